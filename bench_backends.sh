@@ -0,0 +1,48 @@
+#!/bin/sh
+# runs sntploadgen against sntpserver once for each io engine and prints the
+# results side by side. the server is started from a copy of
+# server_config.cfg in a temporary directory with only the engine, port and
+# log level changed.
+#
+# requests are sent open loop at a fixed rate so the latency percentiles of
+# the engines can be compared at the same load, raise the rate until replies
+# start being lost to find the most each engine can sustain.
+#
+# usage: ./bench_backends.sh [seconds] [requests/s] [threads] [ports] [port]
+
+DURATION=${1:-5}
+RATE=${2:-50000}
+THREADS=${3:-1}
+PORTS=${4:-16}
+PORT=${5:-16123}
+LIB_DIR="$(pwd)/build/lib"
+
+if [ ! -x ./sntpserver ] || [ ! -x ./sntploadgen ]; then
+  echo "build sntpserver and sntploadgen first" >&2
+  exit 1
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cp sntpserver "$dir"/
+
+# name, io_engine, batch_size
+for run in "epoll epoll 1" "epoll-batched epoll 32" "io_uring io_uring 1"; do
+  set -- $run
+  sed -e "s/^io_engine = .*/io_engine = \"$2\";/" \
+      -e "s/^batch_size = .*/batch_size = $3;/" \
+      -e "s/^server_port = .*/server_port = $PORT;/" \
+      -e "s/^log_level = .*/log_level = \"warning\";/" \
+      server_config.cfg > "$dir/server_config.cfg"
+
+  (cd "$dir" && LD_LIBRARY_PATH="$LIB_DIR" exec ./sntpserver) &
+  pid=$!
+  sleep 1
+
+  echo "== $1"
+  LD_LIBRARY_PATH="$LIB_DIR" ./sntploadgen -u 127.0.0.1 -p "$PORT" \
+    -r "$RATE" -t "$THREADS" -s "$PORTS" -d "$DURATION"
+
+  kill "$pid"
+  wait "$pid" 2>/dev/null || true
+done
@@ -0,0 +1,72 @@
+#!/bin/sh
+# runs sntploadgen against a single worker sntpserver without authentication,
+# with an HMAC-SHA256 key from ntp.keys and with NTS, and prints how many
+# requests each answered per second of server CPU time. the server is started
+# from a copy of server_config.cfg in a temporary directory along with a
+# self-signed certificate for its NTS-KE service.
+#
+# the CPU time is read from /proc once the load has been sent, so it counts
+# everything the server did for those requests including the system calls.
+# keep the rate below what one core can answer or the lost replies make the
+# figures meaningless.
+#
+# usage: ./bench_nts.sh [seconds] [requests/s] [ports] [port]
+
+DURATION=${1:-5}
+RATE=${2:-20000}
+PORTS=${3:-16}
+PORT=${4:-16123}
+LIB_DIR="$(pwd)/build/lib"
+TICKS=$(getconf CLK_TCK)
+
+if [ ! -x ./sntpserver ] || [ ! -x ./sntploadgen ]; then
+  echo "build sntpserver and sntploadgen first" >&2
+  exit 1
+fi
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cp sntpserver ntp.keys "$dir"/
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes \
+  -days 1 -subj "/CN=localhost" -addext "subjectAltName=IP:127.0.0.1" \
+  -keyout "$dir/nts.key" -out "$dir/nts.crt" 2>/dev/null || exit 1
+
+sed -e "s/^worker_threads = .*/worker_threads = 1;/" \
+    -e "s/^server_port = .*/server_port = $PORT;/" \
+    -e "s/^log_level = .*/log_level = \"warning\";/" \
+    -e "s/^\/\/key_file = .*/key_file = \"ntp.keys\";/" \
+    -e "s/^nts_enabled = .*/nts_enabled = true;/" \
+    server_config.cfg > "$dir/server_config.cfg"
+
+# user and system time of a process in clock ticks
+cpu_ticks() {
+  awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# name, extra loadgen options
+for run in "plain" "hmac -K ntp.keys -k 1" "nts -N -C $dir/nts.crt"; do
+  set -- $run
+  name=$1
+  shift
+
+  (cd "$dir" && LD_LIBRARY_PATH="$LIB_DIR" exec ./sntpserver) &
+  pid=$!
+  sleep 1
+  start=$(cpu_ticks "$pid")
+
+  echo "== $name"
+  LD_LIBRARY_PATH="$LIB_DIR" ./sntploadgen -u 127.0.0.1 -p "$PORT" \
+    -r "$RATE" -s "$PORTS" -d "$DURATION" "$@" | tee "$dir/out"
+  end=$(cpu_ticks "$pid")
+
+  awk -v ticks=$((end - start)) -v hz="$TICKS" '
+    /^sent / { received = $5 }
+    END {
+      if (ticks > 0)
+        printf("server cpu %.2fs, %.0f replies/s per core\n", ticks / hz,
+               received / (ticks / hz))
+    }' "$dir/out"
+
+  kill "$pid"
+  wait "$pid" 2>/dev/null || true
+done
@@ -4,18 +4,6 @@
 #include "reusedlib.h"
 
 
-void convert_ntp_time_into_unix_time(struct ntp_time_t *ntp, struct timeval *epoch)
-{
-    epoch->tv_sec = ntp->second - 0x83AA7E80; // the seconds from Jan 1, 1900 to Jan 1, 1970
-    epoch->tv_usec = (uint32_t)( (double)ntp->fraction * 1.0e6 / (double)(1LL<<32) );
-}
-
-void convert_unix_time_into_ntp_time(struct timeval *epoch, struct ntp_time_t *ntp)
-{
-    ntp->second = epoch->tv_sec + 0x83AA7E80;
-    ntp->fraction = (uint32_t)( (double)(epoch->tv_usec+1) * (double)(1LL<<32) * 1.0e-6 );
-}
-
 int set_socket_recvfrom_timeout(int sockfd, int seconds, int debug){
   struct timeval tv;
 
@@ -47,14 +35,10 @@ config_t setup_config_file(char *config_file){
 }
 
 
-void print_debug(int enable_debug, const char *fmt, ...){
+void print_debug_message(const char *fmt, ...){
   char message[4096];
   va_list args;
 
-  if (enable_debug != 1){
-    return;
-  }
-
   va_start(args, fmt);
   vsnprintf(message, sizeof(message), fmt, args);
   va_end(args);
@@ -1,3 +1,6 @@
+#ifndef REUSEDLIB_H
+#define REUSEDLIB_H
+
 #include "build/include/libconfig.h"
 #include <stdarg.h>
 #include <sys/socket.h>
@@ -15,10 +18,6 @@ struct ntp_time_t {
     uint32_t   fraction;
 };
 
-// http://waitingkuo.blogspot.co.uk/2012/06/conversion-between-ntp-time-and-unix.html
-void convert_ntp_time_into_unix_time(struct ntp_time_t *ntp, struct timeval *epoch);
-void convert_unix_time_into_ntp_time(struct timeval *epoch, struct ntp_time_t *ntp);
-
 // http://stackoverflow.com/questions/2876024/linux-is-there-a-read-or-recv-from-socket-with-timeout
 int set_socket_recvfrom_timeout(int sockfd, int seconds, int debug);
 
@@ -26,4 +25,12 @@ int set_socket_recvfrom_timeout(int sockfd, int seconds, int debug);
 config_t setup_config_file(char *config_file);
 
 // http://stackoverflow.com/questions/14766040/function-arguments-like-printf-in-c
-void print_debug(int enable_debug, const char *fmt, ...);
+void print_debug_message(const char *fmt, ...);
+// the arguments are only evaluated when debug is enabled
+#define print_debug(enable_debug, ...) \
+  do { \
+    if ((enable_debug) == 1) \
+      print_debug_message(__VA_ARGS__); \
+  } while (0)
+
+#endif
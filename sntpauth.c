@@ -0,0 +1,397 @@
+/* sntpauth.c - symmetric key MACs and the table of keys they are made with
+ */
+
+#include "sntpauth.h"
+
+static const char *key_type_names[] = {"SHA256", "AES128", "AES256"};
+
+static int count_key_lines(FILE *file);
+static int parse_key_line(char *line, uint32_t *id, int *type, uint8_t *key,
+                          size_t *key_len);
+static int parse_key(const char *str, uint8_t *key, size_t *key_len);
+static int insert_auth_key(struct key_table *table, uint32_t id, int type,
+                           const uint8_t *key, size_t key_len);
+static void initialise_hmac(struct auth_key *entry, const uint8_t *key,
+                            size_t key_len);
+static void initialise_cmac(struct auth_key *entry, const uint8_t *key,
+                            size_t key_len);
+static void compute_cmac(const struct auth_key *key, const uint8_t *data,
+                         size_t len, uint8_t *digest);
+static void shift_cmac_subkey(const uint8_t *in, uint8_t *out);
+
+
+/*
+  line_num is set to the line of the key file that could not be read
+
+  Return codes:
+    0 - success
+    1 - the file could not be opened or the table allocated
+    2 - a line is not a valid key
+*/
+int load_key_table(struct key_table *table, const char *path, int *line_num){
+  int num_lines;
+  int type;
+  uint32_t id;
+  uint32_t slots;
+  size_t key_len;
+  uint8_t key[AUTH_MAX_KEY_LEN];
+  char line[512];
+  FILE *file;
+
+  memset(table, 0, sizeof(*table));
+  *line_num = 0;
+  if ((file = fopen(path, "r")) == NULL){
+    return 1;
+  }
+
+  // half full at most, so a lookup rarely probes more than one slot
+  num_lines = count_key_lines(file);
+  slots = 2;
+  while (slots < (uint32_t)num_lines * 2){
+    slots <<= 1;
+  }
+  if ((table->keys = calloc(slots, sizeof(struct auth_key))) == NULL){
+    fclose(file);
+    return 1;
+  }
+  table->mask = slots - 1;
+
+  rewind(file);
+  while (fgets(line, sizeof(line), file) != NULL){
+    ++*line_num;
+    switch (parse_key_line(line, &id, &type, key, &key_len)){
+      case 0:
+        if (insert_auth_key(table, id, type, key, key_len) == 0){
+          break;
+        }
+        // fall through, the id is already taken
+      case 2:
+        OPENSSL_cleanse(key, sizeof(key));
+        free_key_table(table);
+        fclose(file);
+        return 2;
+    }
+  }
+  OPENSSL_cleanse(key, sizeof(key));
+  fclose(file);
+  return 0;
+}
+
+
+void free_key_table(struct key_table *table){
+  if (table->keys != NULL){
+    OPENSSL_cleanse(table->keys, (table->mask + 1) * sizeof(struct auth_key));
+  }
+  free(table->keys);
+  table->keys = NULL;
+  table->num_keys = 0;
+}
+
+
+// NULL if there is no key with the id
+const struct auth_key *lookup_auth_key(const struct key_table *table,
+                                       uint32_t id){
+  uint32_t i;
+  const struct auth_key *entry;
+
+  if (table->keys == NULL || id == 0){
+    return NULL;
+  }
+  for (i = id * 2654435761U;; i++){
+    entry = &table->keys[i & table->mask];
+    if (entry->id == id){
+      return entry;
+    }
+    if (entry->id == 0){
+      return NULL;
+    }
+  }
+}
+
+
+/*
+  the MAC of the len bytes at data, the packet and any extension fields, as
+  it is sent after them
+*/
+void compute_ntp_mac(const struct auth_key *key, const void *data, size_t len,
+                     struct ntp_mac *mac){
+  uint32_t id = htonl(key->id);
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256_CTX sha;
+
+  if (key->type == AUTH_KEY_SHA256){
+    // only the padded key was hashed when the key was loaded
+    sha = key->ctx.hmac.inner;
+    SHA256_Update(&sha, data, len);
+    SHA256_Final(digest, &sha);
+    sha = key->ctx.hmac.outer;
+    SHA256_Update(&sha, digest, SHA256_DIGEST_LENGTH);
+    SHA256_Final(digest, &sha);
+  }
+  else{
+    compute_cmac(key, data, len, digest);
+  }
+  memcpy(mac->data, &id, sizeof(id));
+  memcpy(mac->data + sizeof(id), digest, key->digest_len);
+  mac->len = sizeof(id) + key->digest_len;
+}
+
+
+/*
+  checks the MAC found by parse_ntp_packet, key is set to the key it was made
+  with so a reply can be signed with the same one
+
+  Return codes:
+    0 - the MAC matches
+    1 - there is no MAC
+    2 - there is no key with its id
+    3 - the MAC does not match
+*/
+int verify_ntp_mac(const struct key_table *table, const struct ntp_packet *pkt,
+                   const struct ntp_packet_info *info,
+                   const struct auth_key **key){
+  uint32_t id;
+  struct ntp_mac expected;
+
+  *key = NULL;
+  if (info->mac == NULL){
+    return 1;
+  }
+  memcpy(&id, info->mac, sizeof(id));
+  if ((*key = lookup_auth_key(table, ntohl(id))) == NULL){
+    return 2;
+  }
+  compute_ntp_mac(*key, pkt, info->mac - (const uint8_t *)pkt, &expected);
+  // compared in constant time so the digest can not be guessed a byte at a
+  // time from how long a rejection takes
+  if (expected.len != info->mac_len ||
+      CRYPTO_memcmp(expected.data, info->mac, expected.len) != 0){
+    *key = NULL;
+    return 3;
+  }
+  return 0;
+}
+
+
+// an upper bound on the number of keys, used to size the table
+static int count_key_lines(FILE *file){
+  int count = 0;
+  char line[512];
+
+  while (fgets(line, sizeof(line), file) != NULL){
+    count++;
+  }
+  return count;
+}
+
+
+/*
+  Return codes:
+    0 - line holds a key
+    1 - line is blank or a comment
+    2 - line is not a valid key
+*/
+static int parse_key_line(char *line, uint32_t *id, int *type, uint8_t *key,
+                          size_t *key_len){
+  int i;
+  unsigned long value;
+  char *end;
+  char *type_str;
+  char *key_str;
+
+  if ((end = strchr(line, '#')) != NULL){
+    *end = '\0';
+  }
+  if ((end = strtok(line, " \t\r\n")) == NULL){
+    return 1;
+  }
+  errno = 0;
+  value = strtoul(end, &end, 10);
+  if (*end != '\0' || errno != 0 || value == 0 || value > UINT32_MAX){
+    return 2;
+  }
+  *id = value;
+  if ((type_str = strtok(NULL, " \t\r\n")) == NULL ||
+      (key_str = strtok(NULL, " \t\r\n")) == NULL ||
+      strtok(NULL, " \t\r\n") != NULL){
+    return 2;
+  }
+
+  *type = -1;
+  for (i = AUTH_KEY_SHA256; i <= AUTH_KEY_AES256; i++){
+    if (strcasecmp(type_str, key_type_names[i]) == 0){
+      *type = i;
+    }
+  }
+  if (*type == -1 || parse_key(key_str, key, key_len) != 0){
+    return 2;
+  }
+  // CMAC needs exactly the AES key size, HMAC takes any length
+  if ((*type == AUTH_KEY_AES128 && *key_len != 16) ||
+      (*type == AUTH_KEY_AES256 && *key_len != 32) || *key_len == 0){
+    return 2;
+  }
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - not valid hex or longer than AUTH_MAX_KEY_LEN
+*/
+static int parse_key(const char *str, uint8_t *key, size_t *key_len){
+  size_t i;
+  size_t len;
+  unsigned int byte;
+
+  if (strncasecmp(str, "HEX:", 4) != 0){
+    if ((len = strlen(str)) > AUTH_MAX_KEY_LEN){
+      return 1;
+    }
+    memcpy(key, str, len);
+    *key_len = len;
+    return 0;
+  }
+
+  str += 4;
+  len = strlen(str);
+  if (len % 2 != 0 || len / 2 > AUTH_MAX_KEY_LEN){
+    return 1;
+  }
+  for (i = 0; i < len / 2; i++){
+    if (!isxdigit((unsigned char)str[2 * i]) ||
+        !isxdigit((unsigned char)str[2 * i + 1]) ||
+        sscanf(str + 2 * i, "%2x", &byte) != 1){
+      return 1;
+    }
+    key[i] = byte;
+  }
+  *key_len = len / 2;
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the id is already in the table
+*/
+static int insert_auth_key(struct key_table *table, uint32_t id, int type,
+                           const uint8_t *key, size_t key_len){
+  uint32_t i;
+  struct auth_key *entry;
+
+  for (i = id * 2654435761U;; i++){
+    entry = &table->keys[i & table->mask];
+    if (entry->id == id){
+      return 1;
+    }
+    if (entry->id == 0){
+      break;
+    }
+  }
+  entry->id = id;
+  entry->type = type;
+  if (type == AUTH_KEY_SHA256){
+    initialise_hmac(entry, key, key_len);
+  }
+  else{
+    initialise_cmac(entry, key, key_len);
+  }
+  table->num_keys++;
+  return 0;
+}
+
+
+// hashes the key padded with ipad and opad (RFC 2104) ahead of time
+static void initialise_hmac(struct auth_key *entry, const uint8_t *key,
+                            size_t key_len){
+  int i;
+  uint8_t block[SHA256_CBLOCK];
+  uint8_t pad[SHA256_CBLOCK];
+
+  // a key longer than a block is replaced by its digest
+  memset(block, 0, sizeof(block));
+  if (key_len > SHA256_CBLOCK){
+    SHA256(key, key_len, block);
+  }
+  else{
+    memcpy(block, key, key_len);
+  }
+
+  for (i = 0; i < SHA256_CBLOCK; i++){
+    pad[i] = block[i] ^ 0x36;
+  }
+  SHA256_Init(&entry->ctx.hmac.inner);
+  SHA256_Update(&entry->ctx.hmac.inner, pad, SHA256_CBLOCK);
+  for (i = 0; i < SHA256_CBLOCK; i++){
+    pad[i] = block[i] ^ 0x5c;
+  }
+  SHA256_Init(&entry->ctx.hmac.outer);
+  SHA256_Update(&entry->ctx.hmac.outer, pad, SHA256_CBLOCK);
+
+  OPENSSL_cleanse(block, sizeof(block));
+  OPENSSL_cleanse(pad, sizeof(pad));
+  entry->digest_len = AUTH_SHA256_DIGEST_LEN;
+}
+
+
+// expands the AES key and derives the two CMAC subkeys (RFC 4493)
+static void initialise_cmac(struct auth_key *entry, const uint8_t *key,
+                            size_t key_len){
+  uint8_t l[AES_BLOCK_SIZE];
+
+  AES_set_encrypt_key(key, key_len * 8, &entry->ctx.cmac.schedule);
+  memset(l, 0, sizeof(l));
+  AES_encrypt(l, l, &entry->ctx.cmac.schedule);
+  shift_cmac_subkey(l, entry->ctx.cmac.k1);
+  shift_cmac_subkey(entry->ctx.cmac.k1, entry->ctx.cmac.k2);
+  OPENSSL_cleanse(l, sizeof(l));
+  entry->digest_len = AES_BLOCK_SIZE;
+}
+
+
+// CBC-MAC of the blocks with the last one masked by a subkey
+static void compute_cmac(const struct auth_key *key, const uint8_t *data,
+                         size_t len, uint8_t *digest){
+  size_t i;
+  size_t offset;
+  size_t last; // offset of the last block, which may be partial or empty
+  size_t last_len;
+  const uint8_t *subkey;
+
+  last = len == 0 ? 0 : (len - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+  last_len = len - last;
+  memset(digest, 0, AES_BLOCK_SIZE);
+  for (offset = 0; offset < last; offset += AES_BLOCK_SIZE){
+    for (i = 0; i < AES_BLOCK_SIZE; i++){
+      digest[i] ^= data[offset + i];
+    }
+    AES_encrypt(digest, digest, &key->ctx.cmac.schedule);
+  }
+
+  subkey = last_len == AES_BLOCK_SIZE ? key->ctx.cmac.k1 : key->ctx.cmac.k2;
+  for (i = 0; i < AES_BLOCK_SIZE; i++){
+    if (i < last_len){
+      digest[i] ^= data[last + i];
+    }
+    else if (i == last_len){
+      digest[i] ^= 0x80;
+    }
+    digest[i] ^= subkey[i];
+  }
+  AES_encrypt(digest, digest, &key->ctx.cmac.schedule);
+}
+
+
+// out is in shifted left a bit, with Rb added if the top bit fell off
+static void shift_cmac_subkey(const uint8_t *in, uint8_t *out){
+  int i;
+  uint8_t carry = in[0] >> 7;
+
+  for (i = 0; i < AES_BLOCK_SIZE - 1; i++){
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[AES_BLOCK_SIZE - 1] = (in[AES_BLOCK_SIZE - 1] << 1) ^ (carry ? 0x87 : 0);
+}
@@ -0,0 +1,82 @@
+#ifndef SNTPAUTH_H
+#define SNTPAUTH_H
+
+// the key tables are built on the SHA256 and AES calls that work on a state
+// the caller owns, which OpenSSL 3 marks deprecated. they are the only ones
+// that let a precomputed state be copied without an allocation
+#ifndef OPENSSL_API_COMPAT
+#define OPENSSL_API_COMPAT 10101
+#endif
+
+#include "sntpcodec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <strings.h>
+#include <openssl/aes.h>
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+
+/*
+  Symmetric key authentication as in RFC 5905, a MAC of a 4 byte key id and
+  a digest of everything before it follows the packet. Keys are read from a
+  key file into an open addressing table indexed by key id. Everything that
+  only depends on the key is worked out once as it is loaded: the SHA256
+  states after the HMAC inner and outer pads, and the AES key schedule and
+  CMAC subkeys, so a packet only costs the digest of its own 48 bytes. The
+  table is not changed after it is loaded so every thread can share it.
+
+  Each line of the key file is "id type key", the type is one of SHA256
+  (HMAC-SHA256), AES128 or AES256 (AES-CMAC as in RFC 8573) and the key is
+  either ASCII or HEX: followed by the key in hex. # starts a comment.
+*/
+
+enum auth_key_type{
+  AUTH_KEY_SHA256, // HMAC-SHA256, cut to NTP_MAX_MAC_LEN as RFC 7822 asks
+  AUTH_KEY_AES128, // AES-CMAC with a 128 bit key
+  AUTH_KEY_AES256 // AES-CMAC with a 256 bit key
+};
+
+struct auth_key{
+  uint32_t id; // 0 if the slot is unused, 0 is never a valid key id
+  int type; // one of enum auth_key_type
+  size_t digest_len; // bytes of digest sent after the key id
+  union{
+    struct{
+      SHA256_CTX inner; // after the key xor ipad
+      SHA256_CTX outer; // after the key xor opad
+    } hmac;
+    struct{
+      AES_KEY schedule;
+      uint8_t k1[AES_BLOCK_SIZE]; // for a whole last block
+      uint8_t k2[AES_BLOCK_SIZE]; // for a padded last block
+    } cmac;
+  } ctx;
+};
+
+struct key_table{
+  struct auth_key *keys;
+  uint32_t mask;
+  int num_keys;
+};
+
+
+int load_key_table(struct key_table *table, const char *path, int *line_num);
+void free_key_table(struct key_table *table);
+const struct auth_key *lookup_auth_key(const struct key_table *table,
+                                       uint32_t id);
+void compute_ntp_mac(const struct auth_key *key, const void *data, size_t len,
+                     struct ntp_mac *mac);
+int verify_ntp_mac(const struct key_table *table, const struct ntp_packet *pkt,
+                   const struct ntp_packet_info *info,
+                   const struct auth_key **key);
+
+
+// longest key read from a key file, in bytes
+#define AUTH_MAX_KEY_LEN 128
+// HMAC-SHA256 digests are cut to this so the MAC fits NTP_MAX_MAC_LEN
+#define AUTH_SHA256_DIGEST_LEN 20
+
+#endif
@@ -2,34 +2,58 @@
  *
  */
 #include "sntpclient.h"
+#include "sntpmulti.h"
+#include "sntpdaemon.h"
 
+// why replies were thrown away, shown once the client is done
+static struct ntp_reject_counts reply_rejects;
 
 int main( int argc, char * argv[]) {
   int exit_code;
   int counter;
+  int num_polls; // requests to make in repeat mode
+  int burst; // how many of them are part of the initial burst
   int s_counter; // number of successful requests
+  int i;
   int num_available_servers;
-  double offset;
-  double offset_total; // used for average calculation
-  double offset_avg;
-  double error_bound;
-  double error_bound_total; // used for average calculation
-  double error_bound_avg;
-  char *ntp_servers[MANYCAST_MAX_SERVERS]; // addresses of available ntp servers
+  struct filter_sample sample;
+  struct clock_filter filter; // picks the best sample in repeat mode
+  // addresses of available ntp servers
+  char ntp_servers[MANYCAST_MAX_SERVERS][INET_ADDRSTRLEN];
   struct client_settings c_set;
-  struct timeval poll_timer; // tracks time next next poll
+  struct timespec poll_timer; // when the last request was sent
+  struct timespec next_poll;
+  struct interleave_state il_state; // last exchange with the server
 
   s_counter = 0;
-  offset_avg = 0;
-  error_bound_avg = 0;
+  il_state.valid = 0;
+  il_state.sockfd = -1;
+  initialise_clock_filter(&filter);
 
   c_set = get_client_settings(argc, argv);
+  if (select_clock_source(c_set.clock_source, c_set.clock_accuracy,
+                          c_set.debug) != 0){
+    fprintf(stderr, "the clock_source asked for can not be used here, or is "
+            "not within clock_accuracy, using realtime\n");
+    select_clock_source(CLOCK_SOURCE_REALTIME, 0, c_set.debug);
+  }
+
+  // look the server up while everything else is being set up
+  set_resolve_cache_ttl(c_set.resolve_cache_ttl);
+  if (!c_set.manycast_enabled && c_set.server_host != NULL){
+    start_resolving_host(c_set.server_host);
+  }
 
   if (c_set.manycast_enabled){
     exit_code = discover_unicast_servers_with_manycast(&c_set, ntp_servers,
                                                       &num_available_servers);
-    if (exit_code == 0){
-      // use the first server that replied for further unicast operations
+    if (exit_code == 0 && num_available_servers > 1){
+      // every server that replied is polled and the ones to trust are picked
+      // by source selection
+      c_set.multi_server_enabled = 1;
+    }
+    else if (exit_code == 0){
+      // use the only server that replied for further unicast operations
       c_set.server_host = ntp_servers[0];
       print_debug(c_set.debug, "using server '%s' for further unicast "
                                        "operations", c_set.server_host);
@@ -40,44 +64,82 @@ int main( int argc, char * argv[]) {
     }
   }
 
-  // only get the time once if timed repeat updates is disabled
-  if (c_set.timed_repeat_updates_enabled !=1 ){
-    if ((exit_code = unicast_mode(c_set, &offset, &error_bound,
-                                  &poll_timer)) != 0){
+  if (c_set.multi_server_enabled || c_set.daemon_enabled){
+    // every discovered server and the one on the commandline join the
+    // configured ones
+    if (c_set.manycast_enabled){
+      for (i = 0; i < num_available_servers; i++){
+        add_server(&c_set, ntp_servers[i], 0, -1);
+      }
+    }
+    else if (c_set.server_host != NULL){
+      add_server(&c_set, c_set.server_host, 0, -1);
+    }
+    if (c_set.daemon_enabled){
+      return daemon_mode(&c_set) == 0 ? 0 : 1;
+    }
+    return multi_server_mode(&c_set) == 0 ? 0 : 1;
+  }
+  if (c_set.server_host == NULL){
+    fprintf(stderr, "%s: no server given, use -u or -m\n", argv[0]);
+    exit(1);
+  }
+
+  // only get the time once if timed repeat updates and iburst are disabled
+  if (c_set.timed_repeat_updates_enabled !=1 && !c_set.iburst_enabled){
+    if ((exit_code = unicast_mode(c_set, &sample, &poll_timer,
+                                  &il_state)) != 0){
       print_error_message(exit_code);
     }
   }
   else{
-    // request the time from the server timed_repeat_updates_limit amount of times
-    for (counter = 0; counter < c_set.timed_repeat_updates_limit; counter++){
-      // wait the minimum amount of time to poll again for the next time sample,
-      // unless this is the first request.
+    // request the time from the server timed_repeat_updates_limit amount of
+    // times, or as many as the burst if that is more
+    num_polls = c_set.timed_repeat_updates_enabled ?
+                c_set.timed_repeat_updates_limit : 1;
+    burst = c_set.iburst_enabled ? c_set.iburst_count : 0;
+    if (burst > num_polls){
+      num_polls = burst;
+    }
+    for (counter = 0; counter < num_polls; counter++){
+      // sleep until the minimum amount of time to poll again has passed,
+      // unless this is the first request. the polls of the burst only wait
+      // iburst_interval.
       // note that the timer is started in the function unicast_mode when a
       // request is sent
-      while (counter != 0 && get_elapsed_time(poll_timer) <= c_set.poll_wait);
+      if (counter != 0){
+        next_poll = poll_timer;
+        add_seconds_to_timespec(&next_poll, counter < burst ?
+                                c_set.iburst_interval : c_set.poll_wait);
+        sleep_until(&next_poll);
+      }
 
-      if ((exit_code = unicast_mode(c_set, &offset, &error_bound,
-                                    &poll_timer)) != 0){
+      if ((exit_code = unicast_mode(c_set, &sample, &poll_timer,
+                                    &il_state)) != 0){
         print_error_message(exit_code);
       }
       else{
-        offset_total += offset;
-        error_bound_total += error_bound;
+        add_filter_sample(&filter, &sample,
+                          ldexp(1, get_clock_source_precision()));
         s_counter++; // keep track of succesful requests
       }
     }
     // only show statistics if there has been more than zero succesful time
     // samples collected
     if (s_counter > 0){
-      offset_avg = offset_total / s_counter;
-      error_bound_avg = error_bound_total / s_counter;
-      printf("\nStatistics -> offset average: %f, error bound average: +/- %f\n",
-              offset_avg, error_bound_avg);
+      printf("\nStatistics -> %i samples, offset: %f, delay: %f, "
+             "jitter: %f\n", s_counter, filter.offset, filter.delay,
+             filter.jitter);
     }
     else{
       fprintf(stderr, "unable to collect any time samples\n");
     }
   }
+
+  print_reply_rejects();
+  if (il_state.sockfd != -1){
+    close(il_state.sockfd);
+  }
   return 0;
 }
 
@@ -88,31 +150,58 @@ int main( int argc, char * argv[]) {
     2 - host doesnt exist
     3 - cant create socket
     4 - max retry's hit
+    9 - server sent a kiss-o'-death
+    10 - NTS key establishment failed
 */
-int unicast_mode(struct client_settings c_set, double *offset,
-                double *error_bound, struct timeval *poll_timer){
+int unicast_mode(struct client_settings c_set, struct filter_sample *sample,
+                 struct timespec *poll_timer, struct interleave_state *il_state){
   int sockfd; // client socket
   int debug = c_set.debug;
   int exit_code;
-  int rem_time;
+  double rem_time;
   int retry_count;
   int valid_reply;
   int no_recv_error;
+  const char *host;
+  int port;
   struct sockaddr_in reply_addr; // address of the server that has sent the packet
   struct host_info userver; // unicast server to request time from
-  struct ntp_packet request_pkt; // request from client to server
-  struct ntp_packet reply_pkt; // reply from server to client
-  struct core_ts serv_ts; // core times
+  // request from client to server, with its NTS fields when NTS is enabled
+  union ntp_buffer request;
+  size_t request_ext_len;
+  struct ntp_mac request_mac; // sent after it when a key is set
+  union ntp_buffer reply; // reply from server to client
+  size_t reply_len;
+  struct timespec dest_time; // when the reply arrived
+  struct timespec next_poll; // earliest time another request can be sent
+  struct timespec recv_deadline; // when to give up waiting for a reply
+
+  // with NTS the key establishment server can name another server or port
+  host = c_set.server_host;
+  port = c_set.server_port;
+  if (c_set.nts != NULL){
+    if ((exit_code = refill_nts_cookies(&c_set)) != 0){
+      return exit_code;
+    }
+    if (c_set.nts->server[0] != '\0'){
+      host = c_set.nts->server;
+    }
+    if (c_set.nts->port != 0){
+      port = c_set.nts->port;
+    }
+  }
 
-  // setup socket
-  if ((exit_code = initialise_socket(&sockfd, c_set.recv_uni_timeout,
-                                      c_set.debug)) != 0){
+  // setup socket, in interleaved mode the socket from the last poll is reused
+  if (c_set.interleaved_enabled && il_state->sockfd != -1){
+    sockfd = il_state->sockfd;
+  }
+  else if ((exit_code = initialise_socket(&sockfd, c_set.debug)) != 0){
     return exit_code;
   }
 
   // connect to ntp server
-  if ((exit_code = initialise_server_interface(c_set.server_host, c_set.server_port,
-                                          &userver, c_set.debug)) != 0){
+  if ((exit_code = initialise_server_interface(host, port, &userver,
+                                               c_set.debug)) != 0){
     return exit_code;
   }
 
@@ -134,22 +223,35 @@ int unicast_mode(struct client_settings c_set, double *offset,
        is larger number than poll_wait, as the timer starts before the
        request is sent.
     */
-    if (poll_timer->tv_sec != -1 &&
-            get_elapsed_time(*poll_timer) <= c_set.poll_wait){
-      continue;
+    if (poll_timer->tv_sec != -1){
+      sleep_until(&next_poll);
     }
 
-    // build sntp request packet
-    create_packet(&request_pkt);
+    // build sntp request packet, every NTS request uses up a cookie and a
+    // NAK throws them all away
+    create_request(&c_set, il_state, &request.pkt, &request_mac);
+    request_ext_len = 0;
+    if (c_set.nts != NULL){
+      if ((exit_code = refill_nts_cookies(&c_set)) != 0){
+        return exit_code;
+      }
+      request_ext_len = create_nts_request(c_set.nts, &request);
+    }
 
     // start timer
-    *poll_timer = start_timer();
+    get_monotonic_time(poll_timer);
+    next_poll = *poll_timer;
+    add_seconds_to_timespec(&next_poll, c_set.poll_wait);
+    recv_deadline = *poll_timer;
+    add_seconds_to_timespec(&recv_deadline, c_set.recv_uni_timeout);
 
     // send request packet to server
-    if (send_SNTP_packet(&request_pkt, sockfd, userver.addr, debug) != 0){
-      rem_time = c_set.poll_wait - get_elapsed_time(*poll_timer);
+    if (send_SNTP_packet(&request.pkt, request.data + NTP_HEADER_LEN,
+                         request_ext_len, &request_mac, sockfd, userver.addr,
+                         NULL, debug) != 0){
+      rem_time = get_seconds_until(&next_poll);
       print_debug(debug, "error sending request packet, can poll "
-                  "again in %i second(s).",
+                  "again in %.3f second(s).",
                   (rem_time<0)?0:rem_time); // stops rem_time appearing below zero
       retry_count++;
       continue;
@@ -160,11 +262,14 @@ int unicast_mode(struct client_settings c_set, double *offset,
     // until an error occurs
     no_recv_error = 0;
     do {
-      if (recieve_SNTP_packet(sockfd, &reply_pkt, &reply_addr,
-                              &serv_ts.destination_timestamp, c_set.debug) != 0){
-        rem_time = c_set.poll_wait - get_elapsed_time(*poll_timer);
+      // a reply from another server does not extend the time waited
+      if (wait_for_packet(sockfd, &recv_deadline) != 0 ||
+          recieve_SNTP_packet(sockfd, &reply, &reply_len, &reply_addr,
+                              &dest_time, NULL,
+                              c_set.debug) != 0){
+        rem_time = get_seconds_until(&next_poll);
         print_debug(debug, "error receiving reply packet, can poll "
-                    "again in %i second(s).", (rem_time<0)?0:rem_time);
+                    "again in %.3f second(s).", (rem_time<0)?0:rem_time);
         no_recv_error = 1;
       }
     } while( !(no_recv_error) && is_same_ipaddr(userver.addr, reply_addr));
@@ -176,52 +281,250 @@ int unicast_mode(struct client_settings c_set, double *offset,
     }
 
     // check reply packet is valid and trusted
-    if (run_sanity_checks(request_pkt, reply_pkt, c_set) != 0){
-      rem_time = c_set.poll_wait - get_elapsed_time(*poll_timer);
+    if ((exit_code = check_reply(&c_set, &request.pkt, &reply.pkt,
+                                 reply_len)) == 9){
+      return exit_code;
+    }
+    else if (exit_code != 0){
+      rem_time = get_seconds_until(&next_poll);
       print_debug(debug, "error running sanity checks, can poll "
-                  "again in %i second(s).", (rem_time<0)?0:rem_time);
+                  "again in %.3f second(s).", (rem_time<0)?0:rem_time);
       retry_count++;
       continue;
     }
     valid_reply = 1;
   }
 
-  get_timestamps_from_packet_in_epoch_time(&reply_pkt, &serv_ts);
-  *offset = calculate_clock_offset(serv_ts);
-  *error_bound = calculate_error_bound(serv_ts);
-  print_server_results(serv_ts.transmit_timestamp, *offset, *error_bound,
-                       userver, reply_pkt.stratum);
+  record_sample(&c_set, &userver, &request.pkt, &reply.pkt,
+                &dest_time, il_state, sample);
 
-  close(sockfd);
+  // keep the socket open for the next interleaved poll
+  if (c_set.interleaved_enabled){
+    il_state->sockfd = sockfd;
+  }
+  else{
+    close(sockfd);
+  }
   return 0;
 }
 
 
-double calculate_clock_offset(struct core_ts ts){
-  double t1, t2, t3, t4;
+void create_request(struct client_settings *c_set,
+                    struct interleave_state *il_state,
+                    struct ntp_packet *request_pkt,
+                    struct ntp_mac *request_mac){
+  create_packet(request_pkt);
+  if (c_set->interleaved_enabled && il_state->valid){
+    // ask for an interleaved reply by echoing the last exchange back
+    request_pkt->originate_timestamp = il_state->server_receive;
+    request_pkt->receive_timestamp = il_state->client_receive;
+  }
+  sign_request(c_set, request_pkt, request_mac);
+}
 
-  t1 = ts.originate_timestamp.tv_sec + (1.0e-6 * ts.originate_timestamp.tv_usec);
-  t2 = ts.receive_timestamp.tv_sec + (1.0e-6 * ts.receive_timestamp.tv_usec);
-  t3 = ts.transmit_timestamp.tv_sec + (1.0e-6 * ts.transmit_timestamp.tv_usec);
-  t4 = ts.destination_timestamp.tv_sec + (1.0e-6 * ts.destination_timestamp.tv_usec);
 
-  return ((t2 - t1) + (t3 - t4)) / 2;
+// the MAC is left empty when no key is set
+void sign_request(struct client_settings *c_set, struct ntp_packet *request_pkt,
+                  struct ntp_mac *request_mac){
+  request_mac->len = 0;
+  if (c_set->key != NULL){
+    compute_ntp_mac(c_set->key, request_pkt, NTP_HEADER_LEN, request_mac);
+  }
 }
 
 
-double calculate_error_bound(struct core_ts ts){
-  double t1, t2, t3, t4;
+/*
+  runs NTS key establishment with server_host once every cookie has been used
 
-  t1 = ts.originate_timestamp.tv_sec + (1.0e-6 * ts.originate_timestamp.tv_usec);
-  t2 = ts.receive_timestamp.tv_sec + (1.0e-6 * ts.receive_timestamp.tv_usec);
-  t3 = ts.transmit_timestamp.tv_sec + (1.0e-6 * ts.transmit_timestamp.tv_usec);
-  t4 = ts.destination_timestamp.tv_sec + (1.0e-6 * ts.destination_timestamp.tv_usec);
+  Return codes:
+    0 - there is a cookie to send
+    10 - key establishment failed
+*/
+int refill_nts_cookies(struct client_settings *c_set){
+  int ret;
 
-  return (t4 - t1) - (t3 - t2);
+  if (c_set->nts->num_cookies > 0){
+    return 0;
+  }
+  if ((ret = run_nts_ke(c_set->nts, c_set->server_host, c_set->nts_ke_port,
+                        c_set->nts_ca_file, c_set->debug)) != 0){
+    print_debug(c_set->debug, "NTS key establishment with '%s' failed(code=%i)",
+                c_set->server_host, ret);
+    return 10;
+  }
+  return 0;
 }
 
 
-char * convert_epoch_time_to_human_readable(struct timeval epoch_time){
+/*
+  len is the number of bytes received into reply_pkt. with a key set the
+  reply has to be signed with it, a kiss-o'-death that is not could have been
+  sent by anyone and is ignored as RFC 5905 asks. with NTS the reply has to
+  carry an authenticator, its cookies are kept for the next requests. an NTS
+  NAK can not be authenticated, it only has to echo the request's identifier,
+  and the cookies are then dropped so key establishment is run again
+
+  Return codes:
+    0 - reply can be used
+    1 - reply failed the sanity checks
+    9 - server sent a kiss-o'-death
+*/
+int check_reply(struct client_settings *c_set, struct ntp_packet *request_pkt,
+                struct ntp_packet *reply_pkt, size_t len){
+  int reason;
+  const struct auth_key *key;
+  struct ntp_packet_info info;
+
+  reason = validate_ntp_reply(request_pkt, reply_pkt, len, &info);
+  if ((reason == NTP_ACCEPT || reason == NTP_REJECT_KISS) &&
+      c_set->key != NULL &&
+      (verify_ntp_mac(&c_set->keys, reply_pkt, &info, &key) != 0 ||
+       key != c_set->key)){
+    reason = NTP_REJECT_AUTH;
+  }
+  if (reason == NTP_REJECT_KISS && c_set->nts != NULL &&
+      is_nts_nak(reply_pkt, &info, c_set->nts->uid)){
+    print_debug(c_set->debug, "NTS NAK received, cookies are no longer valid");
+    c_set->nts->num_cookies = 0;
+    count_ntp_reject(&reply_rejects, NTP_REJECT_NTS);
+    return 1;
+  }
+  if ((reason == NTP_ACCEPT || reason == NTP_REJECT_KISS) &&
+      c_set->nts != NULL && check_nts_reply(c_set->nts, reply_pkt, &info) != 0){
+    reason = NTP_REJECT_NTS;
+  }
+  if (reason == NTP_ACCEPT){
+    return 0;
+  }
+  count_ntp_reject(&reply_rejects, reason);
+  // stratum 0 is a kiss-o'-death, the server is asking to be left alone so
+  // retrying would only make things worse
+  if (reason == NTP_REJECT_KISS){
+    print_debug(c_set->debug, "kiss-o'-death received(code=%.4s)",
+                (char *)&reply_pkt->reference_identifier);
+    return 9;
+  }
+  print_debug(c_set->debug, "sanity checks failed on - %s",
+              get_ntp_reject_name(reason));
+  return 1;
+}
+
+
+// shows why replies were thrown away, if any were
+void print_reply_rejects(void){
+  char counts[256];
+
+  if (format_ntp_reject_counts(&reply_rejects, counts, sizeof(counts)) > 0){
+    printf("Rejected replies -> %s\n", counts);
+  }
+}
+
+
+/*
+  works out the offset and error bound from a checked reply and shows them,
+  dest_time is when the reply arrived. sample is filled in for the clock filter
+*/
+void record_sample(struct client_settings *c_set, struct host_info *server,
+                   struct ntp_packet *request_pkt, struct ntp_packet *reply_pkt,
+                   struct timespec *dest_time, struct interleave_state *il_state,
+                   struct filter_sample *sample){
+  struct core_ts serv_ts; // core times
+  struct core_ts sample_ts; // times the offset is calculated from
+  struct host_info shown = *server;
+  struct timespec now;
+  struct timespec transmit_time;
+  char server_name[NI_MAXHOST];
+
+  get_timestamps_from_packet(reply_pkt, &serv_ts);
+  serv_ts.destination_timestamp = convert_timespec_into_ntp_time(dest_time);
+  if (is_interleaved_reply(request_pkt, reply_pkt)){
+    // the reply completes the previous exchange with the time the server
+    // really sent its reply, so the offset is worked out from that exchange
+    print_debug(c_set->debug, "interleaved reply received");
+    sample_ts = il_state->prev_ts;
+    sample_ts.transmit_timestamp = serv_ts.transmit_timestamp;
+  }
+  else{
+    sample_ts = serv_ts;
+  }
+  if (c_set->interleaved_enabled){
+    record_interleave_state(il_state, request_pkt, reply_pkt, &serv_ts);
+  }
+
+  sample->offset = calculate_clock_offset(sample_ts);
+  if (c_set->clock != NULL){
+    // samples are timestamped with the system clock, which the disciplined
+    // clock may be ahead of
+    sample->offset -= c_set->clock->get_error(c_set->clock);
+  }
+  // as in RFC 5905 the delay is never less than the clock can measure, on a
+  // fast path timestamp errors could otherwise make it negative and win the
+  // clock filter
+  sample->delay = fmax(calculate_error_bound(sample_ts),
+                       ldexp(1, get_clock_source_precision()));
+  sample->dispersion = get_sample_dispersion(reply_pkt->precision,
+                                             get_clock_source_precision(),
+                                             sample->delay);
+  get_monotonic_time(&now);
+  sample->time = now.tv_sec + now.tv_nsec * 1e-9;
+  // the name is only looked up once there is a result to show it with
+  if (shown.name == NULL && c_set->reverse_lookup &&
+      lookup_host_name(shown.addr.sin_addr, server_name, sizeof(server_name),
+                       c_set->debug) == 0){
+    shown.name = server_name;
+  }
+  // the daemon shows its own status instead of every sample
+  if (!c_set->daemon_enabled || c_set->debug){
+    convert_ntp_time_into_timespec(sample_ts.transmit_timestamp,
+                                   &transmit_time);
+    print_server_results(transmit_time, sample->offset,
+                         sample->delay, shown, reply_pkt->stratum);
+  }
+}
+
+
+/*
+  stores this exchange so the next request can ask for it to be completed in
+  interleaved mode. T1 is taken from the request as the originate field of an
+  interleaved reply holds T4 of the previous exchange instead.
+*/
+void record_interleave_state(struct interleave_state *il_state,
+                             struct ntp_packet *req_pkt,
+                             struct ntp_packet *rep_pkt, struct core_ts *ts){
+  il_state->prev_ts = *ts;
+  il_state->prev_ts.originate_timestamp =
+    read_ntp_timestamp(&req_pkt->transmit_timestamp);
+
+  il_state->server_receive = rep_pkt->receive_timestamp;
+  write_ntp_timestamp(&il_state->client_receive, ts->destination_timestamp);
+  il_state->valid = 1;
+}
+
+
+/*
+  the differences are taken in 32.32 fixed point and only the result is turned
+  into seconds, a double holding a whole timestamp only resolves about 200ns.
+  each half is divided before they are added so the sum cannot overflow
+*/
+double calculate_clock_offset(struct core_ts ts){
+  return convert_ntp_time_into_seconds(
+           get_ntp_time_difference(ts.receive_timestamp,
+                                   ts.originate_timestamp) / 2 +
+           get_ntp_time_difference(ts.transmit_timestamp,
+                                   ts.destination_timestamp) / 2);
+}
+
+
+double calculate_error_bound(struct core_ts ts){
+  return convert_ntp_time_into_seconds(
+           get_ntp_time_difference(ts.destination_timestamp,
+                                   ts.originate_timestamp) -
+           get_ntp_time_difference(ts.transmit_timestamp,
+                                   ts.receive_timestamp));
+}
+
+
+char * convert_epoch_time_to_human_readable(struct timespec epoch_time){
    char *readable_time_string;
    struct tm  ts;
    char time_convertion[35];
@@ -229,43 +532,31 @@ char * convert_epoch_time_to_human_readable(struct timeval epoch_time){
    readable_time_string = (char*)malloc(35);
    ts = *localtime(&epoch_time.tv_sec);
    strftime(time_convertion, sizeof(time_convertion), "%Y-%m-%d %H:%M:%S", &ts);
-   sprintf(readable_time_string, "%s.%06li", time_convertion, epoch_time.tv_usec);
+   sprintf(readable_time_string, "%s.%06li", time_convertion,
+           epoch_time.tv_nsec / 1000);
    return (char *)readable_time_string;
  }
 
 
-void create_packet(struct ntp_packet *pkt){
-  struct ntp_time_t transmit_ts_ntp;
-
-  memset( pkt, 0, sizeof *pkt ); // zero all fields in struct
-
-   // set SNTP V4 and Mode 3(client)
-  pkt->li_vn_mode = (4 << 3) | 3; // (vn << 3) | mode
-
-  transmit_ts_ntp = get_ntp_time_of_day();
-  pkt->transmit_timestamp.second =  htonl(transmit_ts_ntp.second);
-  pkt->transmit_timestamp.fraction = htonl(transmit_ts_ntp.fraction);
- }
-
-
 int discover_unicast_servers_with_manycast(struct client_settings *c_set,
-                                            char *ntp_servers[],
-                                            int *s_count){
+                                           char ntp_servers[][INET_ADDRSTRLEN],
+                                           int *s_count){
   int exit_code;
   int sockfd;
   struct sockaddr_in server; // discovered server
   struct host_info many_grp; // manycast group
   struct ntp_packet request_pkt; // request packet to manycast group
-  struct ntp_packet reply_pkt; // reply packet from a manycast group server
-  struct timeval timer; // use to track amount of time elapsed
+  struct ntp_mac request_mac;
+  union ntp_buffer reply; // reply packet from a manycast group server
+  size_t reply_len;
+  struct timespec deadline; // end of the time to collect replies for
   u_char ttl = 55; // time to live for manycast packets
 
   *s_count = 0;
   print_debug(c_set->debug, "initialising manycast request");
 
   // setup socket
-  if ((exit_code = initialise_socket(&sockfd, MANYCAST_RECV_TIMEOUT,
-                                       c_set->debug)) != 0){
+  if ((exit_code = initialise_socket(&sockfd, c_set->debug)) != 0){
     return exit_code;
   }
 
@@ -281,21 +572,23 @@ int discover_unicast_servers_with_manycast(struct client_settings *c_set,
   }
 
   create_packet(&request_pkt);
+  sign_request(c_set, &request_pkt, &request_mac);
 
   // send an ntp request to the manycast group
-  if (send_SNTP_packet(&request_pkt, sockfd, many_grp.addr,
-                       c_set->debug) != 0){
+  if (send_SNTP_packet(&request_pkt, NULL, 0, &request_mac, sockfd,
+                       many_grp.addr, NULL, c_set->debug) != 0){
     print_debug(c_set->debug, "error sending manycast request packet");
     return 5;
   }
 
-  timer = start_timer();
+  get_monotonic_time(&deadline);
+  add_seconds_to_timespec(&deadline, c_set->manycast_wait_time);
   // gather server replies for a set time
-  while (get_elapsed_time(timer) <= c_set->manycast_wait_time){
+  while (wait_for_packet(sockfd, &deadline) == 0){
     // listen for a server
-    if (recieve_SNTP_packet(sockfd, &reply_pkt, &server, NULL,
-                            c_set->debug) != 0){
-      print_debug(c_set->debug, "no replys from any server");
+    if (recieve_SNTP_packet(sockfd, &reply, &reply_len, &server, NULL,
+                            NULL, c_set->debug) != 0){
+      print_debug(c_set->debug, "error receiving reply from a server");
       continue;
     }
 
@@ -303,16 +596,19 @@ int discover_unicast_servers_with_manycast(struct client_settings *c_set,
                 inet_ntoa( server.sin_addr));
 
     // check the reply packet to test the state/health of the server
-    if (run_sanity_checks(request_pkt, reply_pkt, *c_set) != 0){
+    if (check_reply(c_set, &request_pkt, &reply.pkt, reply_len) != 0){
       print_debug(c_set->debug, "server '%s' failed sanity checks, "
                  "discarding server", inet_ntoa( server.sin_addr));
       continue;
     }
 
-    ntp_servers[*s_count] = inet_ntoa( server.sin_addr);
+    strcpy(ntp_servers[*s_count], inet_ntoa( server.sin_addr));
     ++*s_count; // inc number of servers found
     print_debug(c_set->debug, "server '%s' is approved",
                 inet_ntoa( server.sin_addr));
+    if (*s_count == MANYCAST_MAX_SERVERS){
+      break;
+    }
   }
 
   // return an error if no servers are found
@@ -336,6 +632,7 @@ struct client_settings get_client_settings(int argc, char * argv[]){
   struct client_settings c_set;
 
   // set relevant settings to their defaults
+  c_set.server_host = NULL;
   c_set.server_port = DEFAULT_SERVER_PORT;
   c_set.debug = DEFAULT_DEBUG;
   c_set.recv_uni_timeout = DEFAULT_RECV_TIMEOUT;
@@ -343,8 +640,34 @@ struct client_settings get_client_settings(int argc, char * argv[]){
   c_set.poll_wait = DEFAULT_MIN_POLL_WAIT;
   c_set.timed_repeat_updates_enabled = DEFAULT_REPEAT_UPDATES_ENABLED;
   c_set.timed_repeat_updates_limit = DEFAULT_REPEAT_UPDATE_LIMIT;
+  c_set.iburst_enabled = DEFAULT_IBURST_ENABLED;
+  c_set.iburst_count = DEFAULT_IBURST_COUNT;
+  c_set.iburst_interval = DEFAULT_IBURST_INTERVAL;
+  c_set.manycast_enabled = 0;
   c_set.manycast_address = DEFAULT_MANYCAST_ADDRESS;
   c_set.manycast_wait_time = DEFAULT_MANYCAST_WAIT_TIME;
+  c_set.interleaved_enabled = DEFAULT_INTERLEAVED_ENABLED;
+  c_set.reverse_lookup = DEFAULT_REVERSE_LOOKUP;
+  c_set.resolve_cache_ttl = DEFAULT_RESOLVE_CACHE_TTL;
+  c_set.multi_server_enabled = DEFAULT_MULTI_SERVER_ENABLED;
+  c_set.num_servers = 0;
+  c_set.daemon_enabled = DEFAULT_DAEMON_ENABLED;
+  c_set.clock_simulated = 0;
+  c_set.simulated_offset = DEFAULT_SIMULATED_OFFSET;
+  c_set.simulated_drift = DEFAULT_SIMULATED_DRIFT;
+  c_set.step_threshold = DEFAULT_STEP_THRESHOLD;
+  c_set.stepout = DEFAULT_STEPOUT;
+  c_set.panic_threshold = DEFAULT_PANIC_THRESHOLD;
+  c_set.poll_min = DEFAULT_POLL_MIN;
+  c_set.poll_max = DEFAULT_POLL_MAX;
+  c_set.clock = NULL;
+  c_set.clock_source = DEFAULT_CLOCK_SOURCE;
+  c_set.clock_accuracy = DEFAULT_CLOCK_ACCURACY;
+  memset(&c_set.keys, 0, sizeof(c_set.keys));
+  c_set.key = NULL;
+  c_set.nts = NULL;
+  c_set.nts_ke_port = DEFAULT_NTS_KE_PORT;
+  c_set.nts_ca_file = NULL;
 
   // dont parse config file if it doesnt exist
   if (0 == access(CONFIG_FILE, 0)){
@@ -358,80 +681,95 @@ struct client_settings get_client_settings(int argc, char * argv[]){
   // update setting by arguments define din the commandline
   parse_command_line(argc, argv, &c_set);
 
-  return c_set;
- }
-
-
-int get_elapsed_time(struct timeval start_time){
-   struct timeval end_time;
+  if (c_set.recv_uni_timeout <= 0 || c_set.poll_wait < 0 ||
+      c_set.manycast_wait_time <= 0){
+    print_debug(c_set.debug, "timeouts and waits must be positive, using the "
+                "defaults");
+    c_set.recv_uni_timeout = DEFAULT_RECV_TIMEOUT;
+    c_set.poll_wait = DEFAULT_MIN_POLL_WAIT;
+    c_set.manycast_wait_time = DEFAULT_MANYCAST_WAIT_TIME;
+  }
+  // the filter only keeps CLOCK_FILTER_STAGES samples, a longer burst is
+  // wasted on it
+  if (c_set.iburst_count < 1 || c_set.iburst_count > CLOCK_FILTER_STAGES ||
+      c_set.iburst_interval <= 0){
+    print_debug(c_set.debug, "iburst_count must be from 1 to %i and "
+                "iburst_interval positive, using the defaults",
+                CLOCK_FILTER_STAGES);
+    c_set.iburst_count = DEFAULT_IBURST_COUNT;
+    c_set.iburst_interval = DEFAULT_IBURST_INTERVAL;
+  }
+  if (c_set.step_threshold <= 0 || c_set.stepout < 0 ||
+      c_set.panic_threshold <= c_set.step_threshold){
+    print_debug(c_set.debug, "invalid step thresholds or stepout, using the "
+                "defaults");
+    c_set.step_threshold = DEFAULT_STEP_THRESHOLD;
+    c_set.stepout = DEFAULT_STEPOUT;
+    c_set.panic_threshold = DEFAULT_PANIC_THRESHOLD;
+  }
+  // the poll counter grows by the log2 of the interval, so 1 second would
+  // never move it
+  if (c_set.poll_min < 2 || c_set.poll_max < c_set.poll_min ||
+      c_set.poll_max > ldexp(1, DISCIPLINE_MAXPOLL)){
+    print_debug(c_set.debug, "poll_min and poll_max must be from 2 to %.0f "
+                "seconds, using the defaults", ldexp(1, DISCIPLINE_MAXPOLL));
+    c_set.poll_min = DEFAULT_POLL_MIN;
+    c_set.poll_max = DEFAULT_POLL_MAX;
+  }
+  // the cookies are kept for one server, and a reply can not be both
+  // signed with a key and NTS authenticated
+  if (c_set.nts != NULL &&
+      (c_set.manycast_enabled || c_set.multi_server_enabled ||
+       c_set.daemon_enabled || c_set.key != NULL)){
+    fprintf(stderr, "nts_enabled only works with a single unicast server and "
+            "without key_id\n");
+    exit(1);
+  }
 
-   gettimeofday(&end_time, NULL);
-   return end_time.tv_sec - start_time.tv_sec;
+  return c_set;
  }
 
 
-void get_timestamps_from_packet_in_epoch_time(struct ntp_packet *pkt,
-                                              struct core_ts *ts ){
-  struct ntp_time_t originate_timestamp_ntp;
-  struct ntp_time_t receive_timestamp_ntp;
-  struct ntp_time_t transmit_timestamp_ntp;
-
-  originate_timestamp_ntp.second = ntohl(pkt->originate_timestamp.second);
-  originate_timestamp_ntp.fraction = ntohl(pkt->originate_timestamp.fraction);
-  convert_ntp_time_into_unix_time(&originate_timestamp_ntp, &ts->originate_timestamp);
-
-  receive_timestamp_ntp.second = ntohl(pkt->receive_timestamp.second);
-  receive_timestamp_ntp.fraction = ntohl(pkt->receive_timestamp.fraction);
-  convert_ntp_time_into_unix_time(&receive_timestamp_ntp, &ts->receive_timestamp);
-
-  transmit_timestamp_ntp.second = ntohl(pkt->transmit_timestamp.second);
-  transmit_timestamp_ntp.fraction = ntohl(pkt->transmit_timestamp.fraction);
-  convert_ntp_time_into_unix_time(&transmit_timestamp_ntp, &ts->transmit_timestamp);
+void get_timestamps_from_packet(struct ntp_packet *pkt, struct core_ts *ts){
+  ts->originate_timestamp = read_ntp_timestamp(&pkt->originate_timestamp);
+  ts->receive_timestamp = read_ntp_timestamp(&pkt->receive_timestamp);
+  ts->transmit_timestamp = read_ntp_timestamp(&pkt->transmit_timestamp);
 }
 
 
-int initialise_socket(int *sockfd, int recv_uni_timeout, int debug){
+/*
+  the socket is left blocking without a receive timeout, every receive waits
+  for the socket with a deadline first
+*/
+int initialise_socket(int *sockfd, int debug){
   if( (*sockfd = socket( AF_INET, SOCK_DGRAM, 0)) == -1) {
     print_debug(debug, "error creating socket\n");
     return 3;
   }
 
-  if (set_socket_recvfrom_timeout(*sockfd, recv_uni_timeout, debug) !=0){
-    print_debug(debug, "error setting socket timeout");
-    return 8;
-  }
+  // a failure here is not fatal, the time after receiving is used instead
+  enable_recv_timestamps(*sockfd, debug);
   return 0;
 }
 
 
+/*
+  an address is used as it is, a hostname is resolved or taken from the cache.
+  cn->name is left NULL for an address, its name is only looked up on demand.
+*/
 int initialise_server_interface(const char *host, int port, struct host_info *cn,
                             int debug){
-  struct hostent *he;
   struct in_addr ipaddr;
 
-  // check if address given is a ipaddress or hostname and check for existence
-  if (inet_pton(AF_INET, host, &ipaddr) != 0){
-    // is ipv4
-    if( (he = gethostbyaddr(&ipaddr, sizeof(ipaddr),AF_INET)) == NULL){
-      print_debug(debug, "unicast server not found");
-      return 2;
-    }
-
-    cn->name = he->h_name;
-  }
-  else{
-    // assume address is a hostname
-    if( (he = gethostbyname( host)) == NULL) {
-      print_debug(debug, "unicast server not found");
-      return 2;
-    }
-    cn->name = host;
+  memset( &cn->addr,0, sizeof cn->addr); /* zero struct */
+  if (resolve_host(host, &cn->addr.sin_addr, debug) != 0){
+    print_debug(debug, "unicast server not found");
+    return 2;
   }
+  cn->name = inet_pton(AF_INET, host, &ipaddr) == 1 ? NULL : host;
 
-  memset( &cn->addr,0, sizeof cn->addr); /* zero struct */
   cn->addr.sin_family = AF_INET;    /* host byte order .. */
   cn->addr.sin_port = htons( port); /* .. short, netwk byte order */
-  cn->addr.sin_addr = *((struct in_addr *)he -> h_addr);
   return 0;
  }
 
@@ -454,7 +792,7 @@ void parse_command_line(int argc, char * argv[], struct client_settings *c_set){
   uni_set = 0;
   many_set = 0;
   while (optind < argc) {
-    if ((c = getopt(argc, argv, "u:mp:dr:")) != -1) {
+    if ((c = getopt(argc, argv, "u:mp:dr:aDi")) != -1) {
       switch(c) {
         case 'u':
           c_set->server_host = optarg;
@@ -475,6 +813,18 @@ void parse_command_line(int argc, char * argv[], struct client_settings *c_set){
           c_set->debug = 1;
           break;
 
+        case 'a':
+          c_set->multi_server_enabled = 1;
+          break;
+
+        case 'D':
+          c_set->daemon_enabled = 1;
+          break;
+
+        case 'i':
+          c_set->iburst_enabled = 1;
+          break;
+
         case 'r':
           c_set->timed_repeat_updates_enabled = 1;
           c_set->timed_repeat_updates_limit = atoi(optarg);
@@ -500,25 +850,182 @@ void parse_command_line(int argc, char * argv[], struct client_settings *c_set){
 
 
 void parse_config_file(struct client_settings *c_set){
+  int i;
+  const char *clock;
+  const char *clock_source;
+  const char *key_file;
+  int line_num;
+  long long key_id;
+  int nts_enabled;
   config_t cfg;
+  config_setting_t *list;
 
   cfg = setup_config_file(CONFIG_FILE); // get config file options
 
   // set the manycast address if manycast is enabled via the commandline
   config_lookup_string(&cfg, "manycast_address", &c_set->manycast_address);
-  config_lookup_int(&cfg, "manycast_wait_time", &c_set->manycast_wait_time);
+  lookup_config_number(&cfg, "manycast_wait_time", &c_set->manycast_wait_time);
 
   config_lookup_int(&cfg, "server_port", &c_set->server_port);
   // set unicast socket timeout
-  config_lookup_int(&cfg, "recv_uni_timeout", &c_set->recv_uni_timeout);
+  lookup_config_number(&cfg, "recv_uni_timeout", &c_set->recv_uni_timeout);
   // set max unicast retry limit
   config_lookup_int(&cfg, "max_unicast_retries", &c_set->max_unicast_retries);
   // set minimum time till polling the same server again
-  config_lookup_int(&cfg, "poll_wait", &c_set->poll_wait);
+  lookup_config_number(&cfg, "poll_wait", &c_set->poll_wait);
+  // burst of polls on the first contact with a server
+  config_lookup_bool(&cfg, "iburst_enabled", &c_set->iburst_enabled);
+  config_lookup_int(&cfg, "iburst_count", &c_set->iburst_count);
+  lookup_config_number(&cfg, "iburst_interval", &c_set->iburst_interval);
+  // ask for interleaved replies when polling the same server repeatedly
+  config_lookup_bool(&cfg, "interleaved_enabled", &c_set->interleaved_enabled);
+  // name lookups
+  config_lookup_bool(&cfg, "reverse_lookup", &c_set->reverse_lookup);
+  lookup_config_number(&cfg, "resolve_cache_ttl", &c_set->resolve_cache_ttl);
+
+  // servers polled together in multi server mode
+  config_lookup_bool(&cfg, "multi_server_enabled", &c_set->multi_server_enabled);
+  if ((list = config_lookup(&cfg, "servers")) != NULL){
+    for (i = 0; i < config_setting_length(list); i++){
+      if (parse_server_entry(config_setting_get_elem(list, i), c_set) != 0){
+        fprintf(stderr, "invalid entry %i in servers\n", i + 1);
+        exit(1);
+      }
+    }
+  }
+
+  // daemon mode and the clock discipline
+  config_lookup_bool(&cfg, "daemon_enabled", &c_set->daemon_enabled);
+  if (config_lookup_string(&cfg, "clock", &clock)){
+    if (strcmp(clock, "simulated") == 0){
+      c_set->clock_simulated = 1;
+    }
+    else if (strcmp(clock, "system") == 0){
+      c_set->clock_simulated = 0;
+    }
+    else{
+      fprintf(stderr, "unknown clock '%s', using the default\n", clock);
+    }
+  }
+  lookup_config_number(&cfg, "simulated_offset", &c_set->simulated_offset);
+  lookup_config_number(&cfg, "simulated_drift", &c_set->simulated_drift);
+  lookup_config_number(&cfg, "step_threshold", &c_set->step_threshold);
+  lookup_config_number(&cfg, "stepout", &c_set->stepout);
+  lookup_config_number(&cfg, "panic_threshold", &c_set->panic_threshold);
+  lookup_config_number(&cfg, "poll_min", &c_set->poll_min);
+  lookup_config_number(&cfg, "poll_max", &c_set->poll_max);
+
+  // where timestamps are read from
+  if (config_lookup_string(&cfg, "clock_source", &clock_source) &&
+      parse_clock_source(clock_source, &c_set->clock_source) != 0){
+    fprintf(stderr, "unknown clock_source '%s', using the default\n",
+            clock_source);
+  }
+  lookup_config_number(&cfg, "clock_accuracy", &c_set->clock_accuracy);
+
+  // symmetric key authentication, the same key is used with every server
+  if (config_lookup_string(&cfg, "key_file", &key_file)){
+    switch (load_key_table(&c_set->keys, key_file, &line_num)){
+      case 1:
+        fprintf(stderr, "unable to read key file '%s'\n", key_file);
+        exit(1);
+      case 2:
+        fprintf(stderr, "invalid key on line %i of '%s'\n", line_num,
+                key_file);
+        exit(1);
+    }
+  }
+  if (config_lookup_int64(&cfg, "key_id", &key_id) && key_id != 0){
+    if (key_id < 0 || key_id > UINT32_MAX ||
+        (c_set->key = lookup_auth_key(&c_set->keys, key_id)) == NULL){
+      fprintf(stderr, "key_id %lli is not in the key file\n", key_id);
+      exit(1);
+    }
+  }
+
+  // network time security, the cookies are fetched on the first request
+  nts_enabled = DEFAULT_NTS_ENABLED;
+  config_lookup_bool(&cfg, "nts_enabled", &nts_enabled);
+  if (nts_enabled &&
+      (c_set->nts = calloc(1, sizeof(struct nts_client))) == NULL){
+    fprintf(stderr, "unable to allocate NTS state\n");
+    exit(1);
+  }
+  config_lookup_int(&cfg, "nts_ke_port", &c_set->nts_ke_port);
+  config_lookup_string(&cfg, "nts_ca_file", &c_set->nts_ca_file);
 }
 
 
-void print_server_results(struct timeval transmit_time, double offset,
+/*
+  an entry is either a string of "host" or "host:port", or a group with a
+  host and optionally a port and a poll_wait of its own
+
+  Return codes:
+    0 - success
+    1 - entry is invalid or there are too many servers
+*/
+int parse_server_entry(config_setting_t *entry, struct client_settings *c_set){
+  int port = 0;
+  double poll_wait = -1;
+  char *host;
+  char *sep;
+  const char *str;
+  config_setting_t *member;
+
+  if ((str = config_setting_get_string(entry)) != NULL){
+    if ((host = strdup(str)) == NULL){
+      return 1;
+    }
+    // a single colon separates the port, an ipv6 address would have several
+    if ((sep = strchr(host, ':')) != NULL && strchr(sep + 1, ':') == NULL){
+      *sep = '\0';
+      if ((port = atoi(sep + 1)) <= 0 || port > 65535){
+        free(host);
+        return 1;
+      }
+    }
+    return add_server(c_set, host, port, poll_wait);
+  }
+
+  if (!config_setting_is_group(entry) ||
+      !config_setting_lookup_string(entry, "host", &str)){
+    return 1;
+  }
+  config_setting_lookup_int(entry, "port", &port);
+  // whole and fractional seconds are both accepted
+  if ((member = config_setting_get_member(entry, "poll_wait")) != NULL){
+    poll_wait = config_setting_type(member) == CONFIG_TYPE_INT ?
+                config_setting_get_int(member) : config_setting_get_float(member);
+    if (poll_wait < 0){
+      return 1;
+    }
+  }
+  if (port < 0 || port > 65535){
+    return 1;
+  }
+  return add_server(c_set, str, port, poll_wait);
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - too many servers
+*/
+int add_server(struct client_settings *c_set, const char *host, int port,
+               double poll_wait){
+  if (c_set->num_servers >= MAX_SERVERS){
+    return 1;
+  }
+  c_set->servers[c_set->num_servers].host = host;
+  c_set->servers[c_set->num_servers].port = port;
+  c_set->servers[c_set->num_servers].poll_wait = poll_wait;
+  c_set->num_servers++;
+  return 0;
+}
+
+
+void print_server_results(struct timespec transmit_time, double offset,
                           double error_bound, struct host_info cn,
                           int stratum){
   char *time_str;
@@ -557,75 +1064,14 @@ void print_error_message(int error_code){
     case 7:
       fprintf( stderr, "%s cant set ttl for manycast request\n", msg_start);
       break;
-    case 8:
-      fprintf( stderr, "%s cant set recv timeout for socket\n", msg_start);
+    case 9:
+      fprintf( stderr, "%s server sent a kiss-o'-death, not polling it\n",
+               msg_start);
+      break;
+    case 10:
+      fprintf( stderr, "%s NTS key establishment failed\n", msg_start);
       break;
     default:
       fprintf( stderr,"%s unknown(code=%i)\n", msg_start, error_code);
   }
 }
-
-
-int run_sanity_checks(struct ntp_packet req_pkt, struct ntp_packet rep_pkt,
-                      struct client_settings c_set){
-  int rep_mode;
-  int rep_version;
-  int req_version;
-  char error_msg[100] = "sanity checks failed on -";
-
-  rep_mode = rep_pkt.li_vn_mode & 0x7; // extract first 3 bits
-  req_version = (req_pkt.li_vn_mode >> 3) & 0x7; // extract bits 3 to 5
-  rep_version = (rep_pkt.li_vn_mode >> 3) & 0x7; // extract bits 3 to 5
-
-  // the originate time in the server reply should be the same as the transmit
-  // time in the request
-  if ((req_pkt.transmit_timestamp.second != rep_pkt.originate_timestamp.second) ||
-        (req_pkt.transmit_timestamp.fraction != rep_pkt.originate_timestamp.fraction)){
-    print_debug(c_set.debug, "%s originate time in the server reply does not "
-             "match the transmit time in the request.", error_msg);
-    return 1;
-  }
-
-  // check stratum is in range
-  else if (rep_pkt.stratum < 0 || rep_pkt.stratum > 15){
-    print_debug(c_set.debug, "%s stratum is not in range 0 to 15(stratum=%i)",
-                        error_msg, rep_pkt.stratum);
-    return 1;
-  }
-
-  // transmit time in the reply packet cant be zero
-  else if (rep_pkt.transmit_timestamp.second == 0 &&
-                rep_pkt.transmit_timestamp.fraction == 0){
-    print_debug(c_set.debug, "%s transmit time of reply packet is zero",
-                        error_msg);
-    return 1;
-  }
-
-  // check mode is 4(server)
-  else if (rep_mode != 4){
-    print_debug(c_set.debug, "%s mode of reply packet is not server(mode=%i)",
-                        error_msg, rep_mode);
-    return 1;
-  }
-
-  // server must be the same version as the client. This check irradicates
-  // the need to check if the version is non-zero as the client can never
-  // be non-zero.
-  else if (req_version != rep_version){
-    print_debug(c_set.debug, "%s server should be of the same version "
-                        "as the client", error_msg);
-    return 1;
-  }
-
-  return 0;
-
-
-}
-
-
-struct timeval start_timer(){
-  struct timeval start_time;
-
-  gettimeofday(&start_time, NULL);
-  return start_time;
-}
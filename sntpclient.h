@@ -1,4 +1,13 @@
+#ifndef SNTPCLIENT_H
+#define SNTPCLIENT_H
+
 #include "sntptools.h"
+#include "sntpsched.h"
+#include "sntpresolve.h"
+#include "sntpfilter.h"
+#include "sntpdiscipline.h"
+#include "sntpauth.h"
+#include "sntpnts.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,14 +17,33 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <netdb.h>         /* for gethostbyname() */
 
-// stores commonly used timestamps in epoch time
+// stores commonly used timestamps as 32.32 NTP time in host order
 struct core_ts {
-  struct timeval originate_timestamp;
-  struct timeval receive_timestamp;
-  struct timeval transmit_timestamp;
-  struct timeval destination_timestamp;
+  uint64_t originate_timestamp;
+  uint64_t receive_timestamp;
+  uint64_t transmit_timestamp;
+  uint64_t destination_timestamp;
+};
+
+// kept between polls of the same server for interleaved mode, where the reply
+// to a request carries the real send time of the reply before it
+struct interleave_state{
+  int valid; // an exchange has been recorded
+  int sockfd; // reused so the server sees the same client on every poll
+  struct ntp_time_t server_receive; // T2 of the last reply, network order
+  struct ntp_time_t client_receive; // T4 of the last reply, network order
+  struct core_ts prev_ts; // T1, T2 and T4 of the last exchange
+};
+
+// the maximum number of servers polled in multi server mode
+#define MAX_SERVERS 16
+
+// a server to poll in multi server mode
+struct server_config{
+  const char *host;
+  int port; // 0 uses server_port
+  double poll_wait; // seconds, below 0 uses poll_wait
 };
 
 // stores all crucial settings for the client
@@ -23,14 +51,46 @@ struct client_settings{
   char *server_host;
   int server_port;
   int debug;
-  int recv_uni_timeout;   //seconds
+  double recv_uni_timeout;   //seconds
   int max_unicast_retries;
-  int poll_wait;  // seconds
+  double poll_wait;  // seconds
   int timed_repeat_updates_enabled;
   int timed_repeat_updates_limit;
+  int iburst_enabled; // start with a burst of polls close together
+  int iburst_count;
+  double iburst_interval; // seconds between the polls of the burst
   int manycast_enabled;
-  int manycast_wait_time; // seconds
+  double manycast_wait_time; // seconds
   const char *manycast_address;
+  int interleaved_enabled;
+  int reverse_lookup; // look up the name of a server given as an address
+  double resolve_cache_ttl; // seconds
+  int multi_server_enabled; // poll every server at once
+  int num_servers;
+  struct server_config servers[MAX_SERVERS];
+  int daemon_enabled; // keep polling and discipline the clock
+  int clock_simulated; // discipline a simulated clock instead of the system's
+  double simulated_offset; // seconds the simulated clock starts ahead
+  double simulated_drift; // ppm the simulated clock gains
+  double step_threshold; // seconds
+  double stepout; // seconds
+  double panic_threshold; // seconds
+  double poll_min; // seconds between daemon polls, a power of two
+  double poll_max; // seconds
+  // the clock being disciplined in daemon mode, offsets are measured against
+  // it. NULL otherwise
+  struct local_clock *clock;
+  int clock_source; // one of enum clock_source_type, timestamps are read from
+  double clock_accuracy; // seconds, the worst precision auto will pick
+  struct key_table keys; // read from key_file, empty if it is not set
+  // signs every request and replies have to be signed with it, NULL when
+  // key_id is not set
+  const struct auth_key *key;
+  // keys and cookies from NTS key establishment with server_host, NULL
+  // unless nts_enabled. it is shared by every copy of the settings
+  struct nts_client *nts;
+  int nts_ke_port;
+  const char *nts_ca_file; // NULL trusts the system's certificates
 };
 
 
@@ -55,13 +115,33 @@ struct client_settings{
 // seconds to wait for a server response
 #define DEFAULT_RECV_TIMEOUT 10
 // when enabled the time is fetched multiple times from the same server and
-// an average of the offset and error bound is shown
+// the sample with the lowest distance is picked by the clock filter
 #define DEFAULT_REPEAT_UPDATES_ENABLED 0
-// the maximum number of times to fetch the server time. note the higher the
-// value here, the greater accuracy of average clock offset and error bound
+// the maximum number of times to fetch the server time. the clock filter keeps
+// the last CLOCK_FILTER_STAGES, more give it a better chance of a quiet path
 #define DEFAULT_REPEAT_UPDATE_LIMIT 4
+// on the first contact with a server send a burst of iburst_count polls
+// iburst_interval seconds apart, so the filter is full within seconds
+#define DEFAULT_IBURST_ENABLED 0
+#define DEFAULT_IBURST_COUNT 6
+#define DEFAULT_IBURST_INTERVAL 2
+// ask the server for interleaved replies on repeat polls
+#define DEFAULT_INTERLEAVED_ENABLED 0
+// show the name of a server given as an address, this costs a reverse lookup
+#define DEFAULT_REVERSE_LOOKUP 0
+// seconds a resolved server address is reused for
+#define DEFAULT_RESOLVE_CACHE_TTL 300
+// poll every configured and discovered server instead of just one
+#define DEFAULT_MULTI_SERVER_ENABLED 0
+// keep running and discipline the clock
+#define DEFAULT_DAEMON_ENABLED 0
+// the simulated clock starts this far ahead and gains this many ppm
+#define DEFAULT_SIMULATED_OFFSET 0
+#define DEFAULT_SIMULATED_DRIFT 0
+// network time security, only for a single unicast server
+#define DEFAULT_NTS_ENABLED 0
+#define DEFAULT_NTS_KE_PORT NTS_KE_PORT
 
-#define MANYCAST_RECV_TIMEOUT 1
 // the maximum number of servers to store from a manycast request
 #define MANYCAST_MAX_SERVERS 10
 
@@ -69,26 +149,42 @@ struct client_settings{
 
 double calculate_clock_offset(struct core_ts ts);
 double calculate_error_bound(struct core_ts ts);
-char * convert_epoch_time_to_human_readable(struct timeval epoch_time);
-void create_packet(struct ntp_packet *pkt);
+char * convert_epoch_time_to_human_readable(struct timespec epoch_time);
+int add_server(struct client_settings *c_set, const char *host, int port,
+               double poll_wait);
 int discover_unicast_servers_with_manycast(struct client_settings *c_set,
-                                           char *ntp_servers[], int *s_count);
+                                           char ntp_servers[][INET_ADDRSTRLEN],
+                                           int *s_count);
 struct client_settings get_client_settings(int argc, char * argv[]);
-int get_elapsed_time(struct timeval start_time);
-void get_timestamps_from_packet_in_epoch_time(struct ntp_packet *pkt,
-                                              struct core_ts *ts );
+void get_timestamps_from_packet(struct ntp_packet *pkt, struct core_ts *ts);
 int initialise_server_interface(const char *host, int port, struct host_info *cn,
                                 int debug);
-int initialise_socket(int *sockfd, int recv_uni_timeout, int debug);
+int initialise_socket(int *sockfd, int debug);
 int is_same_ipaddr(struct sockaddr_in sent_addr, struct sockaddr_in reply_addr);
+int parse_server_entry(config_setting_t *entry, struct client_settings *c_set);
 void parse_command_line(int argc, char * argv[], struct client_settings *c_set);
 void parse_config_file(struct client_settings *c_set);
-void print_debug(int enable_debug, const char *fmt, ...);
-void print_server_results(struct timeval transmit_time, double offset,
+void print_server_results(struct timespec transmit_time, double offset,
                           double error_bound, struct host_info cn, int stratum);
 void print_error_message(int error_code);
-int run_sanity_checks(struct ntp_packet req_pkt, struct ntp_packet rep_pkt,
-                      struct client_settings c_set);
-struct timeval start_timer();
-int unicast_mode(struct client_settings c_set, double *offset,
-                 double *error_bound, struct timeval *poll_timer);
+int unicast_mode(struct client_settings c_set, struct filter_sample *sample,
+                 struct timespec *poll_timer, struct interleave_state *il_state);
+void create_request(struct client_settings *c_set,
+                    struct interleave_state *il_state,
+                    struct ntp_packet *request_pkt,
+                    struct ntp_mac *request_mac);
+void sign_request(struct client_settings *c_set, struct ntp_packet *request_pkt,
+                  struct ntp_mac *request_mac);
+int check_reply(struct client_settings *c_set, struct ntp_packet *request_pkt,
+                struct ntp_packet *reply_pkt, size_t len);
+int refill_nts_cookies(struct client_settings *c_set);
+void print_reply_rejects(void);
+void record_sample(struct client_settings *c_set, struct host_info *server,
+                   struct ntp_packet *request_pkt, struct ntp_packet *reply_pkt,
+                   struct timespec *dest_time, struct interleave_state *il_state,
+                   struct filter_sample *sample);
+void record_interleave_state(struct interleave_state *il_state,
+                             struct ntp_packet *req_pkt,
+                             struct ntp_packet *rep_pkt, struct core_ts *ts);
+
+#endif
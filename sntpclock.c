@@ -0,0 +1,364 @@
+/* sntpclock.c - the clock timestamps are read from and how precise it is
+ */
+
+#include "sntpclock.h"
+
+static const char *source_names[] = {"realtime", "tai", "coarse", "tsc",
+                                     "auto"};
+static const clockid_t source_ids[] = {CLOCK_REALTIME, CLOCK_TAI,
+                                       CLOCK_REALTIME_COARSE, CLOCK_REALTIME};
+
+// CLOCK_REALTIME until a source has been selected and timed
+static struct clock_source current = {CLOCK_SOURCE_REALTIME, "realtime",
+                                      CLOCK_REALTIME, 1e-9, 0, -20};
+static _Atomic int tai_offset; // seconds CLOCK_TAI is ahead of UTC
+static _Atomic time_t tai_checked; // TAI second the offset was last read in
+static struct tsc_anchor anchor;
+
+static void read_source(struct clock_source *cs, struct timespec *ts);
+static int update_tai_offset(time_t now);
+static int initialise_tsc(double *resolution);
+static int is_tsc_invariant(void);
+static uint64_t read_tsc(void);
+static void read_tsc_pair(uint64_t *tsc, uint64_t *ns);
+static void read_tsc_clock(struct timespec *ts);
+static void update_tsc_anchor(uint32_t seq);
+
+
+/*
+  Return codes:
+    0 - name is a known clock source
+    1 - unknown name, type is left untouched
+*/
+int parse_clock_source(const char *name, int *type){
+  int i;
+
+  for (i = CLOCK_SOURCE_REALTIME; i <= CLOCK_SOURCE_AUTO; i++){
+    if (strcmp(name, source_names[i]) == 0){
+      *type = i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+  times how long a read of the clock takes. as in RFC 5905 the precision is
+  the finer of what the clock can resolve and how long it takes to read, a
+  timestamp can not be trusted to less than either
+
+  Return codes:
+    0 - success
+    1 - the clock can not be read on this system
+*/
+int calibrate_clock_source(struct clock_source *cs, int type){
+  int i;
+  int run;
+  double run_time;
+  struct timespec res;
+  struct timespec ts;
+  struct timespec start;
+  struct timespec end;
+
+  cs->type = type;
+  cs->name = source_names[type];
+  cs->clock_id = source_ids[type];
+  if (clock_getres(cs->clock_id, &res) != 0 ||
+      clock_gettime(cs->clock_id, &ts) != 0){
+    return 1;
+  }
+  cs->resolution = res.tv_sec + res.tv_nsec * 1e-9;
+  if (type == CLOCK_SOURCE_TSC && initialise_tsc(&cs->resolution) != 0){
+    return 1;
+  }
+
+  cs->read_time = -1;
+  for (run = 0; run < CLOCK_CALIBRATE_RUNS; run++){
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < CLOCK_CALIBRATE_READS; i++){
+      read_source(cs, &ts);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    run_time = ((end.tv_sec - start.tv_sec) +
+                (end.tv_nsec - start.tv_nsec) * 1e-9) / CLOCK_CALIBRATE_READS;
+    if (cs->read_time < 0 || run_time < cs->read_time){
+      cs->read_time = run_time;
+    }
+  }
+  cs->precision = (int)ceil(log2(fmax(cs->resolution,
+                                      fmax(cs->read_time, 1e-9))));
+  return 0;
+}
+
+
+/*
+  makes type the clock every timestamp is read from. CLOCK_SOURCE_AUTO times
+  them all and picks the cheapest to read whose precision is within accuracy
+  seconds. only to be called before other threads read the clock
+
+  Return codes:
+    0 - success
+    1 - the clock can not be read on this system, the TSC also needs to be
+        invariant
+    2 - no clock is accurate enough
+*/
+int select_clock_source(int type, double accuracy, int debug){
+  int i;
+  int best;
+  struct clock_source sources[NUM_CLOCK_SOURCES];
+
+  if (type != CLOCK_SOURCE_AUTO){
+    if (calibrate_clock_source(&sources[0], type) != 0){
+      return 1;
+    }
+    best = 0;
+  }
+  else{
+    best = -1;
+    for (i = 0; i < NUM_CLOCK_SOURCES; i++){
+      if (calibrate_clock_source(&sources[i], i) != 0){
+        continue;
+      }
+      print_debug(debug, "clock %s: resolution %.0f ns, read in %.1f ns, "
+                  "precision %i", sources[i].name, sources[i].resolution * 1e9,
+                  sources[i].read_time * 1e9, sources[i].precision);
+      if (ldexp(1, sources[i].precision) <= accuracy &&
+          (best == -1 || sources[i].read_time < sources[best].read_time)){
+        best = i;
+      }
+    }
+    if (best == -1){
+      return 2;
+    }
+  }
+
+  current = sources[best];
+  if (current.type == CLOCK_SOURCE_TAI &&
+      (update_tai_offset(0) != 0 || atomic_load(&tai_offset) == 0)){
+    print_debug(debug, "the kernel TAI offset is not set, CLOCK_TAI reads the "
+                "same as CLOCK_REALTIME");
+  }
+  print_debug(debug, "reading the %s clock, precision %i", current.name,
+              current.precision);
+  return 0;
+}
+
+
+struct clock_source *get_clock_source(void){
+  return &current;
+}
+
+
+int get_clock_source_precision(void){
+  return current.precision;
+}
+
+
+// the time in UTC from the selected clock
+void read_clock_source(struct timespec *ts){
+  read_source(&current, ts);
+}
+
+
+static void read_source(struct clock_source *cs, struct timespec *ts){
+  time_t checked;
+
+  if (cs->type == CLOCK_SOURCE_TSC){
+    read_tsc_clock(ts);
+    return;
+  }
+  clock_gettime(cs->clock_id, ts);
+  if (cs->type != CLOCK_SOURCE_TAI){
+    return;
+  }
+  // the offset only changes with a leap second, which falls on a second
+  // boundary, so it is read again on the first read of every second
+  checked = atomic_load_explicit(&tai_checked, memory_order_relaxed);
+  if (ts->tv_sec != checked){
+    update_tai_offset(ts->tv_sec);
+  }
+  ts->tv_sec -= atomic_load_explicit(&tai_offset, memory_order_relaxed);
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the offset could not be read, the last one is kept
+*/
+static int update_tai_offset(time_t now){
+  struct timex tx;
+
+  memset(&tx, 0, sizeof(tx)); // modes 0 only reads
+  if (adjtimex(&tx) == -1){
+    return 1;
+  }
+  atomic_store_explicit(&tai_offset, tx.tai, memory_order_relaxed);
+  atomic_store_explicit(&tai_checked, now, memory_order_relaxed);
+  return 0;
+}
+
+
+/*
+  measures the TSC rate against CLOCK_REALTIME and sets up the first anchor,
+  resolution is set to the length of a tick
+
+  Return codes:
+    0 - success
+    1 - there is no TSC or it does not run at a constant rate
+*/
+static int initialise_tsc(double *resolution){
+  uint64_t start_tsc;
+  uint64_t start_ns;
+  uint64_t tsc;
+  uint64_t ns;
+  uint64_t mult;
+  struct timespec wait = {0, TSC_CALIBRATE_NS};
+
+  if (!is_tsc_invariant()){
+    return 1;
+  }
+  read_tsc_pair(&start_tsc, &start_ns);
+  nanosleep(&wait, NULL);
+  read_tsc_pair(&tsc, &ns);
+  if (tsc <= start_tsc || ns <= start_ns){
+    return 1;
+  }
+  mult = ((ns - start_ns) << 32) / (tsc - start_tsc);
+
+  atomic_store_explicit(&anchor.tsc, tsc, memory_order_relaxed);
+  atomic_store_explicit(&anchor.ns, ns, memory_order_relaxed);
+  atomic_store_explicit(&anchor.mult, mult, memory_order_relaxed);
+  atomic_store_explicit(&anchor.interval, (uint64_t)((double)TSC_ANCHOR_NS *
+                        (tsc - start_tsc) / (ns - start_ns)),
+                        memory_order_relaxed);
+  atomic_store_explicit(&anchor.seq, 0, memory_order_release);
+  *resolution = ldexp((double)mult, -32) * 1e-9;
+  return 0;
+}
+
+
+// CPUID 0x80000007 EDX bit 8, the TSC ticks at the same rate in every power
+// state and on every core
+static int is_tsc_invariant(void){
+#ifdef HAVE_TSC
+  unsigned int eax;
+  unsigned int ebx;
+  unsigned int ecx;
+  unsigned int edx;
+
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8))){
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+
+static uint64_t read_tsc(void){
+#ifdef HAVE_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+
+// CLOCK_REALTIME and the TSC read as close together as can be managed, the
+// TSC is taken either side and the try with the shortest gap kept
+static void read_tsc_pair(uint64_t *tsc, uint64_t *ns){
+  int i;
+  uint64_t before;
+  uint64_t after;
+  uint64_t gap;
+  struct timespec ts;
+
+  gap = UINT64_MAX;
+  for (i = 0; i < TSC_PAIR_TRIES; i++){
+    before = read_tsc();
+    clock_gettime(CLOCK_REALTIME, &ts);
+    after = read_tsc();
+    if (after - before < gap){
+      gap = after - before;
+      *tsc = before + gap / 2;
+      *ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+  }
+}
+
+
+static void read_tsc_clock(struct timespec *ts){
+  uint32_t seq;
+  uint64_t tsc;
+  uint64_t ns;
+  uint64_t mult;
+  uint64_t interval;
+  uint64_t ticks;
+
+  do{
+    seq = atomic_load_explicit(&anchor.seq, memory_order_acquire);
+    if (seq & 1){
+      clock_gettime(CLOCK_REALTIME, ts);
+      return;
+    }
+    tsc = atomic_load_explicit(&anchor.tsc, memory_order_relaxed);
+    ns = atomic_load_explicit(&anchor.ns, memory_order_relaxed);
+    mult = atomic_load_explicit(&anchor.mult, memory_order_relaxed);
+    interval = atomic_load_explicit(&anchor.interval, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+  } while (seq != atomic_load_explicit(&anchor.seq, memory_order_relaxed));
+
+  ticks = read_tsc() - tsc;
+  // another core can read a TSC a few ticks behind the anchor
+  if ((int64_t)ticks < 0){
+    ticks = 0;
+  }
+  ns += (uint64_t)(((unsigned __int128)ticks * mult) >> 32);
+  if (ticks > interval){
+    update_tsc_anchor(seq);
+  }
+  ts->tv_sec = ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+
+/*
+  takes a new anchor and works the rate out again from the time since the
+  last one, which follows the kernel clock as it is slewed. only the reader
+  that gets to make seq odd does this, the rest carry on with the old anchor
+*/
+static void update_tsc_anchor(uint32_t seq){
+  uint64_t tsc;
+  uint64_t ns;
+  uint64_t mult;
+  uint64_t old_tsc;
+  uint64_t old_ns;
+  uint64_t old_mult;
+
+  if (!atomic_compare_exchange_strong_explicit(&anchor.seq, &seq, seq + 1,
+                                               memory_order_acquire,
+                                               memory_order_relaxed)){
+    return;
+  }
+  // pairs with the acquire fence of readers, none of the stores below can be
+  // seen before seq is odd
+  atomic_thread_fence(memory_order_release);
+  old_tsc = atomic_load_explicit(&anchor.tsc, memory_order_relaxed);
+  old_ns = atomic_load_explicit(&anchor.ns, memory_order_relaxed);
+  old_mult = atomic_load_explicit(&anchor.mult, memory_order_relaxed);
+  read_tsc_pair(&tsc, &ns);
+
+  mult = old_mult;
+  if (tsc > old_tsc && ns > old_ns){
+    mult = (uint64_t)(((unsigned __int128)(ns - old_ns) << 32) /
+                      (tsc - old_tsc));
+    if (fabs((double)mult - old_mult) > old_mult * TSC_MAX_RATE_CHANGE){
+      mult = old_mult;
+    }
+  }
+  atomic_store_explicit(&anchor.tsc, tsc, memory_order_relaxed);
+  atomic_store_explicit(&anchor.ns, ns, memory_order_relaxed);
+  atomic_store_explicit(&anchor.mult, mult, memory_order_relaxed);
+  atomic_store_explicit(&anchor.seq, seq + 2, memory_order_release);
+}
@@ -0,0 +1,84 @@
+#ifndef SNTPCLOCK_H
+#define SNTPCLOCK_H
+
+#include "reusedlib.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/*
+  The clock every timestamp the server and client send is read from. It is
+  picked once at startup, before any thread reads it, and timed then so the
+  precision field is what the clock can really be read to rather than a
+  guess. CLOCK_REALTIME_COARSE is much cheaper to read but only moves once a
+  kernel tick, CLOCK_TAI is corrected by the kernel's TAI offset so it still
+  gives UTC as NTP needs. The TSC is cheaper and finer than any of them where
+  the CPU keeps it running at a constant rate, it is turned into
+  CLOCK_REALTIME from an anchor that is taken again every second so it follows
+  the kernel clock as that is slewed.
+*/
+
+enum clock_source_type{
+  CLOCK_SOURCE_REALTIME, // CLOCK_REALTIME
+  CLOCK_SOURCE_TAI, // CLOCK_TAI less the kernel's TAI offset
+  CLOCK_SOURCE_COARSE, // CLOCK_REALTIME_COARSE
+  CLOCK_SOURCE_TSC, // the invariant TSC anchored to CLOCK_REALTIME
+  CLOCK_SOURCE_AUTO // the cheapest of the above that is accurate enough
+};
+#define NUM_CLOCK_SOURCES 4
+
+struct clock_source{
+  int type; // one of enum clock_source_type
+  const char *name;
+  clockid_t clock_id;
+  double resolution; // seconds, as given by clock_getres
+  double read_time; // seconds a read takes, measured at startup
+  int precision; // log2 seconds of the larger of the two, rounded up
+};
+
+// a TSC reading and the CLOCK_REALTIME time it was taken at, published with a
+// seqlock so readers never take a lock. a reader that finds an update under
+// way reads CLOCK_REALTIME instead of waiting for it
+struct tsc_anchor{
+  _Atomic uint32_t seq; // odd while the anchor is being updated
+  _Atomic uint64_t tsc;
+  _Atomic uint64_t ns; // CLOCK_REALTIME at tsc, ns since 1970
+  _Atomic uint64_t mult; // ns per tick in 32.32 fixed point
+  _Atomic uint64_t interval; // ticks an anchor is used for
+};
+
+
+int parse_clock_source(const char *name, int *type);
+int calibrate_clock_source(struct clock_source *cs, int type);
+int select_clock_source(int type, double accuracy, int debug);
+struct clock_source *get_clock_source(void);
+int get_clock_source_precision(void);
+void read_clock_source(struct timespec *ts);
+
+
+// reads timed together to work out the cost of one
+#define CLOCK_CALIBRATE_READS 1000
+// the fastest of this many runs is kept, a run the thread was switched out in
+// can only be slower
+#define CLOCK_CALIBRATE_RUNS 5
+// the TSC rate is first measured over this long
+#define TSC_CALIBRATE_NS 20000000
+// how often the TSC is anchored to CLOCK_REALTIME again
+#define TSC_ANCHOR_NS 1000000000
+// reads of CLOCK_REALTIME between two of the TSC, the closest pair is kept
+#define TSC_PAIR_TRIES 5
+// the most the rate is allowed to change by between anchors, more means the
+// kernel clock was stepped and the old rate is kept
+#define TSC_MAX_RATE_CHANGE 0.001
+#define DEFAULT_CLOCK_SOURCE CLOCK_SOURCE_REALTIME
+// the worst precision in seconds CLOCK_SOURCE_AUTO will pick a clock with
+#define DEFAULT_CLOCK_ACCURACY 1e-6
+
+#endif
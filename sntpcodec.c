@@ -0,0 +1,278 @@
+/* sntpcodec.c - checks made on NTP packets where they were received
+ */
+
+#include "sntpcodec.h"
+
+static const char *reject_names[] = {"accepted", "short", "oversize",
+                                     "extension", "version", "mode",
+                                     "version mismatch", "bogus", "stratum",
+                                     "zero transmit", "kiss", "auth", "nts"};
+
+static int read_ext_header(const uint8_t *data, size_t offset, size_t end,
+                           int *type, size_t *length);
+
+
+/*
+  a request a server can answer, pkt holds the len bytes that were received.
+  info, when not NULL, is filled in with where the extension fields and MAC
+  are. returns one of enum ntp_reject
+*/
+int validate_ntp_request(const struct ntp_packet *pkt, size_t len,
+                         struct ntp_packet_info *info){
+  int vn;
+
+  if (len < NTP_HEADER_LEN){
+    return NTP_REJECT_SHORT;
+  }
+  if (len > NTP_MAX_PACKET_LEN){
+    return NTP_REJECT_OVERSIZE;
+  }
+  if (get_ntp_mode(pkt) != NTP_MODE_CLIENT){
+    return NTP_REJECT_MODE;
+  }
+  vn = get_ntp_version(pkt);
+  if (vn < 1 || vn > 4){
+    return NTP_REJECT_VERSION;
+  }
+  if (parse_ntp_packet(pkt, len, info) != 0){
+    return NTP_REJECT_EXTENSION;
+  }
+  return NTP_ACCEPT;
+}
+
+
+/*
+  a reply to req that can be used, rep holds the len bytes that were
+  received. a kiss-o'-death passes every other check so it can be matched to
+  its request. info is as for validate_ntp_request. returns one of
+  enum ntp_reject
+*/
+int validate_ntp_reply(const struct ntp_packet *req, const struct ntp_packet *rep,
+                       size_t len, struct ntp_packet_info *info){
+  if (len < NTP_HEADER_LEN){
+    return NTP_REJECT_SHORT;
+  }
+  if (len > NTP_MAX_PACKET_LEN){
+    return NTP_REJECT_OVERSIZE;
+  }
+  // the originate time in the server reply should be the same as the transmit
+  // time in the request, or the receive time for an interleaved reply
+  if (!is_same_ntp_timestamp(&rep->originate_timestamp,
+                             &req->transmit_timestamp) &&
+      (is_ntp_timestamp_zero(&req->receive_timestamp) ||
+       !is_same_ntp_timestamp(&rep->originate_timestamp,
+                              &req->receive_timestamp))){
+    return NTP_REJECT_BOGUS;
+  }
+  if (rep->stratum > NTP_MAX_STRATUM){
+    return NTP_REJECT_STRATUM;
+  }
+  if (is_ntp_timestamp_zero(&rep->transmit_timestamp)){
+    return NTP_REJECT_ZERO_TRANSMIT;
+  }
+  if (get_ntp_mode(rep) != NTP_MODE_SERVER){
+    return NTP_REJECT_MODE;
+  }
+  // the server must answer in the version of the request, which also rules
+  // out version 0 as the client never sends it
+  if (get_ntp_version(rep) != get_ntp_version(req)){
+    return NTP_REJECT_VERSION_MISMATCH;
+  }
+  if (parse_ntp_packet(rep, len, info) != 0){
+    return NTP_REJECT_EXTENSION;
+  }
+  if (rep->stratum == 0){
+    return NTP_REJECT_KISS;
+  }
+  return NTP_ACCEPT;
+}
+
+
+/*
+  finds the extension fields and MAC in the len bytes of pkt without copying
+  them, info can be NULL to only check they are well formed. as in RFC 7822
+  what is left after a field is a MAC if it is a MAC long, anything else must
+  be another field. versions before 4 have no extension fields
+
+  Return codes:
+    0 - success
+    1 - a field runs past the end of the packet or what is left is neither a
+        field nor a MAC
+*/
+int parse_ntp_packet(const struct ntp_packet *pkt, size_t len,
+                     struct ntp_packet_info *info){
+  const uint8_t *data = (const uint8_t *)pkt;
+  size_t offset;
+  size_t left;
+  size_t length;
+  int type;
+  int num_ext;
+
+  num_ext = 0;
+  for (offset = NTP_HEADER_LEN; offset < len; offset += length){
+    left = len - offset;
+    if (left >= NTP_MIN_MAC_LEN && left <= NTP_MAX_MAC_LEN){
+      break;
+    }
+    if (get_ntp_version(pkt) < 4 ||
+        read_ext_header(data, offset, len, &type, &length) != 0){
+      return 1;
+    }
+    num_ext++;
+  }
+
+  left = len - offset;
+  if (left % 4 != 0){
+    return 1;
+  }
+  if (info != NULL){
+    info->num_ext = num_ext;
+    info->ext_len = offset - NTP_HEADER_LEN;
+    info->mac = left != 0 ? data + offset : NULL;
+    info->mac_len = left;
+  }
+  return 0;
+}
+
+
+/*
+  reads the extension field at *offset and moves it on to the next one. info
+  has to come from parse_ntp_packet on the same packet, so the fields are
+  known to be in bounds. *offset starts at NTP_HEADER_LEN
+
+  Return codes:
+    0 - field is the next extension field
+    1 - there are no more
+*/
+int get_ntp_ext_field(const struct ntp_packet *pkt,
+                      const struct ntp_packet_info *info, size_t *offset,
+                      struct ntp_ext_field *field){
+  return next_ntp_ext_field((const uint8_t *)pkt,
+                            NTP_HEADER_LEN + info->ext_len, offset, field);
+}
+
+
+/*
+  as get_ntp_ext_field for fields that are not in a packet, such as those
+  that arrive encrypted, the first len bytes of data are read and each field
+  is checked as it is reached
+
+  Return codes:
+    0 - field is the next extension field
+    1 - there are no more, or the next one is not well formed
+*/
+int next_ntp_ext_field(const uint8_t *data, size_t len, size_t *offset,
+                       struct ntp_ext_field *field){
+  size_t length;
+
+  if (read_ext_header(data, *offset, len, &field->type, &length) != 0){
+    return 1;
+  }
+  field->body = data + *offset + NTP_EXT_HEADER_LEN;
+  field->body_len = length - NTP_EXT_HEADER_LEN;
+  *offset += length;
+  return 0;
+}
+
+
+/*
+  writes an extension field with body_len bytes of body to buf, a NULL body is
+  all zeros. it is padded with zeros to a multiple of 4 bytes and at least
+  NTP_MIN_EXT_LEN. returns the length of the field
+*/
+size_t write_ntp_ext_field(uint8_t *buf, int type, const void *body,
+                           size_t body_len){
+  size_t length;
+
+  length = NTP_EXT_HEADER_LEN + ((body_len + 3) & ~(size_t)3);
+  if (length < NTP_MIN_EXT_LEN){
+    length = NTP_MIN_EXT_LEN;
+  }
+  buf[0] = type >> 8;
+  buf[1] = type;
+  buf[2] = length >> 8;
+  buf[3] = length;
+  if (body != NULL){
+    memcpy(buf + NTP_EXT_HEADER_LEN, body, body_len);
+  }
+  else{
+    memset(buf + NTP_EXT_HEADER_LEN, 0, body_len);
+  }
+  memset(buf + NTP_EXT_HEADER_LEN + body_len, 0,
+         length - NTP_EXT_HEADER_LEN - body_len);
+  return length;
+}
+
+
+/*
+  Return codes:
+    0 - field is the first extension field of the type
+    1 - the packet has no field of the type
+*/
+int find_ntp_ext_field(const struct ntp_packet *pkt,
+                       const struct ntp_packet_info *info, int type,
+                       struct ntp_ext_field *field){
+  size_t offset = NTP_HEADER_LEN;
+
+  while (get_ntp_ext_field(pkt, info, &offset, field) == 0){
+    if (field->type == type){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+const char *get_ntp_reject_name(int reason){
+  if (reason < 0 || reason >= NUM_NTP_REJECTS){
+    return "unknown";
+  }
+  return reject_names[reason];
+}
+
+
+/*
+  writes every reason with a count as "name count" separated by commas, an
+  empty string if there are none. returns the length written
+*/
+int format_ntp_reject_counts(const struct ntp_reject_counts *counts, char *buf,
+                             size_t size){
+  int i;
+  int len;
+  int n;
+
+  len = 0;
+  buf[0] = '\0';
+  for (i = NTP_ACCEPT + 1; i < NUM_NTP_REJECTS; i++){
+    if (counts->counts[i] == 0){
+      continue;
+    }
+    n = snprintf(buf + len, size - len, "%s%s %llu", len > 0 ? ", " : "",
+                 reject_names[i], (unsigned long long)counts->counts[i]);
+    if (n < 0 || (size_t)n >= size - len){
+      break;
+    }
+    len += n;
+  }
+  return len;
+}
+
+
+/*
+  Return codes:
+    0 - a well formed field header of a field that ends by end
+    1 - there is no room for one or the length is not valid
+*/
+static int read_ext_header(const uint8_t *data, size_t offset, size_t end,
+                           int *type, size_t *length){
+  if (offset + NTP_EXT_HEADER_LEN > end){
+    return 1;
+  }
+  *type = data[offset] << 8 | data[offset + 1];
+  *length = data[offset + 2] << 8 | data[offset + 3];
+  if (*length < NTP_MIN_EXT_LEN || *length % 4 != 0 ||
+      *length > end - offset){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,199 @@
+#ifndef SNTPCODEC_H
+#define SNTPCODEC_H
+
+#include "reusedlib.h" // struct ntp_time_t
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+  The NTP packet as it is on the wire and the checks made on it, shared by the
+  server, client and load generator. Packets are received straight into a
+  struct ntp_packet and checked where they lie, fields are only read through
+  the accessors below which handle the byte order and bit packing. A packet
+  that fails a check is rejected with the reason why, callers keep a count of
+  each reason so it can be seen why packets are being dropped.
+
+  Receive buffers are a union ntp_buffer, large enough for any packet that
+  fits an ethernet frame, so extension fields (RFC 7822) and a MAC arrive
+  behind the header. They are walked where they lie by parse_ntp_packet,
+  which only reads the type and length of each field and checks it is within
+  the packet, a field nobody asks for costs nothing more than that.
+*/
+
+// the 48 byte header of RFC 5905, every field falls on its natural alignment
+// so there is no padding and the struct is the wire layout
+struct ntp_packet {
+  uint8_t li_vn_mode;
+  uint8_t stratum;
+  uint8_t poll;
+  int8_t  precision;
+  int32_t root_delay;
+  uint32_t root_dispersion;
+  uint32_t reference_identifier;
+  struct ntp_time_t reference_timestamp;
+  struct ntp_time_t originate_timestamp;
+  struct ntp_time_t receive_timestamp;
+  struct ntp_time_t transmit_timestamp;
+};
+
+#define NTP_HEADER_LEN 48
+_Static_assert(sizeof(struct ntp_packet) == NTP_HEADER_LEN,
+               "struct ntp_packet does not match the wire layout");
+_Static_assert(offsetof(struct ntp_packet, transmit_timestamp) == 40,
+               "struct ntp_packet does not match the wire layout");
+
+// the largest packet that fits a 1500 byte ethernet frame behind the IPv4 and
+// UDP headers, anything longer is rejected rather than read
+#define NTP_MAX_PACKET_LEN 1472
+
+// a received packet, the header and whatever followed it
+union ntp_buffer{
+  struct ntp_packet pkt;
+  uint8_t data[NTP_MAX_PACKET_LEN];
+};
+
+// extension fields have a 2 byte type and 2 byte length that counts the
+// header, the length is a multiple of 4 and at least 16 (RFC 7822)
+#define NTP_EXT_HEADER_LEN 4
+#define NTP_MIN_EXT_LEN 16
+// a MAC is a 4 byte key id and a 128 or 160 bit digest. as in RFC 7822 a
+// longer digest is cut to 160 bits so a MAC can never be taken for an
+// extension field
+#define NTP_MIN_MAC_LEN 20
+#define NTP_MAX_MAC_LEN 24
+
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_MAX_STRATUM 15
+
+enum ntp_reject{
+  NTP_ACCEPT,
+  NTP_REJECT_SHORT, // less than a whole header
+  NTP_REJECT_OVERSIZE, // longer than NTP_MAX_PACKET_LEN
+  NTP_REJECT_EXTENSION, // extension fields or MAC do not fit the packet
+  NTP_REJECT_VERSION, // version is not 1 to 4
+  NTP_REJECT_MODE, // not a client request, or not a server reply
+  NTP_REJECT_VERSION_MISMATCH, // reply is not in the version of the request
+  NTP_REJECT_BOGUS, // originate time does not match the request
+  NTP_REJECT_STRATUM, // stratum is over 15, the server is not synchronised
+  NTP_REJECT_ZERO_TRANSMIT, // the reply has no transmit time
+  NTP_REJECT_KISS, // stratum 0, a kiss-o'-death
+  NTP_REJECT_AUTH, // no MAC when one is needed, or it does not match a key
+  NTP_REJECT_NTS, // NTS fields that are malformed or do not authenticate
+  NUM_NTP_REJECTS
+};
+
+// where the extension fields and MAC of a packet are, found by
+// parse_ntp_packet
+struct ntp_packet_info{
+  int num_ext; // extension fields after the header
+  size_t ext_len; // bytes they take up
+  const uint8_t *mac; // key id then digest, NULL when there is no MAC
+  size_t mac_len;
+};
+
+// a MAC to send after a packet, the key id in network order then the digest
+struct ntp_mac{
+  uint8_t data[NTP_MAX_MAC_LEN];
+  size_t len; // 0 sends the packet without one
+};
+
+// one extension field, body points into the packet
+struct ntp_ext_field{
+  int type;
+  const uint8_t *body;
+  size_t body_len; // includes any padding
+};
+
+// counts of every reason a packet was rejected, kept by whoever checks them so
+// no counter is shared between threads
+struct ntp_reject_counts{
+  uint64_t counts[NUM_NTP_REJECTS];
+};
+
+
+int validate_ntp_request(const struct ntp_packet *pkt, size_t len,
+                         struct ntp_packet_info *info);
+int validate_ntp_reply(const struct ntp_packet *req, const struct ntp_packet *rep,
+                       size_t len, struct ntp_packet_info *info);
+int parse_ntp_packet(const struct ntp_packet *pkt, size_t len,
+                     struct ntp_packet_info *info);
+int get_ntp_ext_field(const struct ntp_packet *pkt,
+                      const struct ntp_packet_info *info, size_t *offset,
+                      struct ntp_ext_field *field);
+int find_ntp_ext_field(const struct ntp_packet *pkt,
+                       const struct ntp_packet_info *info, int type,
+                       struct ntp_ext_field *field);
+int next_ntp_ext_field(const uint8_t *data, size_t len, size_t *offset,
+                       struct ntp_ext_field *field);
+size_t write_ntp_ext_field(uint8_t *buf, int type, const void *body,
+                           size_t body_len);
+const char *get_ntp_reject_name(int reason);
+int format_ntp_reject_counts(const struct ntp_reject_counts *counts, char *buf,
+                             size_t size);
+
+
+static inline void count_ntp_reject(struct ntp_reject_counts *counts,
+                                    int reason){
+  counts->counts[reason]++;
+}
+
+
+static inline int get_ntp_leap(const struct ntp_packet *pkt){
+  return pkt->li_vn_mode >> 6;
+}
+
+
+static inline int get_ntp_version(const struct ntp_packet *pkt){
+  return (pkt->li_vn_mode >> 3) & 0x7;
+}
+
+
+static inline int get_ntp_mode(const struct ntp_packet *pkt){
+  return pkt->li_vn_mode & 0x7;
+}
+
+
+static inline void set_ntp_header(struct ntp_packet *pkt, int leap, int version,
+                                  int mode){
+  pkt->li_vn_mode = (leap << 6) | (version << 3) | mode;
+}
+
+
+// root delay and dispersion are in the 16.16 short format, in seconds
+static inline double get_ntp_root_delay(const struct ntp_packet *pkt){
+  return (int32_t)ntohl(pkt->root_delay) / 65536.0;
+}
+
+
+static inline double get_ntp_root_dispersion(const struct ntp_packet *pkt){
+  return ntohl(pkt->root_dispersion) / 65536.0;
+}
+
+
+// a timestamp field in network order as 32.32 NTP time in host order
+static inline uint64_t read_ntp_timestamp(const struct ntp_time_t *field){
+  return (uint64_t)ntohl(field->second) << 32 | ntohl(field->fraction);
+}
+
+
+static inline void write_ntp_timestamp(struct ntp_time_t *field, uint64_t ntp){
+  field->second = htonl((uint32_t)(ntp >> 32));
+  field->fraction = htonl((uint32_t)ntp);
+}
+
+
+static inline int is_ntp_timestamp_zero(const struct ntp_time_t *field){
+  return field->second == 0 && field->fraction == 0;
+}
+
+
+static inline int is_same_ntp_timestamp(const struct ntp_time_t *a,
+                                        const struct ntp_time_t *b){
+  return a->second == b->second && a->fraction == b->fraction;
+}
+
+#endif
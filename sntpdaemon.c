@@ -0,0 +1,127 @@
+/* sntpdaemon.c - keeps the clock disciplined to the servers
+ */
+
+#include "sntpdaemon.h"
+
+
+/*
+  only returns on an error, otherwise it runs until it is killed
+
+  Return codes:
+    1 - the clock cant be adjusted, no server can be polled or the offset
+        went past the panic threshold
+*/
+int daemon_mode(struct client_settings *c_set){
+  int i;
+  int action;
+  double last_sample; // time of the system peer sample last used
+  struct local_clock clock;
+  struct clock_discipline d;
+  struct server_poll polls[MAX_SERVERS];
+  struct select_result result;
+  struct timespec now;
+  struct timespec next_poll;
+  struct timespec next_adjust;
+
+  if (c_set->clock_simulated){
+    initialise_simulated_clock(&clock, c_set->simulated_offset,
+                               c_set->simulated_drift * 1e-6);
+  }
+  else if (initialise_system_clock(&clock) != 0){
+    fprintf(stderr, "unable to adjust the system clock, run as root or set "
+            "clock = \"simulated\" in %s\n", CONFIG_FILE);
+    return 1;
+  }
+  c_set->clock = &clock;
+  initialise_clock_discipline(&d, &clock,
+                              ldexp(1, get_clock_source_precision()),
+                              c_set->step_threshold, c_set->stepout,
+                              c_set->panic_threshold, c_set->poll_min,
+                              c_set->poll_max);
+  print_debug(c_set->debug, "disciplining the %s clock", clock.name);
+
+  if (start_server_polls(c_set, polls) == 0){
+    return 1;
+  }
+  last_sample = 0;
+
+  for (;;){
+    get_monotonic_time(&next_poll);
+    add_seconds_to_timespec(&next_poll, get_poll_interval(&d));
+
+    if (restart_server_polls(polls, c_set->num_servers) == 0){
+      fprintf(stderr, "every server has refused access\n");
+      close_server_polls(polls, c_set->num_servers);
+      return 1;
+    }
+    run_server_polls(c_set, polls, c_set->num_servers);
+    // as in RFC 5905 a sample only updates the clock once, if the filter of
+    // the system peer still holds an older one it is waited out
+    if (select_server_offset(polls, c_set->num_servers, &result,
+                             c_set->debug) == 0 &&
+        polls[result.system_peer].filter.picked_time > last_sample){
+      last_sample = polls[result.system_peer].filter.picked_time;
+      get_monotonic_time(&now);
+      action = update_clock_discipline(&d, result.offset,
+                                       now.tv_sec + now.tv_nsec * 1e-9);
+      if (action == DISCIPLINE_PANIC){
+        fprintf(stderr, "offset of %f seconds is over the panic threshold, "
+                "set the clock by hand\n", result.offset);
+        close_server_polls(polls, c_set->num_servers);
+        return 1;
+      }
+      if (action == DISCIPLINE_STEP){
+        // every sample so far was taken against the clock before it moved
+        for (i = 0; i < c_set->num_servers; i++){
+          initialise_clock_filter(&polls[i].filter);
+          polls[i].il_state.valid = 0;
+        }
+      }
+      adjust_clock(&d, now.tv_sec + now.tv_nsec * 1e-9);
+      // the next poll is timed from this update, at the interval it has set
+      next_poll = now;
+      add_seconds_to_timespec(&next_poll, get_poll_interval(&d));
+      print_discipline_status(&d, result.offset, action);
+    }
+
+    // slew the clock in small steps until the next poll
+    for (;;){
+      get_monotonic_time(&next_adjust);
+      add_seconds_to_timespec(&next_adjust, DAEMON_ADJUST_INTERVAL);
+      if (get_seconds_until(&next_poll) <= get_seconds_until(&next_adjust)){
+        break;
+      }
+      sleep_until(&next_adjust);
+      get_monotonic_time(&now);
+      adjust_clock(&d, now.tv_sec + now.tv_nsec * 1e-9);
+    }
+    sleep_until(&next_poll);
+  }
+}
+
+
+// one line per update with the offset and where the discipline is at
+void print_discipline_status(struct clock_discipline *d, double offset,
+                             int action){
+  char *time_str;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  time_str = convert_epoch_time_to_human_readable(now);
+  printf("%s (+0000) offset: %f, frequency: %.3f ppm, jitter: %f, "
+         "poll: %.0f s, %s", time_str, offset, d->freq * 1e6, d->jitter,
+         get_poll_interval(d), get_discipline_state_name(d->state));
+  free(time_str);
+  if (action == DISCIPLINE_STEP){
+    printf(", stepped");
+  }
+  else if (action == DISCIPLINE_IGNORE){
+    printf(", ignored");
+  }
+  // the error of a simulated clock is known, which shows how well it works
+  if (strcmp(d->clock->name, "simulated") == 0){
+    printf(", clock error: %f", d->clock->get_error(d->clock));
+  }
+  printf("\n");
+  fflush(stdout);
+}
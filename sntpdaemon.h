@@ -0,0 +1,22 @@
+#ifndef SNTPDAEMON_H
+#define SNTPDAEMON_H
+
+#include "sntpmulti.h"
+
+/*
+  Daemon mode for the client. The servers are polled as in multi server mode
+  at the interval the clock discipline asks for, between poll_min and
+  poll_max, and the offset picked by source selection is fed to the clock
+  discipline, which slews the clock once a second in between. This
+  replaces running a separate time daemon next to the client.
+*/
+
+// the longest the clock is left between adjustments, seconds
+#define DAEMON_ADJUST_INTERVAL 1.0
+
+
+int daemon_mode(struct client_settings *c_set);
+void print_discipline_status(struct clock_discipline *d, double offset,
+                             int action);
+
+#endif
@@ -0,0 +1,358 @@
+/* sntpdiscipline.c - the clock discipline loop and the clocks it can adjust
+ */
+
+#include "sntpdiscipline.h"
+
+static int step_system_clock(struct local_clock *clock, double offset);
+static int set_system_clock_frequency(struct local_clock *clock, double freq);
+static double get_system_clock_error(struct local_clock *clock);
+static int step_simulated_clock(struct local_clock *clock, double offset);
+static int set_simulated_clock_frequency(struct local_clock *clock,
+                                         double freq);
+static double get_simulated_clock_error(struct local_clock *clock);
+static void advance_simulated_clock(struct local_clock *clock);
+static void reset_clock_discipline(struct clock_discipline *d, int state,
+                                   double now, double offset);
+static void adjust_poll_interval(struct clock_discipline *d);
+static void adjust_clock_offset(struct clock_discipline *d, double now);
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the clock cant be adjusted, usually as the client isnt root
+*/
+int initialise_system_clock(struct local_clock *clock){
+  struct timex tx;
+
+  memset(clock, 0, sizeof(*clock));
+  clock->name = "system";
+  clock->step = step_system_clock;
+  clock->set_frequency = set_system_clock_frequency;
+  clock->get_error = get_system_clock_error;
+
+  // write back the current frequency to find out if the clock can be adjusted
+  memset(&tx, 0, sizeof(tx));
+  if (clock_adjtime(CLOCK_REALTIME, &tx) == -1){
+    return 1;
+  }
+  tx.modes = ADJ_FREQUENCY;
+  if (clock_adjtime(CLOCK_REALTIME, &tx) == -1){
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  offset is how far ahead of the system clock the simulated clock starts and
+  drift how many seconds per second it gains on its own
+*/
+void initialise_simulated_clock(struct local_clock *clock, double offset,
+                                double drift){
+  memset(clock, 0, sizeof(*clock));
+  clock->name = "simulated";
+  clock->step = step_simulated_clock;
+  clock->set_frequency = set_simulated_clock_frequency;
+  clock->get_error = get_simulated_clock_error;
+  clock->sim_offset = offset;
+  clock->sim_drift = drift;
+  get_monotonic_time(&clock->sim_last);
+}
+
+
+/*
+  poll_min and poll_max are in seconds and rounded to a power of two, the
+  poll interval starts at poll_min
+*/
+void initialise_clock_discipline(struct clock_discipline *d,
+                                 struct local_clock *clock, double precision,
+                                 double step_threshold, double stepout,
+                                 double panic_threshold, double poll_min,
+                                 double poll_max){
+  memset(d, 0, sizeof(*d));
+  d->clock = clock;
+  d->state = DISCIPLINE_NSET;
+  d->precision = precision;
+  d->step_threshold = step_threshold;
+  d->stepout = stepout;
+  d->panic_threshold = panic_threshold;
+  d->poll_min = (int)round(log2(poll_min));
+  d->poll_max = (int)round(log2(poll_max));
+  d->poll = d->poll_min;
+}
+
+
+// seconds until the next poll, which is also the time constant of the loop
+double get_poll_interval(struct clock_discipline *d){
+  return ldexp(1, d->poll);
+}
+
+
+/*
+  feeds the discipline a new offset of the local clock from the servers, the
+  local_clock routine of RFC 5905. now is the CLOCK_MONOTONIC time of the
+  offset in seconds. adjust_clock should be called straight after to start
+  slewing and the next poll made after get_poll_interval.
+
+  Returns one of enum discipline_action
+*/
+int update_clock_discipline(struct clock_discipline *d, double offset,
+                            double now){
+  int action;
+  double mu; // seconds since the last update
+  double freq; // change to the frequency
+  double etemp;
+  double dtemp;
+  double time_constant;
+
+  if (d->state != DISCIPLINE_NSET && fabs(offset) > d->panic_threshold){
+    return DISCIPLINE_PANIC;
+  }
+
+  // bring the slew up to now so the offset left to slew is current
+  adjust_clock_offset(d, now);
+  mu = now - d->last_update;
+  time_constant = get_poll_interval(d);
+  freq = 0;
+  action = DISCIPLINE_SLEW;
+  if (fabs(offset) > d->step_threshold){
+    switch (d->state){
+      case DISCIPLINE_SYNC:
+        // wait a stepout to see if the offset is real
+        d->state = DISCIPLINE_SPIK;
+        return DISCIPLINE_IGNORE;
+
+      case DISCIPLINE_FREQ:
+        if (mu < d->stepout){
+          return DISCIPLINE_IGNORE;
+        }
+        freq = (offset - d->offset) / mu;
+        // fall through
+
+      case DISCIPLINE_SPIK:
+        if (mu < d->stepout){
+          return DISCIPLINE_IGNORE;
+        }
+        // fall through
+
+      default:
+        if (d->clock->step(d->clock, offset) != 0){
+          return DISCIPLINE_IGNORE;
+        }
+        action = DISCIPLINE_STEP;
+        // the clock is watched closely again after a step
+        d->poll = d->poll_min;
+        d->poll_count = 0;
+        if (d->state == DISCIPLINE_NSET){
+          // the frequency is measured over the next stepout
+          reset_clock_discipline(d, DISCIPLINE_FREQ, now, 0);
+          return action;
+        }
+        reset_clock_discipline(d, DISCIPLINE_SYNC, now, 0);
+        break;
+    }
+  }
+  else{
+    dtemp = fmax(fabs(offset - d->last_offset), d->precision);
+    d->jitter = sqrt(d->jitter * d->jitter +
+                     (dtemp * dtemp - d->jitter * d->jitter) / DISCIPLINE_AVG);
+
+    switch (d->state){
+      case DISCIPLINE_NSET:
+        // slew the first offset away while the frequency is measured
+        reset_clock_discipline(d, DISCIPLINE_FREQ, now, offset);
+        return action;
+
+      case DISCIPLINE_FREQ:
+        if (mu < d->stepout){
+          return DISCIPLINE_IGNORE;
+        }
+        // what is left after slewing is down to the frequency
+        freq = (offset - d->offset) / mu;
+        // fall through
+
+      default:
+        // frequency locked loop, only trusted with long gaps between updates
+        if (time_constant > DISCIPLINE_ALLAN / 2){
+          etemp = fmax(DISCIPLINE_MAXPOLL + 1 - d->poll, DISCIPLINE_AVG);
+          freq += (offset - d->last_offset) /
+                  (fmax(mu, DISCIPLINE_ALLAN) * etemp);
+        }
+        // phase locked loop
+        dtemp = 4 * DISCIPLINE_PLL * time_constant;
+        freq += offset * fmin(mu, DISCIPLINE_ALLAN) / (dtemp * dtemp);
+        reset_clock_discipline(d, DISCIPLINE_SYNC, now, offset);
+        break;
+    }
+  }
+
+  freq += d->freq;
+  d->freq = fmax(fmin(freq, DISCIPLINE_MAXFREQ), -DISCIPLINE_MAXFREQ);
+  d->wander = sqrt(d->wander * d->wander +
+                   (freq * freq - d->wander * d->wander) / DISCIPLINE_AVG);
+  if (action == DISCIPLINE_SLEW){
+    adjust_poll_interval(d);
+  }
+  return action;
+}
+
+
+/*
+  slews the clock towards the servers, the clock_adjust routine of RFC 5905.
+  it is called at least once a second, the part of the offset slewed away
+  since the last call is taken off and the rate set again from what remains.
+
+  Return codes:
+    0 - success
+    1 - the clock cant be adjusted
+*/
+int adjust_clock(struct clock_discipline *d, double now){
+  if (d->state == DISCIPLINE_NSET){
+    return 0;
+  }
+  adjust_clock_offset(d, now);
+  d->slew = d->offset / (DISCIPLINE_PLL * get_poll_interval(d));
+  return d->clock->set_frequency(d->clock, d->freq + d->slew) != 0;
+}
+
+
+const char *get_discipline_state_name(int state){
+  switch (state){
+    case DISCIPLINE_NSET:
+      return "unset";
+    case DISCIPLINE_FREQ:
+      return "freq";
+    case DISCIPLINE_SPIK:
+      return "spike";
+    default:
+      return "sync";
+  }
+}
+
+
+/*
+  the poll adjust from the local_clock routine of RFC 5905. offsets within
+  DISCIPLINE_PGATE times the jitter add the poll exponent to a counter and
+  others take off twice as much, the interval doubles when the counter passes
+  DISCIPLINE_LIMIT and halves when it passes -DISCIPLINE_LIMIT. it backs off
+  quicker than it grows so a worsening clock is caught early
+*/
+static void adjust_poll_interval(struct clock_discipline *d){
+  if (fabs(d->offset) < DISCIPLINE_PGATE * d->jitter){
+    d->poll_count += d->poll;
+    if (d->poll_count > DISCIPLINE_LIMIT){
+      d->poll_count = DISCIPLINE_LIMIT;
+      if (d->poll < d->poll_max){
+        d->poll_count = 0;
+        d->poll++;
+      }
+    }
+  }
+  else{
+    d->poll_count -= d->poll * 2;
+    if (d->poll_count < -DISCIPLINE_LIMIT){
+      d->poll_count = -DISCIPLINE_LIMIT;
+      if (d->poll > d->poll_min){
+        d->poll_count = 0;
+        d->poll--;
+      }
+    }
+  }
+}
+
+
+// takes off the part of the offset slewed away since the last adjustment
+static void adjust_clock_offset(struct clock_discipline *d, double now){
+  double slewed;
+
+  slewed = d->slew * (now - d->last_adjust);
+  // the slew never carries on past zero
+  d->offset = fabs(slewed) >= fabs(d->offset) ? 0 : d->offset - slewed;
+  d->last_adjust = now;
+}
+
+
+// the rstclock routine of RFC 5905
+static void reset_clock_discipline(struct clock_discipline *d, int state,
+                                   double now, double offset){
+  d->state = state;
+  d->last_update = now;
+  d->last_adjust = now;
+  d->offset = offset;
+  d->last_offset = offset;
+  d->slew = 0;
+}
+
+
+static int step_system_clock(struct local_clock *clock, double offset){
+  struct timex tx;
+
+  memset(&tx, 0, sizeof(tx));
+  tx.modes = ADJ_SETOFFSET | ADJ_NANO;
+  // the nanoseconds have to be positive, so a negative step borrows a second
+  tx.time.tv_sec = (time_t)floor(offset);
+  tx.time.tv_usec = (long)((offset - floor(offset)) * 1e9);
+  if (clock_adjtime(CLOCK_REALTIME, &tx) == -1){
+    perror("clock_adjtime");
+    return 1;
+  }
+  return 0;
+}
+
+
+static int set_system_clock_frequency(struct local_clock *clock, double freq){
+  struct timex tx;
+
+  memset(&tx, 0, sizeof(tx));
+  // the kernel's own loop is turned off and it is told the clock is in sync,
+  // the frequency is in ppm with a 16 bit fraction
+  tx.modes = ADJ_FREQUENCY | ADJ_STATUS;
+  tx.status = 0;
+  freq = fmax(fmin(freq, DISCIPLINE_MAXFREQ), -DISCIPLINE_MAXFREQ);
+  tx.freq = (long)(freq * 1e6 * 65536);
+  if (clock_adjtime(CLOCK_REALTIME, &tx) == -1){
+    perror("clock_adjtime");
+    return 1;
+  }
+  return 0;
+}
+
+
+static double get_system_clock_error(struct local_clock *clock){
+  // samples are taken with the system clock itself
+  return 0;
+}
+
+
+static int step_simulated_clock(struct local_clock *clock, double offset){
+  advance_simulated_clock(clock);
+  clock->sim_offset += offset;
+  return 0;
+}
+
+
+static int set_simulated_clock_frequency(struct local_clock *clock,
+                                         double freq){
+  advance_simulated_clock(clock);
+  clock->sim_freq = fmax(fmin(freq, DISCIPLINE_MAXFREQ), -DISCIPLINE_MAXFREQ);
+  return 0;
+}
+
+
+static double get_simulated_clock_error(struct local_clock *clock){
+  advance_simulated_clock(clock);
+  return clock->sim_offset;
+}
+
+
+// brings the offset of the simulated clock up to now
+static void advance_simulated_clock(struct local_clock *clock){
+  struct timespec now;
+
+  get_monotonic_time(&now);
+  clock->sim_offset += (clock->sim_drift + clock->sim_freq) *
+                       (now.tv_sec - clock->sim_last.tv_sec +
+                        (now.tv_nsec - clock->sim_last.tv_nsec) * 1e-9);
+  clock->sim_last = now;
+}
@@ -0,0 +1,128 @@
+#ifndef SNTPDISCIPLINE_H
+#define SNTPDISCIPLINE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // clock_adjtime
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timex.h>
+#include "sntpsched.h"
+
+/*
+  Keeps the local clock in step with the servers, following the clock
+  discipline from RFC 5905 (section 11.3). Small offsets are slewed away by
+  a hybrid phase/frequency locked loop that also learns how fast the clock
+  drifts, so it stays close between polls. Large offsets are stepped, but only
+  once they have lasted a whole stepout interval, as a single wild sample is
+  more likely a network hiccup than the clock being wrong.
+
+  The poll interval adapts as well. While offsets stay within a few times the
+  jitter the clock is holding well, so the interval doubles up to the most
+  allowed, and as soon as they grow it halves towards the least. A settled
+  client ends up polling far less often than it started. The loop time
+  constant follows the poll interval.
+
+  The clock being disciplined sits behind struct local_clock. The system
+  clock is adjusted with clock_adjtime and needs root, the simulated clock
+  only keeps an offset from the system clock in memory so the loop can be
+  watched without root or touching the real time.
+*/
+
+// offsets above this are stepped rather than slewed, seconds
+#define DEFAULT_STEP_THRESHOLD 0.128
+// how long an offset above the step threshold must last before the clock is
+// stepped, also how long the frequency is measured for at start up, seconds
+#define DEFAULT_STEPOUT 900
+// offsets above this are too big to trust outside of the first update, seconds
+#define DEFAULT_PANIC_THRESHOLD 1000
+// loop gain of the phase locked loop
+#define DISCIPLINE_PLL 16
+// above this many seconds between updates the frequency locked loop is used
+#define DISCIPLINE_ALLAN 1500
+// averaging constant for the jitter and wander
+#define DISCIPLINE_AVG 4
+// log2 seconds of the longest poll interval, sets the weight of the fll
+#define DISCIPLINE_MAXPOLL 17
+// the least and most the poll interval can be set to, seconds
+#define DEFAULT_POLL_MIN 16
+#define DEFAULT_POLL_MAX 1024
+// offsets within this many times the jitter count towards a longer poll
+#define DISCIPLINE_PGATE 4
+// how far the poll counter goes before the poll interval changes
+#define DISCIPLINE_LIMIT 30
+// the most the frequency is corrected by, 500 ppm
+#define DISCIPLINE_MAXFREQ 500e-6
+
+enum discipline_state{
+  DISCIPLINE_NSET, // no update yet
+  DISCIPLINE_FREQ, // measuring the frequency after the first update
+  DISCIPLINE_SPIK, // an offset above the step threshold has been seen
+  DISCIPLINE_SYNC // in sync, offsets are slewed
+};
+
+// what an update did to the clock
+enum discipline_action{
+  DISCIPLINE_IGNORE, // the offset was not used
+  DISCIPLINE_SLEW, // the offset is being slewed away
+  DISCIPLINE_STEP, // the clock was stepped, samples from before are stale
+  DISCIPLINE_PANIC // the offset is too big to correct
+};
+
+struct local_clock{
+  const char *name;
+  // moves the clock forward by offset seconds
+  int (*step)(struct local_clock *clock, double offset);
+  // makes the clock run faster by freq seconds per second, on top of its
+  // natural rate
+  int (*set_frequency)(struct local_clock *clock, double freq);
+  // seconds the clock is ahead of CLOCK_REALTIME, which samples are taken with
+  double (*get_error)(struct local_clock *clock);
+  // state of the simulated clock
+  double sim_offset; // seconds ahead of the system clock
+  double sim_drift; // natural rate error, seconds per second
+  double sim_freq; // correction set by the discipline
+  struct timespec sim_last; // when sim_offset was last brought up to date
+};
+
+struct clock_discipline{
+  struct local_clock *clock;
+  int state; // one of enum discipline_state
+  double offset; // offset still to be slewed away, seconds
+  double last_offset; // offset at the last update
+  double freq; // frequency correction, seconds per second
+  double slew; // rate the offset is being slewed away at, seconds per second
+  double jitter; // of the offsets, seconds
+  double wander; // of the frequency, seconds per second
+  double last_update; // time of the last update, CLOCK_MONOTONIC seconds
+  double last_adjust; // time the slew was last brought up to date
+  double precision; // of the local clock, seconds
+  double step_threshold;
+  double stepout;
+  double panic_threshold;
+  int poll; // log2 seconds between polls
+  int poll_min; // log2 seconds
+  int poll_max; // log2 seconds
+  int poll_count; // counts towards a longer or shorter poll interval
+};
+
+
+int initialise_system_clock(struct local_clock *clock);
+void initialise_simulated_clock(struct local_clock *clock, double offset,
+                                double drift);
+void initialise_clock_discipline(struct clock_discipline *d,
+                                 struct local_clock *clock, double precision,
+                                 double step_threshold, double stepout,
+                                 double panic_threshold, double poll_min,
+                                 double poll_max);
+int update_clock_discipline(struct clock_discipline *d, double offset,
+                            double now);
+int adjust_clock(struct clock_discipline *d, double now);
+double get_poll_interval(struct clock_discipline *d);
+const char *get_discipline_state_name(int state);
+
+#endif
@@ -0,0 +1,110 @@
+/* sntpfilter.c - picks the best of the recent samples from a server
+ */
+
+#include "sntpfilter.h"
+
+static double get_sample_distance(struct filter_sample *sample);
+
+
+void initialise_clock_filter(struct clock_filter *filter){
+  memset(filter, 0, sizeof(*filter));
+}
+
+
+/*
+  shifts the sample into the filter and picks the sample with the lowest
+  distance. precision is the smallest jitter worth reporting, in seconds.
+
+  Return codes:
+    0 - a sample newer than the last one picked has been picked
+    1 - the picked sample has been picked before, or is older than it. RFC
+        5905 does not let the same sample update the clock twice
+*/
+int add_filter_sample(struct clock_filter *filter, struct filter_sample *sample,
+                      double precision){
+  int i;
+  int j;
+  int order[CLOCK_FILTER_STAGES];
+  double age;
+  double weight;
+  double dispersion;
+  double jitter;
+  struct filter_sample *best;
+
+  // older samples become less trustworthy the longer it has been since they
+  // were taken
+  if (filter->count > 0){
+    age = sample->time - filter->last_update;
+    for (i = 0; i < filter->count; i++){
+      filter->stages[i].dispersion += CLOCK_PHI * age;
+      if (filter->stages[i].dispersion > CLOCK_MAX_DISPERSION){
+        filter->stages[i].dispersion = CLOCK_MAX_DISPERSION;
+      }
+    }
+  }
+  memmove(&filter->stages[1], &filter->stages[0],
+          (CLOCK_FILTER_STAGES - 1) * sizeof(filter->stages[0]));
+  filter->stages[0] = *sample;
+  if (filter->count < CLOCK_FILTER_STAGES){
+    filter->count++;
+  }
+  filter->last_update = sample->time;
+
+  // sort the stages by distance, an insertion sort is plenty for 8 of them
+  for (i = 0; i < filter->count; i++){
+    for (j = i; j > 0 &&
+         get_sample_distance(&filter->stages[order[j - 1]]) >
+         get_sample_distance(&filter->stages[i]); j--){
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+  best = &filter->stages[order[0]];
+
+  // the dispersion is weighted towards the best samples. unlike RFC 5905
+  // empty stages are left out rather than counted as the worst possible, the
+  // client takes a handful of samples and would otherwise see every server
+  // as seconds wide when selecting between them
+  dispersion = 0;
+  jitter = 0;
+  weight = 0.5;
+  for (i = 0; i < filter->count; i++, weight /= 2){
+    dispersion += filter->stages[order[i]].dispersion * weight;
+    jitter += pow(filter->stages[order[i]].offset - best->offset, 2);
+  }
+  filter->dispersion = dispersion;
+  if (filter->count > 1){
+    jitter = sqrt(jitter / (filter->count - 1));
+  }
+  filter->jitter = jitter > precision ? jitter : precision;
+
+  if (filter->picked_time != 0 && best->time <= filter->picked_time){
+    return 1;
+  }
+  filter->offset = best->offset;
+  filter->delay = best->delay;
+  filter->picked_time = best->time;
+  return 0;
+}
+
+
+/*
+  half the delay plus the dispersion. samples of the same age are ordered by
+  delay, but as the dispersion grows with age an old sample that had a quiet
+  path cant stay picked forever as the clocks drift apart
+*/
+static double get_sample_distance(struct filter_sample *sample){
+  return sample->delay / 2 + sample->dispersion;
+}
+
+
+/*
+  dispersion of a new sample, from how finely each clock can be read and how
+  far the clocks can drift apart during the round trip. precisions are the
+  log2 seconds carried in the packet precision field
+*/
+double get_sample_dispersion(int server_precision, int local_precision,
+                             double delay){
+  return ldexp(1, server_precision) + ldexp(1, local_precision) +
+         CLOCK_PHI * delay;
+}
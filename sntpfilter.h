@@ -0,0 +1,51 @@
+#ifndef SNTPFILTER_H
+#define SNTPFILTER_H
+
+#include <math.h>
+#include <string.h>
+
+/*
+  The clock filter from RFC 5905 (section 10). The last CLOCK_FILTER_STAGES
+  samples from a server are kept and the one with the lowest synchronisation
+  distance, half its round trip delay plus its dispersion, is picked. Among
+  samples of the same age that is the one with the lowest delay, the one least
+  disturbed by queueing along the path, and as the dispersion grows with age a
+  fresh sample wins when delays are close. A single packet that was held up somewhere is then simply not used, where an
+  average would be pulled towards it. The spread of the other samples around
+  the picked one gives the jitter.
+*/
+
+// number of samples kept per server
+#define CLOCK_FILTER_STAGES 8
+// how fast the dispersion of a sample grows with its age, 15 ppm
+#define CLOCK_PHI 15e-6
+// the most dispersion any sample can have, seconds
+#define CLOCK_MAX_DISPERSION 16.0
+
+struct filter_sample{
+  double offset; // seconds
+  double delay; // round trip delay, seconds
+  double dispersion; // error from the precision of both clocks, seconds
+  double time; // when it was taken, CLOCK_MONOTONIC seconds
+};
+
+struct clock_filter{
+  struct filter_sample stages[CLOCK_FILTER_STAGES]; // newest first
+  int count; // stages holding a sample
+  double last_update; // time of the newest sample
+  // the picked sample and the filter statistics
+  double offset;
+  double delay;
+  double dispersion;
+  double jitter;
+  double picked_time; // time of the picked sample, 0 until one is picked
+};
+
+
+void initialise_clock_filter(struct clock_filter *filter);
+int add_filter_sample(struct clock_filter *filter, struct filter_sample *sample,
+                      double precision);
+double get_sample_dispersion(int server_precision, int local_precision,
+                             double delay);
+
+#endif
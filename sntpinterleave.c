@@ -0,0 +1,75 @@
+/* sntpinterleave.c - server side state for NTPv4 interleaved mode
+*/
+
+#include "sntpinterleave.h"
+
+
+/*
+  size is rounded up to a power of two so a slot is found with a mask
+
+  Return codes:
+    0 - success
+    1 - unable to allocate the table
+*/
+int initialise_interleave_table(struct interleave_table *table, int size){
+  uint32_t slots;
+
+  slots = 1;
+  while (slots < (uint32_t)size){
+    slots <<= 1;
+  }
+  if ((table->entries = calloc(slots, sizeof(struct interleave_entry))) == NULL){
+    return 1;
+  }
+  table->mask = slots - 1;
+  return 0;
+}
+
+
+void free_interleave_table(struct interleave_table *table){
+  free(table->entries);
+  table->entries = NULL;
+}
+
+
+struct interleave_entry *lookup_interleave_entry(struct interleave_table *table,
+                                                 uint32_t client_addr){
+  uint32_t hash;
+
+  // multiplicative hash spreads neighbouring addresses across the table
+  hash = ntohl(client_addr) * 2654435761U;
+  return &table->entries[(hash >> 7) & table->mask];
+}
+
+
+/*
+  a client asks for interleaved mode by putting the receive timestamp of our
+  last reply to it in the originate field. only when that matches what we
+  stored, and the send time of that reply is known, can we answer with it.
+*/
+int is_interleaved_request(struct interleave_entry *entry, uint32_t client_addr,
+                           const struct ntp_packet *req_pkt){
+  if (entry->client_addr != client_addr){
+    return 0;
+  }
+  if (entry->tx_ts == 0){
+    return 0;
+  }
+  return read_ntp_timestamp(&req_pkt->originate_timestamp) == entry->rx_ts &&
+         entry->rx_ts != 0;
+}
+
+
+void record_interleave_receive(struct interleave_entry *entry,
+                               uint32_t client_addr, uint64_t rx_ts){
+  entry->client_addr = client_addr;
+  entry->rx_ts = rx_ts;
+  // the reply has not gone out yet
+  entry->tx_ts = 0;
+}
+
+
+void record_interleave_transmit(struct interleave_entry *entry,
+                                uint64_t tx_ts){
+  entry->tx_ts = tx_ts;
+}
@@ -0,0 +1,38 @@
+#ifndef SNTPINTERLEAVE_H
+#define SNTPINTERLEAVE_H
+
+#include "sntptools.h"
+
+/*
+  Per client state for NTPv4 interleaved mode. In interleaved mode the server
+  answers a request with the real transmit time of its previous reply to the
+  same client, which it can only know once that reply has been sent.
+*/
+
+// what the server remembers about the last exchange with a client
+struct interleave_entry{
+  uint32_t client_addr; // network byte order, 0 if the slot is unused
+  uint64_t rx_ts; // receive time of the clients last request
+  uint64_t tx_ts; // time the reply to that request was sent, 0 until then
+};
+
+// direct mapped table of clients, a newer client simply replaces an older one
+// in the same slot which costs that client one exchange in basic mode
+struct interleave_table{
+  struct interleave_entry *entries;
+  uint32_t mask;
+};
+
+
+int initialise_interleave_table(struct interleave_table *table, int size);
+void free_interleave_table(struct interleave_table *table);
+struct interleave_entry *lookup_interleave_entry(struct interleave_table *table,
+                                                 uint32_t client_addr);
+int is_interleaved_request(struct interleave_entry *entry, uint32_t client_addr,
+                           const struct ntp_packet *req_pkt);
+void record_interleave_receive(struct interleave_entry *entry,
+                               uint32_t client_addr, uint64_t rx_ts);
+void record_interleave_transmit(struct interleave_entry *entry,
+                                uint64_t tx_ts);
+
+#endif
@@ -0,0 +1,613 @@
+/* sntploadgen.c - sends requests to an sntp server at a set rate and reports
+   how many were answered and how long the answers took
+ */
+
+#include "sntploadgen.h"
+
+
+int main(int argc, char *argv[]){
+  int i;
+  double elapsed;
+  struct timespec start;
+  struct timespec end;
+  struct loadgen_settings l_set;
+  struct loadgen_thread *threads;
+
+  l_set = get_loadgen_settings(argc, argv);
+  if ((threads = calloc(l_set.threads, sizeof(*threads))) == NULL){
+    fprintf(stderr, "unable to allocate load generator threads\n");
+    exit(1);
+  }
+
+  for (i = 0; i < l_set.threads; i++){
+    threads[i].id = i;
+    threads[i].l_set = &l_set;
+    if (initialise_loadgen_thread(&threads[i]) != 0){
+      fprintf(stderr, "unable to set up load generator thread %i\n", i);
+      exit(1);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < l_set.threads; i++){
+    if (pthread_create(&threads[i].thread, NULL, run_loadgen_thread,
+                       &threads[i]) != 0){
+      fprintf(stderr, "unable to start load generator thread %i\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < l_set.threads; i++){
+    pthread_join(threads[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  print_loadgen_results(&l_set, threads, elapsed);
+  for (i = 0; i < l_set.threads; i++){
+    free_loadgen_thread(&threads[i]);
+  }
+  free(threads);
+  return 0;
+}
+
+
+/*
+  every source port is a socket of its own connected to the server, so the
+  server sees as many clients as there are ports
+
+  Return codes:
+    0 - success
+    1 - error creating the sockets
+*/
+int initialise_loadgen_thread(struct loadgen_thread *t){
+  int i;
+  int sockfd;
+  struct loadgen_settings *l_set = t->l_set;
+
+  t->server_addr.sin_family = AF_INET;
+  t->server_addr.sin_port = htons(l_set->server_port);
+  if (inet_pton(AF_INET, l_set->server_host, &t->server_addr.sin_addr) != 1){
+    fprintf(stderr, "'%s' is not an IPv4 address\n", l_set->server_host);
+    return 1;
+  }
+  t->seed = time(NULL) ^ (t->id * 2654435761U);
+
+  t->pfds = calloc(l_set->sockets, sizeof(*t->pfds));
+  t->reqs = calloc(LOADGEN_SLOTS, sizeof(*t->reqs));
+  if (t->pfds == NULL || t->reqs == NULL){
+    return 1;
+  }
+  for (i = 0; i < l_set->sockets; i++){
+    t->pfds[i].fd = -1;
+  }
+  for (i = 0; i < l_set->sockets; i++){
+    if ((sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1 ||
+        connect(sockfd, (struct sockaddr *)&t->server_addr,
+                sizeof(t->server_addr)) == -1){
+      return 1;
+    }
+    t->pfds[i].fd = sockfd;
+    t->pfds[i].events = POLLIN;
+  }
+  return 0;
+}
+
+
+void free_loadgen_thread(struct loadgen_thread *t){
+  int i;
+
+  for (i = 0; t->pfds != NULL && i < t->l_set->sockets; i++){
+    if (t->pfds[i].fd != -1){
+      close(t->pfds[i].fd);
+    }
+  }
+  free(t->pfds);
+  free(t->reqs);
+}
+
+
+/*
+  requests are sent once their scheduled time has passed and replies are read
+  in between. a thread running late sends every overdue request straight away,
+  in bursts of up to LOADGEN_SEND_BURST so replies are still read, and each
+  keeps the time it should have gone out at.
+*/
+void *run_loadgen_thread(void *arg){
+  int i;
+  int burst;
+  int next_socket;
+  double elapsed;
+  double schedule; // seconds after start the next request is due
+  double wait;
+  double thread_rate;
+  struct timespec start;
+  struct timespec now;
+  struct timespec intended;
+  struct timespec timeout;
+  struct loadgen_thread *t = arg;
+  struct loadgen_settings *l_set = t->l_set;
+
+  // poll wakes up close to when the next request is due
+  prctl(PR_SET_TIMERSLACK, 1UL);
+
+  thread_rate = l_set->rate / l_set->threads;
+  // stagger the threads so evenly paced requests stay evenly paced overall
+  schedule = t->id / l_set->rate;
+  next_socket = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1){
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    if (elapsed >= l_set->duration){
+      break;
+    }
+
+    for (burst = 0; schedule <= elapsed && burst < LOADGEN_SEND_BURST; burst++){
+      intended.tv_sec = start.tv_sec + (time_t)schedule;
+      intended.tv_nsec = start.tv_nsec +
+                         (long)((schedule - (time_t)schedule) * 1e9);
+      if (intended.tv_nsec >= 1000000000L){
+        intended.tv_sec++;
+        intended.tv_nsec -= 1000000000L;
+      }
+      send_loadgen_request(t, &intended, t->pfds[next_socket].fd);
+      next_socket = (next_socket + 1) % l_set->sockets;
+      schedule += next_send_gap(t, thread_rate);
+    }
+
+    wait = (schedule < l_set->duration ? schedule : l_set->duration) - elapsed;
+    if (wait < 0){
+      wait = 0;
+    }
+    timeout.tv_sec = (time_t)wait;
+    timeout.tv_nsec = (long)((wait - timeout.tv_sec) * 1e9);
+    if (ppoll(t->pfds, l_set->sockets, &timeout, NULL) > 0){
+      for (i = 0; i < l_set->sockets; i++){
+        if (t->pfds[i].revents & POLLIN){
+          receive_loadgen_replies(t, t->pfds[i].fd);
+        }
+      }
+    }
+  }
+
+  // give the last requests a chance to be answered
+  timeout.tv_sec = 0;
+  timeout.tv_nsec = 10 * 1000000L;
+  for (burst = 0; burst < LOADGEN_DRAIN_MS / 10 &&
+       t->received + t->invalid + t->overwritten < t->sent;
+       burst++){
+    if (ppoll(t->pfds, l_set->sockets, &timeout, NULL) > 0){
+      for (i = 0; i < l_set->sockets; i++){
+        if (t->pfds[i].revents & POLLIN){
+          receive_loadgen_replies(t, t->pfds[i].fd);
+        }
+      }
+    }
+  }
+  for (i = 0; i < LOADGEN_SLOTS; i++){
+    t->lost += t->reqs[i].in_flight;
+  }
+  t->lost += t->overwritten;
+  return NULL;
+}
+
+
+/*
+  builds the request with the same create_packet the client uses and keeps it
+  in the next slot until its reply comes back. with NTS the fields are added
+  in a copy of it
+
+  Return codes:
+    0 - success
+    1 - error sending the request
+*/
+int send_loadgen_request(struct loadgen_thread *t, struct timespec *intended,
+                         int sockfd){
+  unsigned int slot;
+  size_t ext_len;
+  struct ntp_mac mac;
+  struct loadgen_request *req;
+
+  slot = t->next_slot++ & (LOADGEN_SLOTS - 1);
+  req = &t->reqs[slot];
+  if (req->in_flight){
+    t->overwritten++;
+  }
+
+  create_packet(&req->pkt);
+  req->pkt.transmit_timestamp.fraction =
+    htonl((ntohl(req->pkt.transmit_timestamp.fraction) & ~(LOADGEN_SLOTS - 1)) |
+          slot);
+  req->intended = *intended;
+  req->in_flight = 0;
+  mac.len = 0;
+  if (t->l_set->key != NULL){
+    compute_ntp_mac(t->l_set->key, &req->pkt, NTP_HEADER_LEN, &mac);
+  }
+
+  ext_len = 0;
+  if (t->l_set->nts != NULL){
+    ext_len = add_loadgen_nts_fields(t, req);
+  }
+
+  if (send_SNTP_packet(ext_len > 0 ? &t->nts_request.pkt : &req->pkt,
+                       t->nts_request.data + NTP_HEADER_LEN, ext_len, &mac,
+                       sockfd, t->server_addr, NULL, 0) != 0){
+    t->send_errors++;
+    return 1;
+  }
+  req->in_flight = 1;
+  t->sent++;
+  return 0;
+}
+
+
+/*
+  the NTS fields for req, in the thread's copy of it. the unique identifier
+  comes from its transmit time so the reply can be checked without keeping
+  it. the cookies from key establishment are used in turn and no
+  placeholders are sent, the server can not tell a cookie has been used
+  before so the load is that of clients each sending a fresh one. returns
+  the length of the fields
+*/
+size_t add_loadgen_nts_fields(struct loadgen_thread *t,
+                              struct loadgen_request *req){
+  int i;
+  uint64_t count;
+  uint8_t uid[NTS_UID_LEN];
+  uint8_t nonce[NTS_NONCE_LEN];
+  struct nts_client *nts = t->l_set->nts;
+
+  // a nonce only has to be unique, the thread id and a count are enough
+  memset(nonce, 0, sizeof(nonce));
+  memcpy(nonce, &t->id, sizeof(t->id));
+  count = t->nts_count++;
+  for (i = NTS_NONCE_LEN - 1; i >= NTS_NONCE_LEN - 8; i--){
+    nonce[i] = count;
+    count >>= 8;
+  }
+
+  make_loadgen_uid(t, req, uid);
+  t->nts_request.pkt = req->pkt;
+  return build_nts_request(&t->nts_request, &nts->c2s, uid,
+                           &nts->cookies[t->nts_count % nts->num_cookies], 0,
+                           nonce);
+}
+
+
+// the transmit time of req and the thread it was sent from, never repeated
+void make_loadgen_uid(struct loadgen_thread *t, struct loadgen_request *req,
+                      uint8_t *uid){
+  memset(uid, 0, NTS_UID_LEN);
+  memcpy(uid, &req->pkt.transmit_timestamp, sizeof(struct ntp_time_t));
+  memcpy(uid + sizeof(struct ntp_time_t), &t->id, sizeof(t->id));
+}
+
+
+/*
+  Return codes:
+    the number of replies read
+*/
+int receive_loadgen_replies(struct loadgen_thread *t, int sockfd){
+  int i;
+  unsigned int slot;
+  uint64_t latency_ns;
+  struct timespec now;
+  struct sockaddr_in addr;
+  union ntp_buffer reply;
+  size_t len;
+  int reason;
+  int num_cookies;
+  uint8_t uid[NTS_UID_LEN];
+  const struct auth_key *key;
+  struct ntp_packet_info info;
+  struct loadgen_request *req;
+
+  for (i = 0; i < LOADGEN_RECV_LIMIT; i++){
+    if (recieve_SNTP_packet(sockfd, &reply, &len, &addr, NULL, NULL, 0) != 0){
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    slot = ntohl(reply.pkt.originate_timestamp.fraction) & (LOADGEN_SLOTS - 1);
+    req = &t->reqs[slot];
+    if (len < NTP_HEADER_LEN || !req->in_flight ||
+        !is_same_ntp_timestamp(&req->pkt.transmit_timestamp,
+                               &reply.pkt.originate_timestamp)){
+      t->unmatched++;
+      continue;
+    }
+    req->in_flight = 0;
+
+    reason = validate_ntp_reply(&req->pkt, &reply.pkt, len, &info);
+    if (reason == NTP_ACCEPT && t->l_set->key != NULL &&
+        (verify_ntp_mac(&t->l_set->keys, &reply.pkt, &info, &key) != 0 ||
+         key != t->l_set->key)){
+      reason = NTP_REJECT_AUTH;
+    }
+    // the new cookies are checked along with the rest but not kept
+    if (reason == NTP_ACCEPT && t->l_set->nts != NULL){
+      make_loadgen_uid(t, req, uid);
+      if (verify_nts_reply(&t->l_set->nts->s2c, &reply.pkt, &info, uid, NULL,
+                           0, &num_cookies) != 0){
+        reason = NTP_REJECT_NTS;
+      }
+    }
+    if (reason != NTP_ACCEPT){
+      count_ntp_reject(&t->rejects, reason);
+      t->invalid++;
+      continue;
+    }
+    latency_ns = (now.tv_sec - req->intended.tv_sec) * 1000000000ULL +
+                 now.tv_nsec - req->intended.tv_nsec;
+    record_latency(&t->hist, latency_ns);
+    t->received++;
+  }
+  return i;
+}
+
+
+// seconds until the next request of this thread is due
+double next_send_gap(struct loadgen_thread *t, double thread_rate){
+  double u;
+
+  if (!t->l_set->poisson){
+    return 1.0 / thread_rate;
+  }
+  // exponentially distributed gaps make the arrivals a poisson process
+  u = (rand_r(&t->seed) + 1.0) / (RAND_MAX + 2.0);
+  return -log(u) / thread_rate;
+}
+
+
+/*
+  values below 2^LATENCY_SUB_BITS get a bucket each, above that every power of
+  two is split into the same number of equal buckets
+*/
+int get_latency_bucket(uint64_t value){
+  int shift;
+
+  if (value < (1ULL << LATENCY_SUB_BITS)){
+    return value;
+  }
+  shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS + 1;
+  return (shift << (LATENCY_SUB_BITS - 1)) + (value >> shift);
+}
+
+
+// the largest value that falls in a bucket
+uint64_t get_latency_bucket_value(int bucket){
+  int shift;
+  uint64_t sub_bucket;
+
+  if (bucket < (1 << LATENCY_SUB_BITS)){
+    return bucket;
+  }
+  shift = (bucket >> (LATENCY_SUB_BITS - 1)) - 1;
+  sub_bucket = bucket - (shift << (LATENCY_SUB_BITS - 1));
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+
+void record_latency(struct latency_histogram *hist, uint64_t latency_ns){
+  hist->counts[get_latency_bucket(latency_ns)]++;
+  hist->total++;
+  if (latency_ns > hist->max_ns){
+    hist->max_ns = latency_ns;
+  }
+}
+
+
+void merge_latency_histogram(struct latency_histogram *into,
+                             struct latency_histogram *from){
+  int i;
+
+  for (i = 0; i < LATENCY_BUCKETS; i++){
+    into->counts[i] += from->counts[i];
+  }
+  into->total += from->total;
+  if (from->max_ns > into->max_ns){
+    into->max_ns = from->max_ns;
+  }
+}
+
+
+// the latency percentile percent of the replies came back within
+uint64_t get_latency_percentile(struct latency_histogram *hist,
+                                double percentile){
+  int i;
+  uint64_t seen;
+  uint64_t target;
+  uint64_t value;
+
+  if (hist->total == 0){
+    return 0;
+  }
+  target = (uint64_t)ceil(percentile / 100.0 * hist->total);
+  if (target < 1){
+    target = 1;
+  }
+  seen = 0;
+  for (i = 0; i < LATENCY_BUCKETS; i++){
+    seen += hist->counts[i];
+    if (seen >= target){
+      value = get_latency_bucket_value(i);
+      return value < hist->max_ns ? value : hist->max_ns;
+    }
+  }
+  return hist->max_ns;
+}
+
+
+void print_loadgen_results(struct loadgen_settings *l_set,
+                           struct loadgen_thread *threads, double elapsed){
+  int i;
+  int j;
+  uint64_t sent = 0;
+  uint64_t received = 0;
+  uint64_t lost = 0;
+  uint64_t invalid = 0;
+  uint64_t unmatched = 0;
+  uint64_t send_errors = 0;
+  char reject_str[256];
+  struct ntp_reject_counts rejects;
+  static struct latency_histogram hist;
+
+  memset(&hist, 0, sizeof(hist));
+  memset(&rejects, 0, sizeof(rejects));
+  for (i = 0; i < l_set->threads; i++){
+    sent += threads[i].sent;
+    received += threads[i].received;
+    lost += threads[i].lost;
+    invalid += threads[i].invalid;
+    for (j = 0; j < NUM_NTP_REJECTS; j++){
+      rejects.counts[j] += threads[i].rejects.counts[j];
+    }
+    unmatched += threads[i].unmatched;
+    send_errors += threads[i].send_errors;
+    merge_latency_histogram(&hist, &threads[i].hist);
+  }
+
+  printf("target %.0f requests/s (%s), %i thread(s) x %i port(s) for %is\n",
+         l_set->rate, l_set->poisson ? "poisson" : "fixed", l_set->threads,
+         l_set->sockets, l_set->duration);
+  if (l_set->key != NULL){
+    printf("requests signed with key %u\n", l_set->key->id);
+  }
+  if (l_set->nts != NULL){
+    printf("requests authenticated with NTS, %i cookies in turn\n",
+           l_set->nts->num_cookies);
+  }
+  printf("sent %llu (%.0f/s), received %llu (%.0f/s)\n",
+         (unsigned long long)sent, sent / elapsed,
+         (unsigned long long)received, received / elapsed);
+  printf("lost %llu (%.3f%%), invalid %llu, unmatched %llu, send errors %llu\n",
+         (unsigned long long)lost, sent ? 100.0 * lost / sent : 0.0,
+         (unsigned long long)invalid, (unsigned long long)unmatched,
+         (unsigned long long)send_errors);
+  if (format_ntp_reject_counts(&rejects, reject_str, sizeof(reject_str)) > 0){
+    printf("invalid replies: %s\n", reject_str);
+  }
+  if (hist.total > 0){
+    printf("latency p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+           get_latency_percentile(&hist, 50) / 1e3,
+           get_latency_percentile(&hist, 90) / 1e3,
+           get_latency_percentile(&hist, 99) / 1e3,
+           get_latency_percentile(&hist, 99.9) / 1e3, hist.max_ns / 1e3);
+  }
+}
+
+
+struct loadgen_settings get_loadgen_settings(int argc, char *argv[]){
+  int c;
+  int line_num;
+  unsigned long key_id;
+  const char *key_file;
+  int nts_enabled;
+  const char *nts_ca_file;
+  struct loadgen_settings l_set;
+
+  l_set.server_host = DEFAULT_SERVER_HOST;
+  l_set.server_port = DEFAULT_SERVER_PORT;
+  l_set.rate = DEFAULT_RATE;
+  l_set.poisson = DEFAULT_POISSON;
+  l_set.threads = DEFAULT_THREADS;
+  l_set.sockets = DEFAULT_SOCKETS;
+  l_set.duration = DEFAULT_DURATION;
+  memset(&l_set.keys, 0, sizeof(l_set.keys));
+  l_set.key = NULL;
+  l_set.nts = NULL;
+  key_file = NULL;
+  key_id = 0;
+  nts_enabled = 0;
+  nts_ca_file = NULL;
+
+  while ((c = getopt(argc, argv, "u:p:r:Pt:s:d:K:k:NC:")) != -1){
+    switch(c){
+      case 'u':
+        l_set.server_host = optarg;
+        break;
+
+      case 'p':
+        l_set.server_port = atoi(optarg);
+        break;
+
+      case 'r':
+        l_set.rate = atof(optarg);
+        break;
+
+      case 'P':
+        l_set.poisson = 1;
+        break;
+
+      case 't':
+        l_set.threads = atoi(optarg);
+        break;
+
+      case 's':
+        l_set.sockets = atoi(optarg);
+        break;
+
+      case 'd':
+        l_set.duration = atoi(optarg);
+        break;
+
+      case 'K':
+        key_file = optarg;
+        break;
+
+      case 'k':
+        key_id = strtoul(optarg, NULL, 10);
+        break;
+
+      case 'N':
+        nts_enabled = 1;
+        break;
+
+      case 'C':
+        nts_ca_file = optarg;
+        break;
+
+      default:
+        fprintf(stderr, "usage: %s [-u address] [-p port] [-r requests/s] [-P] "
+                "[-t threads] [-s ports per thread] [-d seconds] "
+                "[-K key file -k key id] [-N [-C ca file]]\n", argv[0]);
+        exit(1);
+    }
+  }
+  // sign every request, to measure what authentication costs the server
+  if (key_id != 0){
+    if (key_file == NULL ||
+        load_key_table(&l_set.keys, key_file, &line_num) != 0 ||
+        (l_set.key = lookup_auth_key(&l_set.keys, key_id)) == NULL){
+      fprintf(stderr, "unable to read key %lu from the key file\n", key_id);
+      exit(1);
+    }
+  }
+  // authenticate every request with NTS, key establishment is run once and
+  // its cookies are shared by every thread
+  if (nts_enabled){
+    if (key_id != 0){
+      fprintf(stderr, "-N and -k can not be used together\n");
+      exit(1);
+    }
+    if ((l_set.nts = calloc(1, sizeof(struct nts_client))) == NULL ||
+        run_nts_ke(l_set.nts, l_set.server_host, NTS_KE_PORT, nts_ca_file,
+                   0) != 0){
+      fprintf(stderr, "NTS key establishment with %s failed\n",
+              l_set.server_host);
+      exit(1);
+    }
+    if (l_set.nts->port != 0){
+      l_set.server_port = l_set.nts->port;
+    }
+  }
+  if (l_set.rate <= 0 || l_set.threads < 1 || l_set.duration < 1 ||
+      l_set.sockets < 1 || l_set.sockets > MAX_LOADGEN_SOCKETS){
+    fprintf(stderr, "rate, threads and duration must be above 0 and ports "
+            "between 1 and %i\n", MAX_LOADGEN_SOCKETS);
+    exit(1);
+  }
+  return l_set;
+}
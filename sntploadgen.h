@@ -0,0 +1,127 @@
+#ifndef SNTPLOADGEN_H
+#define SNTPLOADGEN_H
+
+#include "sntptools.h"
+#include "sntpauth.h"
+#include "sntpnts.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/prctl.h>
+
+/*
+  Open loop load generator for benchmarking sntpserver. Requests are sent on a
+  schedule fixed in advance, either evenly spaced or with Poisson arrivals,
+  whether or not the server keeps up. The latency of each request is measured
+  from the time it was meant to be sent, so a generator that falls behind
+  because the server stalled still charges the stall to every request that was
+  held up by it rather than hiding it (coordinated omission).
+*/
+
+// latencies are kept in a log linear histogram, every power of two is split
+// into 2^(LATENCY_SUB_BITS - 1) buckets which bounds the error to under 2%
+#define LATENCY_SUB_BITS 7
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) << (LATENCY_SUB_BITS - 1))
+
+struct latency_histogram{
+  uint64_t counts[LATENCY_BUCKETS];
+  uint64_t total;
+  uint64_t max_ns;
+};
+
+// the low bits of the transmit fraction of each request hold its slot so the
+// reply can be matched up without a search. 2^-16 of a second is lost from the
+// timestamp the server sees, the latency uses the exact time kept in the slot
+#define LOADGEN_SLOT_BITS 16
+#define LOADGEN_SLOTS (1 << LOADGEN_SLOT_BITS)
+
+// a request waiting for its reply
+struct loadgen_request{
+  struct ntp_packet pkt;
+  struct timespec intended; // CLOCK_MONOTONIC time it was due to be sent
+  int in_flight;
+};
+
+// stores the settings for a load generator run
+struct loadgen_settings{
+  const char *server_host;
+  int server_port;
+  double rate; // requests per second across every thread
+  int poisson; // exponential gaps between requests instead of fixed ones
+  int threads;
+  int sockets; // source ports used by each thread
+  int duration; // seconds
+  struct key_table keys; // read from the -K key file
+  const struct auth_key *key; // signs every request, NULL when -k is not given
+  // keys and cookies from key establishment with the server, NULL without -N
+  struct nts_client *nts;
+};
+
+// state and results of one thread
+struct loadgen_thread{
+  pthread_t thread;
+  int id;
+  struct loadgen_settings *l_set;
+  struct sockaddr_in server_addr;
+  struct pollfd *pfds; // one per source port
+  struct loadgen_request *reqs; // LOADGEN_SLOTS of them
+  unsigned int next_slot;
+  unsigned int seed; // for the poisson gaps
+  union ntp_buffer nts_request; // a request is built here with its NTS fields
+  uint64_t nts_count; // requests sent with NTS, makes their nonces
+  uint64_t sent;
+  uint64_t received;
+  uint64_t invalid; // replies that failed the sanity checks
+  struct ntp_reject_counts rejects; // why they failed
+  uint64_t unmatched; // replies to no outstanding request
+  uint64_t overwritten; // slots reused before their reply arrived
+  uint64_t send_errors;
+  uint64_t lost;
+  struct latency_histogram hist;
+};
+
+
+struct loadgen_settings get_loadgen_settings(int argc, char *argv[]);
+void *run_loadgen_thread(void *arg);
+int initialise_loadgen_thread(struct loadgen_thread *t);
+void free_loadgen_thread(struct loadgen_thread *t);
+int send_loadgen_request(struct loadgen_thread *t, struct timespec *intended,
+                         int sockfd);
+int receive_loadgen_replies(struct loadgen_thread *t, int sockfd);
+size_t add_loadgen_nts_fields(struct loadgen_thread *t,
+                              struct loadgen_request *req);
+void make_loadgen_uid(struct loadgen_thread *t, struct loadgen_request *req,
+                      uint8_t *uid);
+double next_send_gap(struct loadgen_thread *t, double thread_rate);
+int get_latency_bucket(uint64_t value);
+uint64_t get_latency_bucket_value(int bucket);
+void record_latency(struct latency_histogram *hist, uint64_t latency_ns);
+void merge_latency_histogram(struct latency_histogram *into,
+                             struct latency_histogram *from);
+uint64_t get_latency_percentile(struct latency_histogram *hist,
+                                double percentile);
+void print_loadgen_results(struct loadgen_settings *l_set,
+                           struct loadgen_thread *threads, double elapsed);
+
+
+#define DEFAULT_SERVER_HOST "127.0.0.1"
+#define DEFAULT_SERVER_PORT 6001
+#define DEFAULT_RATE 10000.0
+#define DEFAULT_POISSON 0
+#define DEFAULT_THREADS 1
+#define DEFAULT_SOCKETS 1
+#define DEFAULT_DURATION 5
+// source ports each thread can use
+#define MAX_LOADGEN_SOCKETS 1024
+// how long replies are waited for once the last request has been sent, any
+// still outstanding after this are counted as lost
+#define LOADGEN_DRAIN_MS 500
+// replies read from a socket before the others get a turn
+#define LOADGEN_RECV_LIMIT 64
+// overdue requests sent by a late thread before it reads replies again
+#define LOADGEN_SEND_BURST 256
+
+#endif
@@ -0,0 +1,176 @@
+/* sntplog.c - asynchronous logging that keeps console output off the request
+ * path
+ */
+
+#include "sntplog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+
+int sntp_log_level = LOG_LEVEL_INFO;
+
+static struct log_ring *rings[LOG_MAX_RINGS];
+static _Atomic int num_rings;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *thread_ring;
+static pthread_t writer_thread;
+static _Atomic int writer_running;
+static _Atomic uint64_t unregistered_dropped; // threads that got no ring
+
+static const char *level_names[] = {"ERROR", "WARNING", "INFO", "DEBUG"};
+
+
+/*
+  Return codes:
+    0 - name is a known level
+    1 - unknown level, level is left untouched
+*/
+int parse_log_level(const char *name, int *level){
+  int i;
+
+  for (i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++){
+    if (strcasecmp(name, level_names[i]) == 0){
+      *level = i;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+  called the first time a thread logs, this is the only place a lock is taken
+*/
+static struct log_ring *register_thread_ring(){
+  struct log_ring *ring;
+
+  pthread_mutex_lock(&register_lock);
+  if (num_rings < LOG_MAX_RINGS && (ring = calloc(1, sizeof(*ring))) != NULL){
+    rings[num_rings] = ring;
+    // publish the ring only once it is in place
+    atomic_store_explicit(&num_rings, num_rings + 1, memory_order_release);
+    thread_ring = ring;
+  }
+  pthread_mutex_unlock(&register_lock);
+  return thread_ring;
+}
+
+
+void log_write(int level, const char *fmt, ...){
+  va_list args;
+  uint32_t head;
+  struct log_record *rec;
+  struct log_ring *ring = thread_ring;
+
+  if (ring == NULL && (ring = register_thread_ring()) == NULL){
+    atomic_fetch_add_explicit(&unregistered_dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >=
+      LOG_RING_SIZE){
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+  rec->level = level;
+  clock_gettime(CLOCK_REALTIME_COARSE, &rec->time);
+  va_start(args, fmt);
+  vsnprintf(rec->msg, sizeof(rec->msg), fmt, args);
+  va_end(args);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+
+/*
+  writes out everything waiting in every ring
+
+  Return codes:
+    the number of records written
+*/
+static int drain_rings(){
+  int i;
+  int count;
+  int written;
+  uint32_t head;
+  uint32_t tail;
+  uint64_t dropped;
+  struct log_ring *ring;
+  struct log_record *rec;
+  FILE *out;
+
+  written = 0;
+  count = atomic_load_explicit(&num_rings, memory_order_acquire);
+  for (i = 0; i < count; i++){
+    ring = rings[i];
+    head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    for (tail = ring->tail; tail != head; tail++){
+      rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+      out = (rec->level <= LOG_LEVEL_WARNING) ? stderr : stdout;
+      fprintf(out, "%ld.%03ld %s: %s\n", (long)rec->time.tv_sec,
+              rec->time.tv_nsec / 1000000, level_names[rec->level], rec->msg);
+      written++;
+    }
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+
+    dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped != ring->dropped_reported){
+      fprintf(stderr, "WARNING: %llu log records dropped, log ring full\n",
+              (unsigned long long)(dropped - ring->dropped_reported));
+      ring->dropped_reported = dropped;
+    }
+  }
+  if (written > 0){
+    fflush(stdout);
+  }
+  return written;
+}
+
+
+static void *run_log_writer(void *arg){
+  struct timespec idle_wait = {0, LOG_IDLE_WAIT_NS};
+
+  (void)arg;
+  while (atomic_load_explicit(&writer_running, memory_order_relaxed)){
+    if (drain_rings() == 0){
+      nanosleep(&idle_wait, NULL);
+    }
+  }
+  drain_rings(); // anything logged while stopping
+  return NULL;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - unable to start the writer thread
+*/
+int log_start(int level){
+  sntp_log_level = level;
+  atomic_store(&writer_running, 1);
+  if (pthread_create(&writer_thread, NULL, run_log_writer, NULL) != 0){
+    atomic_store(&writer_running, 0);
+    return 1;
+  }
+  return 0;
+}
+
+
+void log_stop(){
+  uint64_t dropped;
+
+  if (!atomic_exchange(&writer_running, 0)){
+    return;
+  }
+  pthread_join(writer_thread, NULL);
+  if ((dropped = atomic_load(&unregistered_dropped)) > 0){
+    fprintf(stderr, "WARNING: %llu log records dropped, too many threads\n",
+            (unsigned long long)dropped);
+  }
+  fflush(stdout);
+}
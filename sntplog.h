@@ -0,0 +1,68 @@
+#ifndef SNTPLOG_H
+#define SNTPLOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+  Asynchronous logging for the server. The level is checked before any of the
+  arguments are evaluated, so a disabled message costs one comparison. Enabled
+  messages are formatted into a ring owned by the calling thread and written
+  out by a background thread, a full ring drops the message and counts it
+  rather than blocking the caller.
+*/
+
+enum log_level{
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_WARNING,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_DEBUG
+};
+
+// number of records each thread can have waiting, must be a power of two
+#define LOG_RING_SIZE 1024
+// longest message kept, longer messages are truncated
+#define LOG_MSG_LEN 200
+// the maximum number of threads that can log
+#define LOG_MAX_RINGS 512
+// how long the writer sleeps for when there is nothing to write
+#define LOG_IDLE_WAIT_NS 10000000
+
+struct log_record{
+  int level;
+  struct timespec time;
+  char msg[LOG_MSG_LEN];
+};
+
+// single producer single consumer ring, head is only written by the owning
+// thread and tail only by the writer thread
+struct log_ring{
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  _Atomic uint64_t dropped;
+  uint64_t dropped_reported; // only touched by the writer thread
+  struct log_record records[LOG_RING_SIZE];
+};
+
+extern int sntp_log_level;
+
+#define log_msg(level, ...) \
+  do { \
+    if ((level) <= sntp_log_level) \
+      log_write((level), __VA_ARGS__); \
+  } while (0)
+
+#define log_error(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_msg(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+int log_start(int level);
+void log_stop();
+void log_write(int level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+int parse_log_level(const char *name, int *level);
+
+#endif
@@ -0,0 +1,409 @@
+/* sntpmulti.c - polls several servers at the same time
+ */
+
+#include "sntpmulti.h"
+
+
+/*
+  Return codes:
+    0 - at least one sample was collected
+    1 - no server gave a usable reply
+*/
+int multi_server_mode(struct client_settings *c_set){
+  int exit_code;
+  struct server_poll polls[MAX_SERVERS];
+  struct select_result result;
+
+  if (start_server_polls(c_set, polls) == 0){
+    return 1;
+  }
+  run_server_polls(c_set, polls, c_set->num_servers);
+  close_server_polls(polls, c_set->num_servers);
+  print_reply_rejects();
+
+  if ((exit_code = select_server_offset(polls, c_set->num_servers, &result,
+                                        1)) != 0){
+    return 1;
+  }
+  printf("Selected -> offset: %f, jitter: %f, from %i of %i servers\n",
+         result.offset, result.jitter, result.num_candidates,
+         result.num_sources);
+  return 0;
+}
+
+
+/*
+  sets up a poll for every server in c_set, polls must have room for
+  c_set->num_servers. returns the number of servers that can be polled
+*/
+int start_server_polls(struct client_settings *c_set, struct server_poll *polls){
+  int i;
+  int num_usable;
+
+  if (c_set->num_servers == 0){
+    fprintf(stderr, "no servers to poll, add some to servers in %s\n",
+            CONFIG_FILE);
+    return 0;
+  }
+
+  // every name is looked up at the same time
+  for (i = 0; i < c_set->num_servers; i++){
+    start_resolving_host(c_set->servers[i].host);
+  }
+  num_usable = 0;
+  for (i = 0; i < c_set->num_servers; i++){
+    memset(&polls[i], 0, sizeof(polls[i]));
+    polls[i].conf = &c_set->servers[i];
+    if (initialise_server_poll(c_set, &polls[i]) == 0){
+      num_usable++;
+    }
+  }
+  return num_usable;
+}
+
+
+/*
+  readies every server that could be set up for another round of polls, the
+  first request goes out straight away. a server that sent DENY or RSTR is
+  left out, as is one still being left alone after a RATE. returns the number
+  of servers that may still be polled in this or a later round
+*/
+int restart_server_polls(struct server_poll *polls, int num_polls){
+  int i;
+  int num_usable;
+
+  num_usable = 0;
+  for (i = 0; i < num_polls; i++){
+    if (polls[i].sockfd == -1 || polls[i].denied){
+      continue;
+    }
+    num_usable++;
+    polls[i].samples = 0;
+    polls[i].retries = 0;
+    if (polls[i].rate_backoff > 0 &&
+        get_seconds_until(&polls[i].rate_holdoff) > 0){
+      polls[i].state = POLL_DONE;
+      continue;
+    }
+    polls[i].state = POLL_IDLE;
+    get_monotonic_time(&polls[i].next_poll);
+  }
+  return num_usable;
+}
+
+
+void close_server_polls(struct server_poll *polls, int num_polls){
+  int i;
+
+  for (i = 0; i < num_polls; i++){
+    if (polls[i].sockfd != -1){
+      close(polls[i].sockfd);
+      polls[i].sockfd = -1;
+    }
+  }
+}
+
+
+// polls the servers until every one has enough samples or has given up
+void run_server_polls(struct client_settings *c_set, struct server_poll *polls,
+                      int num_polls){
+  int i;
+  int num_fds;
+  int num_active;
+  double wait;
+  struct timespec *deadline;
+  struct timespec *nearest;
+  struct timespec timeout;
+  struct pollfd pfds[MAX_SERVERS];
+  struct server_poll *ready[MAX_SERVERS];
+
+  num_active = 0;
+  for (i = 0; i < num_polls; i++){
+    num_active += polls[i].state != POLL_DONE;
+  }
+
+  while (num_active > 0){
+    // start and time out requests, then find the next thing to wake up for
+    nearest = NULL;
+    num_fds = 0;
+    for (i = 0; i < num_polls; i++){
+      if (polls[i].state == POLL_WAITING &&
+          get_seconds_until(&polls[i].recv_deadline) <= 0){
+        print_debug(c_set->debug, "no reply from '%s'", polls[i].conf->host);
+        fail_server_attempt(c_set, &polls[i]);
+      }
+      if (polls[i].state == POLL_IDLE &&
+          get_seconds_until(&polls[i].next_poll) <= 0){
+        send_server_request(c_set, &polls[i]);
+      }
+
+      if (polls[i].state == POLL_DONE){
+        continue;
+      }
+      if (polls[i].state == POLL_WAITING){
+        deadline = &polls[i].recv_deadline;
+        pfds[num_fds].fd = polls[i].sockfd;
+        pfds[num_fds].events = POLLIN;
+        ready[num_fds++] = &polls[i];
+      }
+      else{
+        deadline = &polls[i].next_poll;
+      }
+      if (nearest == NULL || deadline->tv_sec < nearest->tv_sec ||
+          (deadline->tv_sec == nearest->tv_sec &&
+           deadline->tv_nsec < nearest->tv_nsec)){
+        nearest = deadline;
+      }
+    }
+    if (nearest == NULL){
+      break;
+    }
+
+    if ((wait = get_seconds_until(nearest)) < 0){
+      wait = 0;
+    }
+    timeout.tv_sec = (time_t)wait;
+    timeout.tv_nsec = (long)((wait - timeout.tv_sec) * 1e9);
+    if (ppoll(pfds, num_fds, &timeout, NULL) <= 0){
+      continue;
+    }
+
+    for (i = 0; i < num_fds; i++){
+      if (!(pfds[i].revents & POLLIN)){
+        continue;
+      }
+      handle_server_reply(c_set, ready[i]);
+    }
+
+    num_active = 0;
+    for (i = 0; i < num_polls; i++){
+      num_active += polls[i].state != POLL_DONE;
+    }
+  }
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the server cant be polled, it is marked as done
+*/
+int initialise_server_poll(struct client_settings *c_set, struct server_poll *p){
+  int exit_code;
+  int flags;
+
+  p->state = POLL_DONE;
+  p->sockfd = -1;
+  initialise_clock_filter(&p->filter);
+  p->il_state.sockfd = -1;
+  p->poll_wait = p->conf->poll_wait >= 0 ? p->conf->poll_wait : c_set->poll_wait;
+  p->burst = c_set->iburst_enabled ? c_set->iburst_count : 0;
+
+  if ((exit_code = initialise_server_interface(p->conf->host,
+                                               p->conf->port ? p->conf->port :
+                                               c_set->server_port,
+                                               &p->info, c_set->debug)) != 0 ||
+      (exit_code = initialise_socket(&p->sockfd, c_set->debug)) != 0){
+    fprintf(stderr, "%s: ", p->conf->host);
+    print_error_message(exit_code);
+    return 1;
+  }
+  if ((flags = fcntl(p->sockfd, F_GETFL)) == -1 ||
+      fcntl(p->sockfd, F_SETFL, flags | O_NONBLOCK) == -1){
+    fprintf(stderr, "%s: ", p->conf->host);
+    print_error_message(3);
+    close(p->sockfd);
+    p->sockfd = -1;
+    return 1;
+  }
+
+  // the first request goes out straight away
+  get_monotonic_time(&p->next_poll);
+  p->state = POLL_IDLE;
+  return 0;
+}
+
+
+void send_server_request(struct client_settings *c_set, struct server_poll *p){
+  create_request(c_set, &p->il_state, &p->request_pkt, &p->request_mac);
+
+  // the next poll is timed from this request, as in unicast_mode
+  get_monotonic_time(&p->next_poll);
+  p->recv_deadline = p->next_poll;
+  add_seconds_to_timespec(&p->next_poll, p->burst > 0 ?
+                          c_set->iburst_interval : p->poll_wait);
+  add_seconds_to_timespec(&p->recv_deadline, c_set->recv_uni_timeout);
+
+  if (send_SNTP_packet(&p->request_pkt, NULL, 0, &p->request_mac, p->sockfd,
+                       p->info.addr, NULL, c_set->debug) != 0){
+    print_debug(c_set->debug, "error sending request packet to '%s'",
+                p->conf->host);
+    fail_server_attempt(c_set, p);
+    return;
+  }
+  p->state = POLL_WAITING;
+}
+
+
+/*
+  Return codes:
+    0 - a sample was taken and added to the server's clock filter
+    1 - no usable reply was read
+*/
+int handle_server_reply(struct client_settings *c_set, struct server_poll *p){
+  int exit_code;
+  struct sockaddr_in reply_addr;
+  union ntp_buffer reply;
+  size_t reply_len;
+  struct timespec dest_time;
+  struct filter_sample sample;
+
+  if (recieve_SNTP_packet(p->sockfd, &reply, &reply_len, &reply_addr,
+                          &dest_time, NULL, c_set->debug) != 0 ||
+      is_same_ipaddr(p->info.addr, reply_addr)){
+    return 1;
+  }
+
+  if ((exit_code = check_reply(c_set, &p->request_pkt, &reply.pkt,
+                               reply_len)) != 0){
+    if (exit_code == 9){
+      fprintf(stderr, "%s: ", p->conf->host);
+      print_error_message(exit_code);
+      handle_server_kiss(c_set, p, &reply.pkt);
+    }
+    else{
+      print_debug(c_set->debug, "reply from '%s' failed the sanity checks",
+                  p->conf->host);
+      fail_server_attempt(c_set, p);
+    }
+    return 1;
+  }
+
+  record_sample(c_set, &p->info, &p->request_pkt, &reply.pkt, &dest_time,
+                &p->il_state, &sample);
+  add_filter_sample(&p->filter, &sample,
+                    ldexp(1, get_clock_source_precision()));
+  // root delay and dispersion are in the 16.16 short format
+  p->stratum = reply.pkt.stratum;
+  p->root_delay = get_ntp_root_delay(&reply.pkt);
+  p->root_dispersion = get_ntp_root_dispersion(&reply.pkt);
+  p->retries = 0;
+  p->rate_backoff = 0;
+  p->samples++;
+  // the burst only ends once the server has answered, so a server that is
+  // down at the start still gets one when it comes back. once it ends the
+  // next poll is a normal one
+  if (p->burst > 0 && --p->burst == 0){
+    add_seconds_to_timespec(&p->next_poll,
+                            p->poll_wait - c_set->iburst_interval);
+  }
+  p->state = p->burst == 0 &&
+             p->samples >= (c_set->timed_repeat_updates_enabled ?
+                            c_set->timed_repeat_updates_limit : 1) ?
+             POLL_DONE : POLL_IDLE;
+  return 0;
+}
+
+
+/*
+  DENY and RSTR mean the server will not serve this client and RATE that it
+  is asking too often, any other code only ends the current round
+*/
+void handle_server_kiss(struct client_settings *c_set, struct server_poll *p,
+                        const struct ntp_packet *reply_pkt){
+  const char *code = (const char *)&reply_pkt->reference_identifier;
+
+  p->state = POLL_DONE;
+  if (memcmp(code, "DENY", 4) == 0 || memcmp(code, "RSTR", 4) == 0){
+    print_debug(c_set->debug, "'%s' refused access, not polling it again",
+                p->conf->host);
+    p->denied = 1;
+  }
+  else if (memcmp(code, "RATE", 4) == 0){
+    p->rate_backoff = p->rate_backoff == 0 ? RATE_BACKOFF_MIN :
+                      fmin(p->rate_backoff * 2, RATE_BACKOFF_MAX);
+    print_debug(c_set->debug, "'%s' is rate limiting, not polling it for %.0f "
+                "seconds", p->conf->host, p->rate_backoff);
+    get_monotonic_time(&p->rate_holdoff);
+    add_seconds_to_timespec(&p->rate_holdoff, p->rate_backoff);
+  }
+}
+
+
+// the server is tried again after its poll_wait unless it is out of retries
+void fail_server_attempt(struct client_settings *c_set, struct server_poll *p){
+  if (++p->retries >= c_set->max_unicast_retries){
+    fprintf(stderr, "%s: ", p->conf->host);
+    print_error_message(4);
+    p->state = POLL_DONE;
+    return;
+  }
+  p->state = POLL_IDLE;
+}
+
+
+/*
+  runs source selection over the servers that have samples. when show is set
+  every server is shown with a tally code as ntpq does, '*' for the system
+  peer, '+' for a server combined into the offset, '-' for one dropped by the
+  cluster algorithm, 'x' for a falseticker and ' ' for one that is unusable
+
+  Return codes:
+    0 - success, result is set
+    1 - no server replied or no majority of them agree
+*/
+int select_server_offset(struct server_poll *polls, int num_polls,
+                         struct select_result *result, int show){
+  int i;
+  int n;
+  int samples;
+  int exit_code;
+  int index[MAX_SERVERS];
+  struct select_source sources[MAX_SERVERS];
+  const char tally_codes[] = " x-+*";
+
+  // each server is represented by the sample its clock filter picked
+  n = 0;
+  samples = 0;
+  for (i = 0; i < num_polls; i++){
+    if (polls[i].filter.count == 0){
+      continue;
+    }
+    samples += polls[i].samples;
+    sources[n].offset = polls[i].filter.offset;
+    sources[n].jitter = polls[i].filter.jitter;
+    sources[n].stratum = polls[i].stratum;
+    sources[n].distance = get_root_distance(polls[i].filter.delay,
+                                            polls[i].filter.dispersion,
+                                            polls[i].filter.jitter,
+                                            polls[i].root_delay,
+                                            polls[i].root_dispersion);
+    index[n++] = i;
+  }
+  if (n == 0){
+    fprintf(stderr, "unable to collect any time samples\n");
+    return 1;
+  }
+
+  exit_code = select_sources(sources, n, result);
+  if (result->system_peer >= 0){
+    result->system_peer = index[result->system_peer];
+  }
+  if (show){
+    printf("\nStatistics -> %i samples from %i servers\n", samples, n);
+  }
+  for (i = 0; show && i < n; i++){
+    printf("%c%-20s offset: %f, root distance: %f, jitter: %f\n",
+           tally_codes[sources[i].tally], polls[index[i]].conf->host,
+           sources[i].offset, sources[i].distance, sources[i].jitter);
+  }
+  if (exit_code == 1){
+    fprintf(stderr, "no majority of the servers agree on the time\n");
+    return 1;
+  }
+  else if (exit_code == 2){
+    fprintf(stderr, "no server is synchronised closely enough to use\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SNTPMULTI_H
+#define SNTPMULTI_H
+
+#include "sntpclient.h"
+#include "sntpselect.h"
+#include <fcntl.h>
+
+/*
+  Multi server mode for the client. Every server gets a non blocking socket of
+  its own and a single loop waits on all of them at once, so N servers give N
+  samples in about one round trip rather than one after another. Each server
+  keeps its own poll_wait, retries and interleave state and results are shown
+  as they arrive. With iburst the first samples from a server are taken
+  iburst_interval apart instead of poll_wait, until it has answered
+  iburst_count times. Once every server is done the servers to trust are
+  picked with the RFC 5905 selection, cluster and combine algorithms.
+
+  A kiss-o'-death is obeyed across rounds as RFC 5905 asks. A server that
+  sends DENY or RSTR is never polled again, one that sends RATE is left out of
+  the rounds for RATE_BACKOFF_MIN seconds, twice as long for each RATE in a
+  row up to RATE_BACKOFF_MAX.
+*/
+
+// seconds a server is left alone after its first RATE kiss-o'-death
+#define RATE_BACKOFF_MIN 64
+// the longest it is left alone, the longest poll interval in RFC 5905
+#define RATE_BACKOFF_MAX 131072
+
+enum server_poll_state{
+  POLL_IDLE, // waiting until the server can be polled again
+  POLL_WAITING, // a request is waiting for its reply
+  POLL_DONE // enough samples, or the server gave up
+};
+
+struct server_poll{
+  struct server_config *conf;
+  struct host_info info;
+  int sockfd;
+  int state; // one of enum server_poll_state
+  int samples; // valid replies so far
+  int retries; // failed attempts at the current sample
+  int burst; // samples still to take in the initial burst
+  double poll_wait;
+  struct ntp_packet request_pkt;
+  struct ntp_mac request_mac; // sent after it when a key is set
+  struct timespec next_poll; // earliest time the next request can go
+  struct timespec recv_deadline; // when the current request is given up on
+  int denied; // sent DENY or RSTR, it is not polled again
+  double rate_backoff; // seconds, 0 unless the last kiss-o'-death was RATE
+  struct timespec rate_holdoff; // not polled again before this after a RATE
+  struct interleave_state il_state;
+  struct clock_filter filter;
+  // from the latest reply, for the root distance
+  int stratum;
+  double root_delay;
+  double root_dispersion;
+};
+
+
+int multi_server_mode(struct client_settings *c_set);
+int start_server_polls(struct client_settings *c_set, struct server_poll *polls);
+int restart_server_polls(struct server_poll *polls, int num_polls);
+void close_server_polls(struct server_poll *polls, int num_polls);
+void run_server_polls(struct client_settings *c_set, struct server_poll *polls,
+                      int num_polls);
+int initialise_server_poll(struct client_settings *c_set, struct server_poll *p);
+void send_server_request(struct client_settings *c_set, struct server_poll *p);
+int handle_server_reply(struct client_settings *c_set, struct server_poll *p);
+void fail_server_attempt(struct client_settings *c_set, struct server_poll *p);
+void handle_server_kiss(struct client_settings *c_set, struct server_poll *p,
+                        const struct ntp_packet *reply_pkt);
+int select_server_offset(struct server_poll *polls, int num_polls,
+                         struct select_result *result, int show);
+
+#endif
@@ -0,0 +1,616 @@
+/* sntpnts.c - NTS key establishment records, the NTS extension fields and
+   the client side of both
+ */
+
+#include "sntpnts.h"
+
+static int read_exact(SSL *ssl, uint8_t *buf, size_t len);
+static int connect_nts_ke(const char *host, int port, int debug);
+static int set_nts_ke_peer(SSL *ssl, const char *host);
+static int parse_nts_ke_response(struct nts_client *nts, const uint8_t *msg,
+                                 size_t len, int debug);
+static int exchange_nts_ke(struct nts_client *nts, SSL *ssl, int debug);
+
+
+/*
+  reads records until the end of message record, buf holds the whole message
+
+  Return codes:
+    0 - success
+    1 - the connection was closed or timed out first
+    2 - the message does not fit size bytes
+*/
+int read_nts_message(SSL *ssl, uint8_t *buf, size_t size, size_t *len){
+  int type;
+  size_t body_len;
+
+  *len = 0;
+  do{
+    if (*len + NTS_RECORD_HEADER_LEN > size){
+      return 2;
+    }
+    if (read_exact(ssl, buf + *len, NTS_RECORD_HEADER_LEN) != 0){
+      return 1;
+    }
+    type = (buf[*len] << 8 | buf[*len + 1]) & ~NTS_RECORD_CRITICAL;
+    body_len = buf[*len + 2] << 8 | buf[*len + 3];
+    *len += NTS_RECORD_HEADER_LEN;
+    if (*len + body_len > size){
+      return 2;
+    }
+    if (read_exact(ssl, buf + *len, body_len) != 0){
+      return 1;
+    }
+    *len += body_len;
+  } while (type != NTS_RECORD_END);
+  return 0;
+}
+
+
+/*
+  reads the record at *offset of a message from read_nts_message and moves it
+  on to the next one
+
+  Return codes:
+    0 - record is the next record
+    1 - there are no more
+*/
+int get_nts_record(const uint8_t *msg, size_t len, size_t *offset,
+                   struct nts_record *record){
+  size_t body_len;
+
+  if (*offset + NTS_RECORD_HEADER_LEN > len){
+    return 1;
+  }
+  body_len = msg[*offset + 2] << 8 | msg[*offset + 3];
+  if (*offset + NTS_RECORD_HEADER_LEN + body_len > len){
+    return 1;
+  }
+  record->critical = (msg[*offset] & 0x80) != 0;
+  record->type = (msg[*offset] << 8 | msg[*offset + 1]) & ~NTS_RECORD_CRITICAL;
+  record->body = msg + *offset + NTS_RECORD_HEADER_LEN;
+  record->body_len = body_len;
+  *offset += NTS_RECORD_HEADER_LEN + body_len;
+  return 0;
+}
+
+
+// appends a record at offset of buf, which the caller makes room for.
+// returns the offset after it
+size_t add_nts_record(uint8_t *buf, size_t offset, int type, int critical,
+                      const void *body, size_t body_len){
+  type |= critical ? NTS_RECORD_CRITICAL : 0;
+  buf[offset] = type >> 8;
+  buf[offset + 1] = type;
+  buf[offset + 2] = body_len >> 8;
+  buf[offset + 3] = body_len;
+  if (body_len > 0){
+    memcpy(buf + offset + NTS_RECORD_HEADER_LEN, body, body_len);
+  }
+  return offset + NTS_RECORD_HEADER_LEN + body_len;
+}
+
+
+// a record holding a single 16 bit value, as most of them do
+size_t add_nts_record_u16(uint8_t *buf, size_t offset, int type, int critical,
+                          uint16_t value){
+  uint8_t body[2];
+
+  body[0] = value >> 8;
+  body[1] = value;
+  return add_nts_record(buf, offset, type, critical, body, sizeof(body));
+}
+
+
+/*
+  the C2S and S2C keys for NTPv4 with AES-SIV-CMAC-256, both
+  AES_SIV_KEY_LEN bytes (RFC 8915 section 5.1)
+
+  Return codes:
+    0 - success
+    1 - the keys could not be exported from the session
+*/
+int export_nts_keys(SSL *ssl, uint8_t *c2s, uint8_t *s2c){
+  // the protocol, the AEAD and which direction the key is for
+  uint8_t context[5] = {NTS_PROTOCOL_NTPV4 >> 8, NTS_PROTOCOL_NTPV4 & 0xff,
+                        NTS_AEAD_AES_SIV_CMAC_256 >> 8,
+                        NTS_AEAD_AES_SIV_CMAC_256 & 0xff, 0};
+
+  if (SSL_export_keying_material(ssl, c2s, AES_SIV_KEY_LEN, NTS_EXPORTER_LABEL,
+                                 strlen(NTS_EXPORTER_LABEL), context,
+                                 sizeof(context), 1) != 1){
+    return 1;
+  }
+  context[4] = 1;
+  if (SSL_export_keying_material(ssl, s2c, AES_SIV_KEY_LEN, NTS_EXPORTER_LABEL,
+                                 strlen(NTS_EXPORTER_LABEL), context,
+                                 sizeof(context), 1) != 1){
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  writes an NTS authenticator field to buf holding the len bytes of plaintext
+  encrypted under key, with ad_len bytes of ad as the associated data and an
+  NTS_NONCE_LEN byte nonce. buf must not overlap ad or plaintext. returns the
+  length of the field
+*/
+size_t write_nts_authenticator(uint8_t *buf, const struct aes_siv_key *key,
+                               const uint8_t *ad, size_t ad_len,
+                               const uint8_t *nonce, const uint8_t *plaintext,
+                               size_t len){
+  size_t ct_len = AES_SIV_TAG_LEN + len;
+  uint8_t *body = buf + NTP_EXT_HEADER_LEN;
+  size_t length;
+
+  // the body is the nonce and ciphertext lengths then both padded to 4 bytes
+  length = write_ntp_ext_field(buf, NTS_EF_AUTHENTICATOR, NULL,
+                               4 + NTS_NONCE_LEN + ct_len);
+  body[0] = NTS_NONCE_LEN >> 8;
+  body[1] = NTS_NONCE_LEN & 0xff;
+  body[2] = ct_len >> 8;
+  body[3] = ct_len;
+  memcpy(body + 4, nonce, NTS_NONCE_LEN);
+  aes_siv_encrypt(key, ad, ad_len, nonce, NTS_NONCE_LEN, plaintext, len,
+                  body + 4 + NTS_NONCE_LEN);
+  return length;
+}
+
+
+/*
+  decrypts an NTS authenticator field into plaintext, which needs room for the
+  whole field body, and sets len to the number of bytes
+
+  Return codes:
+    0 - success
+    1 - the field is malformed or does not authenticate
+*/
+int open_nts_authenticator(const struct ntp_ext_field *field,
+                           const struct aes_siv_key *key, const uint8_t *ad,
+                           size_t ad_len, uint8_t *plaintext, size_t *len){
+  size_t nonce_len;
+  size_t ct_len;
+  size_t ct_offset;
+
+  if (field->body_len < 4){
+    return 1;
+  }
+  nonce_len = field->body[0] << 8 | field->body[1];
+  ct_len = field->body[2] << 8 | field->body[3];
+  ct_offset = 4 + ((nonce_len + 3) & ~(size_t)3);
+  // RFC 8915 asks for nonces of at least 16 bytes with AES-SIV-CMAC-256
+  if (nonce_len < NTS_NONCE_LEN || ct_len < AES_SIV_TAG_LEN ||
+      ct_offset + ct_len > field->body_len){
+    return 1;
+  }
+  if (aes_siv_decrypt(key, ad, ad_len, field->body + 4, nonce_len,
+                      field->body + ct_offset, ct_len, plaintext) != 0){
+    return 1;
+  }
+  *len = ct_len - AES_SIV_TAG_LEN;
+  return 0;
+}
+
+
+/*
+  key establishment with the NTS-KE server on host and port. the certificate
+  is checked against ca_file, or the system's trusted certificates when it is
+  NULL, and has to be for host. the keys, cookies and any server and port
+  records are kept in nts
+
+  Return codes:
+    0 - success
+    1 - unable to connect
+    2 - the TLS handshake failed or the certificate is not trusted
+    3 - the server refused, or sent a response that could not be used
+*/
+int run_nts_ke(struct nts_client *nts, const char *host, int port,
+               const char *ca_file, int debug){
+  int fd;
+  int ret;
+  SSL_CTX *ctx;
+  SSL *ssl;
+
+  // a server closing the connection early must not kill the client
+  signal(SIGPIPE, SIG_IGN);
+  if ((fd = connect_nts_ke(host, port, debug)) == -1){
+    return 1;
+  }
+  ssl = NULL;
+  ret = 2;
+  if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL ||
+      SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) != 1 ||
+      SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)NTS_ALPN,
+                              sizeof(NTS_ALPN) - 1) != 0){
+    goto done;
+  }
+  if ((ca_file != NULL ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL) :
+       SSL_CTX_set_default_verify_paths(ctx)) != 1){
+    print_debug(debug, "unable to load the trusted certificates");
+    goto done;
+  }
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  if ((ssl = SSL_new(ctx)) == NULL || SSL_set_fd(ssl, fd) != 1 ||
+      set_nts_ke_peer(ssl, host) != 0){
+    goto done;
+  }
+  if (SSL_connect(ssl) != 1){
+    print_debug(debug, "TLS handshake with %s failed: %s", host,
+                X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+    goto done;
+  }
+  ret = exchange_nts_ke(nts, ssl, debug);
+  SSL_shutdown(ssl);
+
+done:
+  SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  close(fd);
+  return ret;
+}
+
+
+/*
+  the extension fields of a request after the header already in buf: the
+  unique identifier, the cookie, placeholders asking for more cookies and the
+  authenticator over all of them under c2s. returns their length
+*/
+size_t build_nts_request(union ntp_buffer *buf, const struct aes_siv_key *c2s,
+                         const uint8_t *uid, const struct nts_cookie *cookie,
+                         int placeholders, const uint8_t *nonce){
+  int i;
+  size_t len;
+
+  len = NTP_HEADER_LEN;
+  len += write_ntp_ext_field(buf->data + len, NTS_EF_UNIQUE_ID, uid,
+                             NTS_UID_LEN);
+  len += write_ntp_ext_field(buf->data + len, NTS_EF_COOKIE, cookie->data,
+                             cookie->len);
+  // a placeholder is as long as the cookie so the reply is no larger than the
+  // request
+  for (i = 0; i < placeholders; i++){
+    len += write_ntp_ext_field(buf->data + len, NTS_EF_COOKIE_PLACEHOLDER,
+                               NULL, cookie->len);
+  }
+  len += write_nts_authenticator(buf->data + len, c2s, buf->data, len, nonce,
+                                 NULL, 0);
+  return len - NTP_HEADER_LEN;
+}
+
+
+/*
+  a reply has to echo uid and carry an authenticator under s2c, fields after
+  the authenticator are not protected and are ignored. up to max_cookies of
+  the cookies in it are copied to cookies, num_cookies is set to how many
+
+  Return codes:
+    0 - success
+    1 - the reply is not for uid or does not authenticate
+*/
+int verify_nts_reply(const struct aes_siv_key *s2c, const struct ntp_packet *pkt,
+                     const struct ntp_packet_info *info, const uint8_t *uid,
+                     struct nts_cookie *cookies, int max_cookies,
+                     int *num_cookies){
+  int found_uid;
+  size_t offset;
+  size_t start;
+  size_t len;
+  uint8_t plaintext[NTP_MAX_PACKET_LEN];
+  struct ntp_ext_field field;
+
+  *num_cookies = 0;
+  found_uid = 0;
+  offset = NTP_HEADER_LEN;
+  for (start = offset; get_ntp_ext_field(pkt, info, &offset, &field) == 0;
+       start = offset){
+    if (field.type == NTS_EF_UNIQUE_ID && field.body_len == NTS_UID_LEN &&
+        CRYPTO_memcmp(field.body, uid, NTS_UID_LEN) == 0){
+      found_uid = 1;
+    }
+    else if (field.type == NTS_EF_AUTHENTICATOR){
+      break;
+    }
+  }
+  if (!found_uid || field.type != NTS_EF_AUTHENTICATOR ||
+      open_nts_authenticator(&field, s2c, (const uint8_t *)pkt, start,
+                             plaintext, &len) != 0){
+    return 1;
+  }
+
+  // the new cookies are extension fields inside the authenticator
+  offset = 0;
+  while (next_ntp_ext_field(plaintext, len, &offset, &field) == 0){
+    if (field.type != NTS_EF_COOKIE || field.body_len > NTS_MAX_COOKIE_LEN ||
+        *num_cookies >= max_cookies){
+      continue;
+    }
+    memcpy(cookies[*num_cookies].data, field.body, field.body_len);
+    cookies[*num_cookies].len = field.body_len;
+    (*num_cookies)++;
+  }
+  return 0;
+}
+
+
+/*
+  an NTS NAK is a kiss-o'-death with code NTSN that echoes the identifier of
+  the request, it can not be authenticated as the server could not read the
+  cookie. returns 1 if pkt is one for uid
+*/
+int is_nts_nak(const struct ntp_packet *pkt, const struct ntp_packet_info *info,
+               const uint8_t *uid){
+  struct ntp_ext_field field;
+
+  return pkt->stratum == 0 &&
+         memcmp(&pkt->reference_identifier, "NTSN", 4) == 0 &&
+         find_ntp_ext_field(pkt, info, NTS_EF_UNIQUE_ID, &field) == 0 &&
+         field.body_len == NTS_UID_LEN &&
+         CRYPTO_memcmp(field.body, uid, NTS_UID_LEN) == 0;
+}
+
+
+/*
+  the extension fields for a client request with the header already in buf.
+  a cookie is used up and placeholders ask for enough new ones to refill the
+  jar, as long as the request still fits a packet. returns their length, 0 if
+  there are no cookies left and key establishment has to be run again
+*/
+size_t create_nts_request(struct nts_client *nts, union ntp_buffer *buf){
+  int placeholders;
+  size_t field_len;
+  size_t len;
+  uint8_t nonce[NTS_NONCE_LEN];
+  struct nts_cookie *cookie;
+
+  if (nts->num_cookies == 0 || RAND_bytes(nts->uid, NTS_UID_LEN) != 1 ||
+      RAND_bytes(nonce, NTS_NONCE_LEN) != 1){
+    return 0;
+  }
+  cookie = &nts->cookies[--nts->num_cookies];
+
+  field_len = NTP_EXT_HEADER_LEN + ((cookie->len + 3) & ~(size_t)3);
+  len = NTP_HEADER_LEN + NTP_EXT_HEADER_LEN + NTS_UID_LEN + field_len +
+        NTP_EXT_HEADER_LEN + 4 + NTS_NONCE_LEN + AES_SIV_TAG_LEN;
+  placeholders = NTS_MAX_COOKIES - 1 - nts->num_cookies;
+  while (placeholders > 0 && len + placeholders * field_len > NTP_MAX_PACKET_LEN){
+    placeholders--;
+  }
+  return build_nts_request(buf, &nts->c2s, nts->uid, cookie, placeholders,
+                           nonce);
+}
+
+
+/*
+  Return codes:
+    0 - the reply authenticated, the cookies in it have been kept
+    1 - it did not
+*/
+int check_nts_reply(struct nts_client *nts, const struct ntp_packet *pkt,
+                    const struct ntp_packet_info *info){
+  int num_cookies;
+
+  if (verify_nts_reply(&nts->s2c, pkt, info, nts->uid,
+                       nts->cookies + nts->num_cookies,
+                       NTS_MAX_COOKIES - nts->num_cookies, &num_cookies) != 0){
+    return 1;
+  }
+  nts->num_cookies += num_cookies;
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the connection was closed or timed out first
+*/
+static int read_exact(SSL *ssl, uint8_t *buf, size_t len){
+  int n;
+  size_t done;
+
+  for (done = 0; done < len; done += n){
+    if ((n = SSL_read(ssl, buf + done, len - done)) <= 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+// a TCP connection to host with NTS_KE_TIMEOUT on every step, -1 on failure
+static int connect_nts_ke(const char *host, int port, int debug){
+  int fd;
+  int ret;
+  char port_str[8];
+  struct timeval timeout = {NTS_KE_TIMEOUT, 0};
+  struct addrinfo hints;
+  struct addrinfo *res;
+  struct addrinfo *ai;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port_str, sizeof(port_str), "%i", port);
+  if ((ret = getaddrinfo(host, port_str, &hints, &res)) != 0){
+    print_debug(debug, "unable to resolve '%s': %s", host, gai_strerror(ret));
+    return -1;
+  }
+
+  fd = -1;
+  for (ai = res; ai != NULL; ai = ai->ai_next){
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1){
+      continue;
+    }
+    // a blocking connect is bounded by the send timeout
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0 &&
+        connect(fd, ai->ai_addr, ai->ai_addrlen) == 0){
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1){
+    print_debug(debug, "unable to connect to NTS-KE server %s:%i", host, port);
+  }
+  return fd;
+}
+
+
+/*
+  the certificate has to name host, as an address if host is one. the name is
+  also sent for servers with more than one certificate
+
+  Return codes:
+    0 - success
+    1 - host could not be set
+*/
+static int set_nts_ke_peer(SSL *ssl, const char *host){
+  struct in6_addr addr;
+
+  if (inet_pton(AF_INET, host, &addr) == 1 ||
+      inet_pton(AF_INET6, host, &addr) == 1){
+    return X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host) == 1 ? 0 : 1;
+  }
+  if (SSL_set_tlsext_host_name(ssl, host) != 1 || SSL_set1_host(ssl, host) != 1){
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  sends the request records once the handshake is done and reads the
+  response. the client offers NTPv4 with AES-SIV-CMAC-256, the only AEAD
+  supported
+
+  Return codes:
+    0 - success
+    2 - the server did not agree to ntske/1 or the connection failed
+    3 - the response could not be used
+*/
+static int exchange_nts_ke(struct nts_client *nts, SSL *ssl, int debug){
+  uint8_t msg[NTS_MAX_KE_MESSAGE_LEN];
+  uint8_t keys[2 * AES_SIV_KEY_LEN];
+  const unsigned char *alpn;
+  unsigned int alpn_len;
+  size_t len;
+
+  SSL_get0_alpn_selected(ssl, &alpn, &alpn_len);
+  if (alpn_len != sizeof(NTS_ALPN) - 2 ||
+      memcmp(alpn, NTS_ALPN + 1, alpn_len) != 0){
+    print_debug(debug, "the NTS-KE server did not agree to ntske/1");
+    return 2;
+  }
+
+  len = add_nts_record_u16(msg, 0, NTS_RECORD_NEXT_PROTOCOL, 1,
+                           NTS_PROTOCOL_NTPV4);
+  len = add_nts_record_u16(msg, len, NTS_RECORD_AEAD, 0,
+                           NTS_AEAD_AES_SIV_CMAC_256);
+  len = add_nts_record(msg, len, NTS_RECORD_END, 1, NULL, 0);
+  if (SSL_write(ssl, msg, len) != (int)len ||
+      read_nts_message(ssl, msg, sizeof(msg), &len) != 0){
+    print_debug(debug, "NTS-KE exchange failed");
+    return 2;
+  }
+  if (parse_nts_ke_response(nts, msg, len, debug) != 0){
+    return 3;
+  }
+
+  if (export_nts_keys(ssl, keys, keys + AES_SIV_KEY_LEN) != 0){
+    return 3;
+  }
+  expand_aes_siv_key(&nts->c2s, keys);
+  expand_aes_siv_key(&nts->s2c, keys + AES_SIV_KEY_LEN);
+  OPENSSL_cleanse(keys, sizeof(keys));
+  print_debug(debug, "NTS-KE gave %i cookies", nts->num_cookies);
+  return 0;
+}
+
+
+/*
+  the server has to have picked NTPv4 and AES-SIV-CMAC-256 and sent at least
+  one cookie, an error record or a critical record that is not known fails it
+
+  Return codes:
+    0 - success
+    1 - the response can not be used
+*/
+static int parse_nts_ke_response(struct nts_client *nts, const uint8_t *msg,
+                                 size_t len, int debug){
+  int ntpv4;
+  int aead;
+  size_t offset;
+  struct nts_record record;
+
+  ntpv4 = 0;
+  aead = 0;
+  nts->server[0] = '\0';
+  nts->port = 0;
+  nts->num_cookies = 0;
+  offset = 0;
+  while (get_nts_record(msg, len, &offset, &record) == 0){
+    switch (record.type){
+      case NTS_RECORD_END:
+        break;
+
+      case NTS_RECORD_NEXT_PROTOCOL:
+        ntpv4 = record.body_len == 2 &&
+                (record.body[0] << 8 | record.body[1]) == NTS_PROTOCOL_NTPV4;
+        break;
+
+      case NTS_RECORD_ERROR:
+        print_debug(debug, "NTS-KE server sent error %i",
+                    record.body_len == 2 ? record.body[0] << 8 | record.body[1] : -1);
+        return 1;
+
+      case NTS_RECORD_WARNING:
+        break;
+
+      case NTS_RECORD_AEAD:
+        aead = record.body_len == 2 &&
+               (record.body[0] << 8 | record.body[1]) ==
+               NTS_AEAD_AES_SIV_CMAC_256;
+        break;
+
+      case NTS_RECORD_COOKIE:
+        if (record.body_len <= NTS_MAX_COOKIE_LEN &&
+            nts->num_cookies < NTS_MAX_COOKIES){
+          memcpy(nts->cookies[nts->num_cookies].data, record.body,
+                 record.body_len);
+          nts->cookies[nts->num_cookies].len = record.body_len;
+          nts->num_cookies++;
+        }
+        break;
+
+      case NTS_RECORD_SERVER:
+        if (record.body_len > 0 && record.body_len < sizeof(nts->server)){
+          memcpy(nts->server, record.body, record.body_len);
+          nts->server[record.body_len] = '\0';
+        }
+        break;
+
+      case NTS_RECORD_PORT:
+        if (record.body_len == 2){
+          nts->port = record.body[0] << 8 | record.body[1];
+        }
+        break;
+
+      default:
+        if (record.critical){
+          print_debug(debug, "NTS-KE server sent unknown critical record %i",
+                      record.type);
+          return 1;
+        }
+    }
+  }
+  if (!ntpv4 || !aead || nts->num_cookies == 0){
+    print_debug(debug, "NTS-KE server did not agree to NTPv4 with "
+                "AES-SIV-CMAC-256 or sent no cookies");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,140 @@
+#ifndef SNTPNTS_H
+#define SNTPNTS_H
+
+#include "reusedlib.h" // print_debug
+#include "sntpcodec.h"
+#include "sntpsiv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+#include <openssl/x509v3.h>
+
+/*
+  Network Time Security (RFC 8915), the parts shared by the server, client and
+  load generator. Keys are agreed in NTS key establishment (NTS-KE), a single
+  exchange of records over TLS 1.3 after which both ends export the same
+  client to server (C2S) and server to client (S2C) keys from the session. The
+  server also hands out cookies, both keys encrypted under a key only it
+  knows, so it keeps no state for any client.
+
+  Each request then carries a unique identifier, one cookie and an NTS
+  authenticator field which protects everything before it with AES-SIV under
+  the C2S key. The reply echoes the identifier and carries fresh cookies
+  encrypted under the S2C key, one for the cookie and for each placeholder in
+  the request, so a client never has to send a cookie twice and can not be
+  followed by it. The fields are built and read in place in the packet
+  buffers, the associated data is always the bytes before the authenticator.
+*/
+
+#define NTS_KE_PORT 4460
+// the ALPN protocol list with its length byte, as OpenSSL wants it
+#define NTS_ALPN "\x07ntske/1"
+#define NTS_EXPORTER_LABEL "EXPORTER-network-time-security"
+
+enum nts_record_type{
+  NTS_RECORD_END, // end of message
+  NTS_RECORD_NEXT_PROTOCOL,
+  NTS_RECORD_ERROR,
+  NTS_RECORD_WARNING,
+  NTS_RECORD_AEAD,
+  NTS_RECORD_COOKIE,
+  NTS_RECORD_SERVER, // NTP server to use, when not the NTS-KE server
+  NTS_RECORD_PORT // NTP port to use, when not 123
+};
+
+// the top bit of a record type, set when it must be understood
+#define NTS_RECORD_CRITICAL 0x8000
+#define NTS_RECORD_HEADER_LEN 4
+// the most a message of records can be, either way
+#define NTS_MAX_KE_MESSAGE_LEN 4096
+
+#define NTS_PROTOCOL_NTPV4 0
+#define NTS_AEAD_AES_SIV_CMAC_256 15
+
+// error codes in an error record
+#define NTS_ERROR_UNRECOGNIZED_CRITICAL 0
+#define NTS_ERROR_BAD_REQUEST 1
+#define NTS_ERROR_INTERNAL 2
+
+// extension field types
+#define NTS_EF_UNIQUE_ID 0x0104
+#define NTS_EF_COOKIE 0x0204
+#define NTS_EF_COOKIE_PLACEHOLDER 0x0304
+#define NTS_EF_AUTHENTICATOR 0x0404
+
+// cookies a client keeps and a server hands out at once
+#define NTS_MAX_COOKIES 8
+#define NTS_MAX_COOKIE_LEN 256
+#define NTS_UID_LEN 32
+#define NTS_NONCE_LEN 16
+// seconds a key establishment is given to connect and each read or write
+#define NTS_KE_TIMEOUT 5
+
+// a cookie as the server sent it, only the server can read it
+struct nts_cookie{
+  uint8_t data[NTS_MAX_COOKIE_LEN];
+  size_t len;
+};
+
+// what a client has from key establishment, refreshed by every reply
+struct nts_client{
+  char server[NI_MAXHOST]; // NTP server from a server record, empty if none
+  int port; // NTP port from a port record, 0 if none
+  struct aes_siv_key c2s;
+  struct aes_siv_key s2c;
+  struct nts_cookie cookies[NTS_MAX_COOKIES];
+  int num_cookies;
+  uint8_t uid[NTS_UID_LEN]; // of the last request sent
+};
+
+// a record of an NTS-KE message, body points into the message
+struct nts_record{
+  int type;
+  int critical;
+  const uint8_t *body;
+  size_t body_len;
+};
+
+
+int read_nts_message(SSL *ssl, uint8_t *buf, size_t size, size_t *len);
+int get_nts_record(const uint8_t *msg, size_t len, size_t *offset,
+                   struct nts_record *record);
+size_t add_nts_record(uint8_t *buf, size_t offset, int type, int critical,
+                      const void *body, size_t body_len);
+size_t add_nts_record_u16(uint8_t *buf, size_t offset, int type, int critical,
+                          uint16_t value);
+int export_nts_keys(SSL *ssl, uint8_t *c2s, uint8_t *s2c);
+size_t write_nts_authenticator(uint8_t *buf, const struct aes_siv_key *key,
+                               const uint8_t *ad, size_t ad_len,
+                               const uint8_t *nonce, const uint8_t *plaintext,
+                               size_t len);
+int open_nts_authenticator(const struct ntp_ext_field *field,
+                           const struct aes_siv_key *key, const uint8_t *ad,
+                           size_t ad_len, uint8_t *plaintext, size_t *len);
+int run_nts_ke(struct nts_client *nts, const char *host, int port,
+               const char *ca_file, int debug);
+size_t build_nts_request(union ntp_buffer *buf, const struct aes_siv_key *c2s,
+                         const uint8_t *uid, const struct nts_cookie *cookie,
+                         int placeholders, const uint8_t *nonce);
+int verify_nts_reply(const struct aes_siv_key *s2c, const struct ntp_packet *pkt,
+                     const struct ntp_packet_info *info, const uint8_t *uid,
+                     struct nts_cookie *cookies, int max_cookies,
+                     int *num_cookies);
+int is_nts_nak(const struct ntp_packet *pkt, const struct ntp_packet_info *info,
+               const uint8_t *uid);
+size_t create_nts_request(struct nts_client *nts, union ntp_buffer *buf);
+int check_nts_reply(struct nts_client *nts, const struct ntp_packet *pkt,
+                    const struct ntp_packet_info *info);
+
+#endif
@@ -0,0 +1,521 @@
+/* sntpntsserver.c - NTS key establishment and the cookies and extension
+   fields of NTS requests on the server
+ */
+
+#include "sntpntsserver.h"
+
+// what the cookie key of a rotation period is derived with
+#define NTS_COOKIE_KEY_LABEL "sntp cookie key"
+// the NTP port, a port record is only sent for any other
+#define NTP_DEFAULT_PORT 123
+
+static void *run_nts_ke_thread(void *arg);
+static void serve_nts_ke(SSL *ssl, struct nts_keys *keys,
+                         struct sockaddr_in *addr);
+static int has_nts_value(const struct nts_record *record, int value);
+static int select_nts_alpn(SSL *ssl, const unsigned char **out,
+                           unsigned char *outlen, const unsigned char *in,
+                           unsigned int inlen, void *arg);
+static const struct aes_siv_key *get_cookie_key(struct nts_keys *keys,
+                                                uint32_t id);
+static void make_nts_cookie(struct nts_keys *keys, const uint8_t *client_keys,
+                            uint32_t now, uint8_t *cookie);
+static int open_nts_cookie(struct nts_keys *keys,
+                           const struct ntp_ext_field *field, uint32_t now,
+                           uint8_t *client_keys);
+static void next_nts_nonce(struct nts_keys *keys, uint8_t *nonce);
+
+
+/*
+  loads the certificate and key, makes the master key and binds the NTS-KE
+  port. only TLS 1.3 is offered, and no session tickets as a client runs key
+  establishment so rarely that resuming would save nothing
+
+  Return codes:
+    0 - success
+    1 - the certificate or key could not be loaded
+    2 - the socket could not be set up
+*/
+int initialise_nts_server(struct nts_server *nts, int debug){
+  int optval;
+  struct sockaddr_in addr;
+
+  if ((nts->ctx = SSL_CTX_new(TLS_server_method())) == NULL ||
+      SSL_CTX_set_min_proto_version(nts->ctx, TLS1_3_VERSION) != 1){
+    print_debug(debug, "unable to set up TLS");
+    return 1;
+  }
+  if (SSL_CTX_use_certificate_chain_file(nts->ctx, nts->cert_file) != 1 ||
+      SSL_CTX_use_PrivateKey_file(nts->ctx, nts->key_file,
+                                  SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(nts->ctx) != 1){
+    print_debug(debug, "unable to load '%s' and '%s'", nts->cert_file,
+                nts->key_file);
+    return 1;
+  }
+  SSL_CTX_set_alpn_select_cb(nts->ctx, select_nts_alpn, NULL);
+  SSL_CTX_set_num_tickets(nts->ctx, 0);
+  if (RAND_bytes(nts->master_key, sizeof(nts->master_key)) != 1){
+    print_debug(debug, "unable to make the cookie master key");
+    return 1;
+  }
+
+  if ((nts->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1){
+    print_debug(debug, "error creating the NTS-KE socket");
+    return 2;
+  }
+  optval = 1;
+  if (setsockopt(nts->listen_fd, SOL_SOCKET, SO_REUSEADDR, &optval,
+                 sizeof(optval)) < 0){
+    print_debug(debug, "error setting up reuseable address");
+    return 2;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(nts->ke_port);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if (bind(nts->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(nts->listen_fd, SOMAXCONN) == -1){
+    print_debug(debug, "error binding to NTS-KE port %i", nts->ke_port);
+    return 2;
+  }
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - a thread could not be started
+*/
+int start_nts_server(struct nts_server *nts){
+  int i;
+
+  // a client closing its connection early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < nts->ke_threads; i++){
+    if (pthread_create(&nts->threads[i], NULL, run_nts_ke_thread, nts) != 0){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - no random nonce prefix could be made
+*/
+int initialise_nts_keys(struct nts_keys *keys, const struct nts_server *nts){
+  memset(keys, 0, sizeof(*keys));
+  keys->server = nts;
+  if (RAND_bytes(keys->nonce_prefix, sizeof(keys->nonce_prefix)) != 1){
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  finds the NTS fields of a request. one with none of them is left alone,
+  just as any other extension field. otherwise it needs a unique identifier,
+  exactly one cookie and an authenticator, fields after the authenticator are
+  not protected by it and are ignored. now is the NTP time in seconds
+
+  Return codes:
+    0 - not an NTS request or a valid one, req->state says which
+    1 - malformed, the request is dropped
+    2 - the cookie or authenticator could not be read, a NAK is sent
+*/
+int check_nts_request(struct nts_keys *keys, const struct ntp_packet *pkt,
+                      const struct ntp_packet_info *info, uint32_t now,
+                      struct nts_request *req){
+  int num_cookies;
+  int placeholders;
+  int found_auth;
+  size_t offset;
+  size_t start;
+  size_t auth_start;
+  size_t len;
+  uint8_t plaintext[NTP_MAX_PACKET_LEN];
+  struct ntp_ext_field field;
+  struct ntp_ext_field cookie;
+  struct aes_siv_key c2s;
+
+  req->state = NTS_REQUEST_NONE;
+  if (info->num_ext == 0){
+    return 0;
+  }
+
+  req->uid = NULL;
+  num_cookies = 0;
+  placeholders = 0;
+  found_auth = 0;
+  offset = NTP_HEADER_LEN;
+  for (start = offset; !found_auth &&
+       get_ntp_ext_field(pkt, info, &offset, &field) == 0; start = offset){
+    if (field.type == NTS_EF_UNIQUE_ID){
+      req->uid = field.body;
+      req->uid_len = field.body_len;
+    }
+    else if (field.type == NTS_EF_COOKIE){
+      cookie = field;
+      num_cookies++;
+    }
+    // a placeholder shorter than a cookie would let the reply be larger than
+    // the request
+    else if (field.type == NTS_EF_COOKIE_PLACEHOLDER &&
+             field.body_len >= NTS_COOKIE_LEN){
+      placeholders++;
+    }
+    else if (field.type == NTS_EF_AUTHENTICATOR){
+      // the associated data is everything before it
+      auth_start = start;
+      found_auth = 1;
+    }
+  }
+  if (req->uid == NULL && num_cookies == 0 && !found_auth){
+    return 0;
+  }
+  if (req->uid == NULL || req->uid_len < NTS_UID_LEN ||
+      req->uid_len > NTS_MAX_UID_LEN || num_cookies != 1 || !found_auth){
+    return 1;
+  }
+
+  req->state = NTS_REQUEST_NAK;
+  if (open_nts_cookie(keys, &cookie, now, req->keys) != 0){
+    return 2;
+  }
+  expand_aes_siv_key(&c2s, req->keys);
+  if (open_nts_authenticator(&field, &c2s, (const uint8_t *)pkt, auth_start,
+                             plaintext, &len) != 0){
+    OPENSSL_cleanse(&c2s, sizeof(c2s));
+    OPENSSL_cleanse(req->keys, sizeof(req->keys));
+    return 2;
+  }
+  OPENSSL_cleanse(&c2s, sizeof(c2s));
+  expand_aes_siv_key(&req->s2c, req->keys + AES_SIV_KEY_LEN);
+
+  req->num_cookies = 1 + placeholders;
+  if (req->num_cookies > NTS_MAX_COOKIES){
+    req->num_cookies = NTS_MAX_COOKIES;
+  }
+  req->state = NTS_REQUEST_VALID;
+  return 0;
+}
+
+
+/*
+  the extension fields of the reply to req, written to buf which has room for
+  NTS_MAX_REPLY_EXT_LEN. a NAK only echoes the unique identifier, a valid
+  request also gets an authenticator under the S2C key over reply_pkt and the
+  identifier, holding its new cookies. the client keys are wiped once used.
+  returns the length of the fields, 0 if req is not an NTS request
+*/
+size_t write_nts_reply(struct nts_keys *keys, struct nts_request *req,
+                       const struct ntp_packet *reply_pkt, uint8_t *buf,
+                       uint32_t now){
+  int i;
+  size_t len;
+  size_t ad_len;
+  size_t plaintext_len;
+  uint8_t ad[NTP_HEADER_LEN + NTP_EXT_HEADER_LEN + NTS_MAX_UID_LEN];
+  uint8_t plaintext[NTS_MAX_COOKIES * (NTP_EXT_HEADER_LEN + NTS_COOKIE_LEN)];
+  uint8_t cookie[NTS_COOKIE_LEN];
+  uint8_t nonce[NTS_NONCE_LEN];
+
+  if (req->state == NTS_REQUEST_NONE){
+    return 0;
+  }
+  len = write_ntp_ext_field(buf, NTS_EF_UNIQUE_ID, req->uid, req->uid_len);
+  if (req->state != NTS_REQUEST_VALID){
+    return len;
+  }
+
+  // the header is sent from a buffer of its own, the associated data has to
+  // be in one piece
+  memcpy(ad, reply_pkt, NTP_HEADER_LEN);
+  memcpy(ad + NTP_HEADER_LEN, buf, len);
+  ad_len = NTP_HEADER_LEN + len;
+
+  plaintext_len = 0;
+  for (i = 0; i < req->num_cookies; i++){
+    make_nts_cookie(keys, req->keys, now, cookie);
+    plaintext_len += write_ntp_ext_field(plaintext + plaintext_len,
+                                         NTS_EF_COOKIE, cookie, sizeof(cookie));
+  }
+  next_nts_nonce(keys, nonce);
+  len += write_nts_authenticator(buf + len, &req->s2c, ad, ad_len, nonce,
+                                 plaintext, plaintext_len);
+
+  OPENSSL_cleanse(req->keys, sizeof(req->keys));
+  OPENSSL_cleanse(&req->s2c, sizeof(req->s2c));
+  req->state = NTS_REQUEST_NONE;
+  return len;
+}
+
+
+/*
+  every thread accepts from the same socket, the kernel hands each
+  connection to one of them. a client that stalls holds its thread for at
+  most NTS_KE_TIMEOUT each read or write
+*/
+static void *run_nts_ke_thread(void *arg){
+  int fd;
+  socklen_t addr_len;
+  struct sockaddr_in addr;
+  struct timeval timeout = {NTS_KE_TIMEOUT, 0};
+  struct nts_server *nts = arg;
+  struct nts_keys keys;
+  SSL *ssl;
+
+  if (initialise_nts_keys(&keys, nts) != 0){
+    log_error("unable to start NTS-KE thread");
+    return NULL;
+  }
+  while (1){
+    addr_len = sizeof(addr);
+    if ((fd = accept(nts->listen_fd, (struct sockaddr *)&addr,
+                     &addr_len)) == -1){
+      if (errno != EINTR && errno != ECONNABORTED){
+        log_error("error accepting NTS-KE connection");
+      }
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if ((ssl = SSL_new(nts->ctx)) != NULL && SSL_set_fd(ssl, fd) == 1){
+      if (SSL_accept(ssl) == 1){
+        serve_nts_ke(ssl, &keys, &addr);
+        SSL_shutdown(ssl);
+      }
+      else{
+        log_debug("NTS-KE handshake with %s failed", inet_ntoa(addr.sin_addr));
+      }
+    }
+    SSL_free(ssl);
+    close(fd);
+  }
+  return NULL;
+}
+
+
+/*
+  reads the request records and answers with the protocol and AEAD, the
+  port to use if it is not 123 and NTS_MAX_COOKIES cookies. a request that
+  offers nothing the server supports gets an empty next protocol record, one
+  that can not be understood gets an error record
+*/
+static void serve_nts_ke(SSL *ssl, struct nts_keys *keys,
+                         struct sockaddr_in *addr){
+  int i;
+  int error;
+  int has_protocol;
+  int ntpv4;
+  int aead;
+  uint32_t now;
+  size_t len;
+  size_t offset;
+  uint8_t msg[NTS_MAX_KE_MESSAGE_LEN];
+  uint8_t client_keys[2 * AES_SIV_KEY_LEN];
+  uint8_t cookie[NTS_COOKIE_LEN];
+  struct nts_record record;
+
+  if (read_nts_message(ssl, msg, sizeof(msg), &len) != 0){
+    log_debug("unable to read NTS-KE request from %s",
+              inet_ntoa(addr->sin_addr));
+    return;
+  }
+
+  error = -1;
+  has_protocol = 0;
+  ntpv4 = 0;
+  aead = 0;
+  offset = 0;
+  while (get_nts_record(msg, len, &offset, &record) == 0){
+    switch (record.type){
+      case NTS_RECORD_END:
+        break;
+
+      case NTS_RECORD_NEXT_PROTOCOL:
+        has_protocol = 1;
+        ntpv4 = has_nts_value(&record, NTS_PROTOCOL_NTPV4);
+        break;
+
+      case NTS_RECORD_AEAD:
+        aead = has_nts_value(&record, NTS_AEAD_AES_SIV_CMAC_256);
+        break;
+
+      // only a server sends errors and warnings
+      case NTS_RECORD_ERROR:
+      case NTS_RECORD_WARNING:
+        error = NTS_ERROR_BAD_REQUEST;
+        break;
+
+      default:
+        if (record.critical){
+          error = NTS_ERROR_UNRECOGNIZED_CRITICAL;
+        }
+    }
+  }
+  if (error == -1 && !has_protocol){
+    error = NTS_ERROR_BAD_REQUEST;
+  }
+  if (error == -1 && ntpv4 && aead &&
+      export_nts_keys(ssl, client_keys, client_keys + AES_SIV_KEY_LEN) != 0){
+    error = NTS_ERROR_INTERNAL;
+  }
+
+  if (error != -1){
+    log_debug("NTS-KE request from %s failed with error %i",
+              inet_ntoa(addr->sin_addr), error);
+    len = add_nts_record_u16(msg, 0, NTS_RECORD_ERROR, 1, error);
+  }
+  else if (!ntpv4 || !aead){
+    len = add_nts_record(msg, 0, NTS_RECORD_NEXT_PROTOCOL, 1, NULL, 0);
+  }
+  else{
+    len = add_nts_record_u16(msg, 0, NTS_RECORD_NEXT_PROTOCOL, 1,
+                             NTS_PROTOCOL_NTPV4);
+    len = add_nts_record_u16(msg, len, NTS_RECORD_AEAD, 0,
+                             NTS_AEAD_AES_SIV_CMAC_256);
+    if (keys->server->ntp_port != NTP_DEFAULT_PORT){
+      len = add_nts_record_u16(msg, len, NTS_RECORD_PORT, 0,
+                               keys->server->ntp_port);
+    }
+    now = (uint32_t)(get_ntp_time_of_day() >> 32);
+    for (i = 0; i < NTS_MAX_COOKIES; i++){
+      make_nts_cookie(keys, client_keys, now, cookie);
+      len = add_nts_record(msg, len, NTS_RECORD_COOKIE, 0, cookie,
+                           sizeof(cookie));
+    }
+    OPENSSL_cleanse(client_keys, sizeof(client_keys));
+    log_debug("NTS-KE with %s done", inet_ntoa(addr->sin_addr));
+  }
+  len = add_nts_record(msg, len, NTS_RECORD_END, 1, NULL, 0);
+  if (SSL_write(ssl, msg, len) != (int)len){
+    log_debug("unable to send NTS-KE response to %s",
+              inet_ntoa(addr->sin_addr));
+  }
+}
+
+
+// returns 1 if the list of 16 bit values in a record has value
+static int has_nts_value(const struct nts_record *record, int value){
+  size_t i;
+
+  for (i = 0; i + 1 < record->body_len; i += 2){
+    if ((record->body[i] << 8 | record->body[i + 1]) == value){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+// a client that does not offer ntske/1 gets a fatal alert
+static int select_nts_alpn(SSL *ssl, const unsigned char **out,
+                           unsigned char *outlen, const unsigned char *in,
+                           unsigned int inlen, void *arg){
+  if (SSL_select_next_proto((unsigned char **)out, outlen,
+                            (const unsigned char *)NTS_ALPN,
+                            sizeof(NTS_ALPN) - 1, in,
+                            inlen) != OPENSSL_NPN_NEGOTIATED){
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+  }
+  return SSL_TLSEXT_ERR_OK;
+}
+
+
+/*
+  the key of rotation period id, derived from the master key and expanded
+  the first time this thread needs it. a slot is reused once its period is
+  too old for its cookies to be accepted
+*/
+static const struct aes_siv_key *get_cookie_key(struct nts_keys *keys,
+                                                uint32_t id){
+  struct nts_cookie_key *entry = &keys->cookie_keys[id % NTS_COOKIE_KEYS];
+  uint8_t label[sizeof(NTS_COOKIE_KEY_LABEL) + 4];
+  uint8_t raw[AES_SIV_KEY_LEN];
+  unsigned int raw_len;
+
+  if (!entry->valid || entry->id != id){
+    memcpy(label, NTS_COOKIE_KEY_LABEL, sizeof(NTS_COOKIE_KEY_LABEL));
+    label[sizeof(NTS_COOKIE_KEY_LABEL)] = id >> 24;
+    label[sizeof(NTS_COOKIE_KEY_LABEL) + 1] = id >> 16;
+    label[sizeof(NTS_COOKIE_KEY_LABEL) + 2] = id >> 8;
+    label[sizeof(NTS_COOKIE_KEY_LABEL) + 3] = id;
+    // HMAC-SHA256 gives exactly AES_SIV_KEY_LEN bytes
+    HMAC(EVP_sha256(), keys->server->master_key,
+         sizeof(keys->server->master_key), label, sizeof(label), raw,
+         &raw_len);
+    expand_aes_siv_key(&entry->key, raw);
+    OPENSSL_cleanse(raw, sizeof(raw));
+    entry->id = id;
+    entry->valid = 1;
+  }
+  return &entry->key;
+}
+
+
+/*
+  a cookie is the rotation period it was made in, a nonce and then both
+  client keys encrypted under the key of that period, with the period as the
+  associated data
+*/
+static void make_nts_cookie(struct nts_keys *keys, const uint8_t *client_keys,
+                            uint32_t now, uint8_t *cookie){
+  uint32_t id = now / keys->server->cookie_rotation;
+
+  cookie[0] = id >> 24;
+  cookie[1] = id >> 16;
+  cookie[2] = id >> 8;
+  cookie[3] = id;
+  next_nts_nonce(keys, cookie + 4);
+  aes_siv_encrypt(get_cookie_key(keys, id), cookie, 4, cookie + 4,
+                  NTS_NONCE_LEN, client_keys, 2 * AES_SIV_KEY_LEN,
+                  cookie + 4 + NTS_NONCE_LEN);
+}
+
+
+/*
+  Return codes:
+    0 - success, client_keys holds the C2S and S2C keys
+    1 - the cookie is too old, not one of ours or has been tampered with
+*/
+static int open_nts_cookie(struct nts_keys *keys,
+                           const struct ntp_ext_field *field, uint32_t now,
+                           uint8_t *client_keys){
+  uint32_t id;
+  const uint8_t *cookie = field->body;
+
+  if (field->body_len != NTS_COOKIE_LEN){
+    return 1;
+  }
+  id = (uint32_t)cookie[0] << 24 | cookie[1] << 16 | cookie[2] << 8 | cookie[3];
+  // a period from the future wraps around and is rejected too, so a forged
+  // cookie never makes a key be derived
+  if (now / keys->server->cookie_rotation - id >= NTS_COOKIE_KEYS){
+    return 1;
+  }
+  if (aes_siv_decrypt(get_cookie_key(keys, id), cookie, 4, cookie + 4,
+                      NTS_NONCE_LEN, cookie + 4 + NTS_NONCE_LEN,
+                      NTS_COOKIE_LEN - 4 - NTS_NONCE_LEN, client_keys) != 0){
+    return 1;
+  }
+  return 0;
+}
+
+
+static void next_nts_nonce(struct nts_keys *keys, uint8_t *nonce){
+  int i;
+  uint64_t count = keys->nonce_count++;
+
+  memcpy(nonce, keys->nonce_prefix, sizeof(keys->nonce_prefix));
+  for (i = NTS_NONCE_LEN - 1; i >= (int)sizeof(keys->nonce_prefix); i--){
+    nonce[i] = count;
+    count >>= 8;
+  }
+}
@@ -0,0 +1,98 @@
+#ifndef SNTPNTSSERVER_H
+#define SNTPNTSSERVER_H
+
+#include "sntpnts.h"
+#include "sntptools.h" // get_ntp_time_of_day
+#include "sntplog.h"
+#include <pthread.h>
+#include <signal.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/*
+  The server side of NTS. Key establishment runs on its own threads, each
+  taking connections from a shared listening socket, as a handshake costs far
+  more than any request and must never hold up a worker.
+
+  Cookies hold the C2S and S2C keys of a client encrypted with AES-SIV under a
+  cookie key, so the server keeps nothing per client. Cookie keys are derived
+  from a master key made at startup and the number of the rotation period,
+  the cookie starts with that number. Every thread derives and expands the
+  few keys it needs itself the first time it sees each period, nothing is
+  shared between threads after startup except the read only master key, so
+  the request path takes no lock. Cookies from the last NTS_COOKIE_KEYS
+  periods are accepted, a restart makes a new master key so a NAK then sends
+  clients back to key establishment.
+*/
+
+// the most key establishment threads that can be started
+#define MAX_NTS_KE_THREADS 16
+// cookie keys kept by each thread, the current rotation period and those
+// before it whose cookies are still accepted
+#define NTS_COOKIE_KEYS 3
+// key id, nonce, then the SIV tag and both client keys
+#define NTS_COOKIE_LEN (4 + NTS_NONCE_LEN + AES_SIV_TAG_LEN + 2 * AES_SIV_KEY_LEN)
+// the largest unique identifier echoed back
+#define NTS_MAX_UID_LEN 64
+// room for the extension fields of any reply: the unique identifier and an
+// authenticator holding NTS_MAX_COOKIES cookies
+#define NTS_MAX_REPLY_EXT_LEN 1024
+
+// settings read from the config file and what key establishment runs on
+struct nts_server{
+  int enabled;
+  int ke_port;
+  const char *cert_file; // certificate chain, PEM
+  const char *key_file; // its private key, PEM
+  int ke_threads;
+  int cookie_rotation; // seconds each cookie key is used for
+  int ntp_port; // sent in a port record when it is not 123
+  SSL_CTX *ctx;
+  int listen_fd;
+  uint8_t master_key[AES_SIV_KEY_LEN];
+  pthread_t threads[MAX_NTS_KE_THREADS];
+};
+
+struct nts_cookie_key{
+  uint32_t id; // the rotation period, valid when key has been derived
+  int valid;
+  struct aes_siv_key key;
+};
+
+// owned by a single thread
+struct nts_keys{
+  const struct nts_server *server;
+  struct nts_cookie_key cookie_keys[NTS_COOKIE_KEYS];
+  // nonces are the prefix then a count, unique without asking for randomness
+  // on every packet
+  uint8_t nonce_prefix[8];
+  uint64_t nonce_count;
+};
+
+enum nts_request_state{
+  NTS_REQUEST_NONE, // not an NTS request
+  NTS_REQUEST_VALID,
+  NTS_REQUEST_NAK // the cookie could not be read, a NAK is sent
+};
+
+struct nts_request{
+  int state; // one of enum nts_request_state
+  const uint8_t *uid; // in the receive buffer, the whole field body
+  size_t uid_len;
+  int num_cookies; // to send back, one for the cookie and each placeholder
+  uint8_t keys[2 * AES_SIV_KEY_LEN]; // C2S then S2C, from the cookie
+  struct aes_siv_key s2c;
+};
+
+
+int initialise_nts_server(struct nts_server *nts, int debug);
+int start_nts_server(struct nts_server *nts);
+int initialise_nts_keys(struct nts_keys *keys, const struct nts_server *nts);
+int check_nts_request(struct nts_keys *keys, const struct ntp_packet *pkt,
+                      const struct ntp_packet_info *info, uint32_t now,
+                      struct nts_request *req);
+size_t write_nts_reply(struct nts_keys *keys, struct nts_request *req,
+                       const struct ntp_packet *reply_pkt, uint8_t *buf,
+                       uint32_t now);
+
+#endif
@@ -0,0 +1,118 @@
+/* sntpratelimit.c - per client token bucket rate limiter for the server
+*/
+
+#include "sntpratelimit.h"
+
+
+/*
+  size is rounded up to a power of two so a slot is found with a mask. rate is
+  in requests per second, at least 1/RATELIMIT_TOKEN_ONE, and a rate too high
+  to be stored is as good as no limit so it is capped
+
+  Return codes:
+    0 - success
+    1 - unable to allocate the table
+*/
+int initialise_ratelimit_table(struct ratelimit_table *table, int size,
+                               double rate, int burst, int send_kod){
+  uint32_t slots;
+
+  slots = RATELIMIT_MAX_PROBE;
+  while (slots < (uint32_t)size){
+    slots <<= 1;
+  }
+  if ((table->entries = calloc(slots, sizeof(struct ratelimit_entry))) == NULL){
+    return 1;
+  }
+  table->mask = slots - 1;
+  table->rate = rate * RATELIMIT_TOKEN_ONE >= UINT32_MAX ? UINT32_MAX :
+                (uint32_t)(rate * RATELIMIT_TOKEN_ONE + 0.5);
+  table->burst = (uint32_t)burst * RATELIMIT_TOKEN_ONE;
+  table->send_kod = send_kod;
+  return 0;
+}
+
+
+void free_ratelimit_table(struct ratelimit_table *table){
+  free(table->entries);
+  table->entries = NULL;
+}
+
+
+/*
+  finds the bucket for a client, claiming an empty slot or the least recently
+  seen one in the probe window if the client is not in the table
+*/
+static struct ratelimit_entry *find_entry(struct ratelimit_table *table,
+                                          uint32_t client_addr, uint32_t now){
+  int i;
+  uint32_t hash;
+  struct ratelimit_entry *entry;
+  struct ratelimit_entry *victim;
+
+  hash = ntohl(client_addr) * 2654435761U;
+  victim = NULL;
+  for (i = 0; i < RATELIMIT_MAX_PROBE; i++){
+    entry = &table->entries[((hash >> 7) + i) & table->mask];
+    if (entry->client_addr == client_addr){
+      return entry;
+    }
+    if (entry->client_addr == 0){
+      victim = entry;
+      break;
+    }
+    if (victim == NULL ||
+        (uint32_t)(now - entry->last_seen) > (uint32_t)(now - victim->last_seen)){
+      victim = entry;
+    }
+  }
+
+  // a new client starts with a full bucket
+  victim->client_addr = client_addr;
+  victim->tokens = table->burst;
+  victim->last_seen = now;
+  victim->limited = 0;
+  return victim;
+}
+
+
+/*
+  now is the arrival time of the request in NTP short format, taken from the
+  receive timestamp so no extra clock read is needed
+
+  Return codes:
+    see enum ratelimit_result
+*/
+int ratelimit_check(struct ratelimit_table *table, uint32_t client_addr,
+                    uint32_t now){
+  uint64_t refill;
+  struct ratelimit_entry *entry;
+
+  entry = find_entry(table, client_addr, now);
+
+  // top the bucket up for the time since the client was last seen, both are
+  // in 1/65536ths so the product is 65536 times too large
+  refill = (uint64_t)(uint32_t)(now - entry->last_seen) * table->rate /
+           RATELIMIT_TOKEN_ONE;
+  entry->last_seen = now;
+  if (refill >= table->burst - entry->tokens){
+    entry->tokens = table->burst;
+  }
+  else{
+    entry->tokens += refill;
+  }
+
+  if (entry->tokens >= RATELIMIT_TOKEN_ONE){
+    entry->tokens -= RATELIMIT_TOKEN_ONE;
+    entry->limited = 0;
+    return RATELIMIT_ALLOW;
+  }
+
+  // only the first request over the limit gets a KoD, so a spoofed flood
+  // cannot turn the server into a reflector
+  if (table->send_kod && !entry->limited){
+    entry->limited = 1;
+    return RATELIMIT_KOD;
+  }
+  return RATELIMIT_DROP;
+}
@@ -0,0 +1,55 @@
+#ifndef SNTPRATELIMIT_H
+#define SNTPRATELIMIT_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+/*
+  Per client rate limiting with a token bucket for every client address. The
+  buckets live in a fixed size open addressing table that is allocated once,
+  a lookup probes at most RATELIMIT_MAX_PROBE neighbouring slots and never
+  allocates. When every probed slot is taken the least recently seen client is
+  replaced.
+
+  Clients are timed in NTP short format to keep an entry at 16 bytes, so the
+  time since a client was last seen wraps every 65536 seconds (about 18.2
+  hours). A client coming back after close to a multiple of that gets little
+  or no refill for the time it was away, so it can be limited early until its
+  bucket refills at the normal rate.
+*/
+
+// slots probed per lookup, 4 entries share a 64 byte cache line
+#define RATELIMIT_MAX_PROBE 8
+// tokens are stored in 1/65536ths of a request
+#define RATELIMIT_TOKEN_ONE 65536U
+
+enum ratelimit_result{
+  RATELIMIT_ALLOW,
+  RATELIMIT_KOD, // first request over the limit, tell the client to slow down
+  RATELIMIT_DROP
+};
+
+struct ratelimit_entry{
+  uint32_t client_addr; // network byte order, 0 if the slot is unused
+  uint32_t tokens;
+  uint32_t last_seen; // NTP short format, 1/65536ths of a second
+  uint32_t limited; // a KoD has been sent since the client last got a reply
+};
+
+struct ratelimit_table{
+  struct ratelimit_entry *entries;
+  uint32_t mask;
+  uint32_t rate; // tokens added each second, 1/65536ths of a request
+  uint32_t burst; // bucket size in tokens
+  int send_kod; // 0 silently drops every request over the limit
+};
+
+
+int initialise_ratelimit_table(struct ratelimit_table *table, int size,
+                               double rate, int burst, int send_kod);
+void free_ratelimit_table(struct ratelimit_table *table);
+int ratelimit_check(struct ratelimit_table *table, uint32_t client_addr,
+                    uint32_t now);
+
+#endif
@@ -0,0 +1,234 @@
+/* sntpresolve.c - cached forward and lazy reverse lookups for the client
+ */
+
+#include "sntpresolve.h"
+
+static struct resolve_entry resolve_cache[RESOLVE_CACHE_SIZE];
+static struct reverse_entry reverse_cache[RESOLVE_CACHE_SIZE];
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_done = PTHREAD_COND_INITIALIZER;
+static double resolve_ttl = 300;
+
+static int lookup_address(const char *host, struct in_addr *addr);
+static struct resolve_entry *find_resolve_slot(void);
+static int has_expired(struct timespec *expires);
+static void *resolve_in_background(void *arg);
+
+
+// how long a result is trusted for, 0 turns the cache off
+void set_resolve_cache_ttl(double seconds){
+  pthread_mutex_lock(&resolve_lock);
+  resolve_ttl = seconds;
+  pthread_mutex_unlock(&resolve_lock);
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - host could not be resolved
+*/
+int resolve_host(const char *host, struct in_addr *addr, int debug){
+  int i;
+  int ret;
+  struct resolve_entry *entry;
+
+  // an address needs no lookup at all
+  if (inet_pton(AF_INET, host, addr) == 1){
+    return 0;
+  }
+  if (strlen(host) >= RESOLVE_MAX_HOST){
+    return lookup_address(host, addr);
+  }
+
+  pthread_mutex_lock(&resolve_lock);
+  while (1){
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++){
+      if (resolve_cache[i].state != RESOLVE_EMPTY &&
+          strcmp(resolve_cache[i].host, host) == 0){
+        break;
+      }
+    }
+    if (i == RESOLVE_CACHE_SIZE){
+      break;
+    }
+    entry = &resolve_cache[i];
+    if (entry->state == RESOLVE_PENDING){
+      // someone else is already asking, wait for their answer
+      pthread_cond_wait(&resolve_done, &resolve_lock);
+      continue;
+    }
+    if (!has_expired(&entry->expires)){
+      *addr = entry->addr;
+      pthread_mutex_unlock(&resolve_lock);
+      print_debug(debug, "using cached address for '%s'", host);
+      return 0;
+    }
+    entry->state = RESOLVE_EMPTY;
+    break;
+  }
+
+  // claim a slot so other threads wait for this lookup
+  if ((entry = find_resolve_slot()) != NULL){
+    strcpy(entry->host, host);
+    entry->state = RESOLVE_PENDING;
+  }
+  pthread_mutex_unlock(&resolve_lock);
+
+  print_debug(debug, "resolving '%s'", host);
+  ret = lookup_address(host, addr);
+
+  pthread_mutex_lock(&resolve_lock);
+  if (entry != NULL){
+    // failures are not cached, the next poll tries again
+    if (ret == 0 && resolve_ttl > 0){
+      entry->addr = *addr;
+      get_monotonic_time(&entry->expires);
+      add_seconds_to_timespec(&entry->expires, resolve_ttl);
+      entry->state = RESOLVE_DONE;
+    }
+    else{
+      entry->state = RESOLVE_EMPTY;
+    }
+    pthread_cond_broadcast(&resolve_done);
+  }
+  pthread_mutex_unlock(&resolve_lock);
+  return ret;
+}
+
+
+/*
+  resolves host in a thread of its own so the address is usually in the cache
+  by the time resolve_host is called for it
+
+  Return codes:
+    0 - success
+    1 - error starting the thread
+*/
+int start_resolving_host(const char *host){
+  pthread_t thread;
+  pthread_attr_t attr;
+  struct in_addr addr;
+
+  if (inet_pton(AF_INET, host, &addr) == 1){
+    return 0;
+  }
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, resolve_in_background,
+                     (void *)host) != 0){
+    pthread_attr_destroy(&attr);
+    return 1;
+  }
+  pthread_attr_destroy(&attr);
+  return 0;
+}
+
+
+static void *resolve_in_background(void *arg){
+  struct in_addr addr;
+
+  resolve_host(arg, &addr, 0);
+  return NULL;
+}
+
+
+/*
+  the name of the host at addr, for display only
+
+  Return codes:
+    0 - success
+    1 - addr has no name
+*/
+int lookup_host_name(struct in_addr addr, char *name, size_t len, int debug){
+  int i;
+  int oldest;
+  struct sockaddr_in sa;
+  char found[NI_MAXHOST];
+
+  pthread_mutex_lock(&resolve_lock);
+  for (i = 0; i < RESOLVE_CACHE_SIZE; i++){
+    if (reverse_cache[i].valid && reverse_cache[i].addr.s_addr == addr.s_addr &&
+        !has_expired(&reverse_cache[i].expires)){
+      snprintf(name, len, "%s", reverse_cache[i].name);
+      pthread_mutex_unlock(&resolve_lock);
+      return 0;
+    }
+  }
+  pthread_mutex_unlock(&resolve_lock);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr = addr;
+  if (getnameinfo((struct sockaddr *)&sa, sizeof(sa), found, sizeof(found),
+                  NULL, 0, NI_NAMEREQD) != 0){
+    print_debug(debug, "no name found for %s", inet_ntoa(addr));
+    return 1;
+  }
+  snprintf(name, len, "%s", found);
+
+  pthread_mutex_lock(&resolve_lock);
+  if (resolve_ttl > 0){
+    oldest = 0;
+    for (i = 0; i < RESOLVE_CACHE_SIZE; i++){
+      if (!reverse_cache[i].valid){
+        oldest = i;
+        break;
+      }
+      if (reverse_cache[i].expires.tv_sec < reverse_cache[oldest].expires.tv_sec){
+        oldest = i;
+      }
+    }
+    reverse_cache[oldest].addr = addr;
+    strcpy(reverse_cache[oldest].name, found);
+    get_monotonic_time(&reverse_cache[oldest].expires);
+    add_seconds_to_timespec(&reverse_cache[oldest].expires, resolve_ttl);
+    reverse_cache[oldest].valid = 1;
+  }
+  pthread_mutex_unlock(&resolve_lock);
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - host could not be resolved
+*/
+static int lookup_address(const char *host, struct in_addr *addr){
+  struct addrinfo hints;
+  struct addrinfo *res;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  if (getaddrinfo(host, NULL, &hints, &res) != 0){
+    return 1;
+  }
+  *addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+  return 0;
+}
+
+
+// an empty slot, or the one closest to expiring. called with the lock held
+static struct resolve_entry *find_resolve_slot(void){
+  int i;
+  struct resolve_entry *slot = NULL;
+
+  for (i = 0; i < RESOLVE_CACHE_SIZE; i++){
+    if (resolve_cache[i].state == RESOLVE_EMPTY){
+      return &resolve_cache[i];
+    }
+    if (resolve_cache[i].state == RESOLVE_DONE &&
+        (slot == NULL || resolve_cache[i].expires.tv_sec < slot->expires.tv_sec)){
+      slot = &resolve_cache[i];
+    }
+  }
+  return slot;
+}
+
+
+static int has_expired(struct timespec *expires){
+  return get_seconds_until(expires) <= 0;
+}
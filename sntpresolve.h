@@ -0,0 +1,51 @@
+#ifndef SNTPRESOLVE_H
+#define SNTPRESOLVE_H
+
+#include "sntpsched.h"
+#include <netdb.h>
+#include <pthread.h>
+
+/*
+  Name resolution for the client. IPv4 literals are converted without asking
+  the resolver, names are looked up with getaddrinfo and the result is cached
+  for a set time so repeat polls do not resolve the server again. The cache is
+  shared by every thread, a name being resolved by one thread is waited on by
+  the others rather than looked up twice. Resolution can be started in the
+  background ahead of when the address is needed.
+
+  Reverse lookups are only made when asked for, they are only used to show
+  the name of a server given as an address.
+*/
+
+// number of names and addresses remembered
+#define RESOLVE_CACHE_SIZE 16
+// longest host name that is cached, longer names are resolved every time
+#define RESOLVE_MAX_HOST 256
+
+enum resolve_state{
+  RESOLVE_EMPTY,
+  RESOLVE_PENDING, // a thread is resolving the name
+  RESOLVE_DONE
+};
+
+struct resolve_entry{
+  char host[RESOLVE_MAX_HOST];
+  struct in_addr addr;
+  struct timespec expires; // CLOCK_MONOTONIC
+  int state; // one of enum resolve_state
+};
+
+struct reverse_entry{
+  struct in_addr addr;
+  char name[NI_MAXHOST];
+  struct timespec expires; // CLOCK_MONOTONIC
+  int valid;
+};
+
+
+void set_resolve_cache_ttl(double seconds);
+int resolve_host(const char *host, struct in_addr *addr, int debug);
+int start_resolving_host(const char *host);
+int lookup_host_name(struct in_addr addr, char *name, size_t len, int debug);
+
+#endif
@@ -0,0 +1,87 @@
+/* sntpsched.c - deadline based waiting on the monotonic clock
+ */
+
+#include "sntpsched.h"
+
+
+void get_monotonic_time(struct timespec *ts){
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+
+void add_seconds_to_timespec(struct timespec *ts, double seconds){
+  long nsec;
+
+  ts->tv_sec += (time_t)seconds;
+  nsec = ts->tv_nsec + (long)((seconds - (time_t)seconds) * 1e9);
+  if (nsec >= 1000000000L){
+    ts->tv_sec++;
+    nsec -= 1000000000L;
+  }
+  else if (nsec < 0){
+    ts->tv_sec--;
+    nsec += 1000000000L;
+  }
+  ts->tv_nsec = nsec;
+}
+
+
+// negative once the deadline has passed
+double get_seconds_until(struct timespec *deadline){
+  struct timespec now;
+
+  get_monotonic_time(&now);
+  return (deadline->tv_sec - now.tv_sec) +
+         (deadline->tv_nsec - now.tv_nsec) / 1e9;
+}
+
+
+/*
+  the deadline is absolute so being woken by a signal and going back to sleep
+  does not push it back
+
+  Return codes:
+    0 - the deadline has passed
+    1 - error sleeping
+*/
+int sleep_until(struct timespec *deadline){
+  int ret;
+
+  while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline,
+                                NULL)) == EINTR);
+  return ret != 0;
+}
+
+
+/*
+  Return codes:
+    0 - a packet is waiting on the socket
+    1 - the deadline passed first
+    2 - error waiting
+*/
+int wait_for_packet(int sockfd, struct timespec *deadline){
+  int ret;
+  double remaining;
+  struct pollfd pfd;
+  struct timespec timeout;
+
+  pfd.fd = sockfd;
+  pfd.events = POLLIN;
+  while (1){
+    if ((remaining = get_seconds_until(deadline)) < 0){
+      remaining = 0;
+    }
+    timeout.tv_sec = (time_t)remaining;
+    timeout.tv_nsec = (long)((remaining - timeout.tv_sec) * 1e9);
+
+    if ((ret = ppoll(&pfd, 1, &timeout, NULL)) > 0){
+      return 0;
+    }
+    if (ret == 0){
+      return 1;
+    }
+    if (errno != EINTR){
+      return 2;
+    }
+  }
+}
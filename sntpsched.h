@@ -0,0 +1,25 @@
+#ifndef SNTPSCHED_H
+#define SNTPSCHED_H
+
+#include "sntptools.h"
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+/*
+  Waiting for the client. Every wait is towards an absolute deadline on
+  CLOCK_MONOTONIC so the time until the next poll or the end of a receive
+  timeout is neither stretched by early wake ups nor thrown off by the wall
+  clock being stepped, which is exactly what the client may be about to do.
+  The thread sleeps in the kernel until the deadline or a packet arrives, so
+  a waiting client uses no cpu.
+*/
+
+
+void get_monotonic_time(struct timespec *ts);
+void add_seconds_to_timespec(struct timespec *ts, double seconds);
+double get_seconds_until(struct timespec *deadline);
+int sleep_until(struct timespec *deadline);
+int wait_for_packet(int sockfd, struct timespec *deadline);
+
+#endif
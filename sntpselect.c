@@ -0,0 +1,242 @@
+/* sntpselect.c - picks the servers to trust and combines their offsets
+ */
+
+#include "sntpselect.h"
+
+// an edge or the middle of a correctness interval
+struct select_endpoint{
+  double value;
+  int type; // -1 lower edge, 0 middle, 1 upper edge
+};
+
+static int compare_endpoints(const void *a, const void *b);
+static int find_majority_interval(struct select_source *sources,
+                                  int num_sources, double *low, double *high);
+static void cluster_candidates(struct select_source *sources, int *cands,
+                               int *num_cands);
+
+
+/*
+  tallies every source and combines the candidates into result.
+
+  Return codes:
+    0 - success
+    1 - no majority of servers agree, every source is a falseticker
+    2 - no source is usable
+*/
+int select_sources(struct select_source *sources, int num_sources,
+                   struct select_result *result){
+  int i;
+  int j;
+  int num_usable;
+  int num_cands;
+  int cands[num_sources > 0 ? num_sources : 1];
+  double low;
+  double high;
+  double weight;
+  double weight_total;
+  double offset;
+  double jitter;
+
+  result->num_sources = num_sources;
+  result->num_candidates = 0;
+  result->system_peer = -1;
+  num_usable = 0;
+  for (i = 0; i < num_sources; i++){
+    if (sources[i].stratum >= SELECT_MAX_STRATUM ||
+        sources[i].distance > SELECT_MAX_DISTANCE){
+      sources[i].tally = TALLY_REJECT;
+    }
+    else{
+      sources[i].tally = TALLY_FALSETICKER;
+      num_usable++;
+    }
+  }
+  if (num_usable == 0){
+    return 2;
+  }
+  if (find_majority_interval(sources, num_sources, &low, &high) != 0){
+    return 1;
+  }
+
+  // truechimers are the sources whose interval overlaps the majority's, the
+  // best come first
+  num_cands = 0;
+  for (i = 0; i < num_sources; i++){
+    if (sources[i].tally != TALLY_FALSETICKER ||
+        sources[i].offset + sources[i].distance < low ||
+        sources[i].offset - sources[i].distance > high){
+      continue;
+    }
+    sources[i].tally = TALLY_OUTLIER;
+    for (j = num_cands; j > 0 &&
+         sources[cands[j - 1]].stratum * SELECT_MAX_DISTANCE +
+         sources[cands[j - 1]].distance >
+         sources[i].stratum * SELECT_MAX_DISTANCE + sources[i].distance; j--){
+      cands[j] = cands[j - 1];
+    }
+    cands[j] = i;
+    num_cands++;
+  }
+
+  cluster_candidates(sources, cands, &num_cands);
+
+  // combine the survivors, the closer a server is to its root the more say
+  // it has
+  weight_total = 0;
+  offset = 0;
+  jitter = 0;
+  for (i = 0; i < num_cands; i++){
+    sources[cands[i]].tally = TALLY_CANDIDATE;
+    weight = 1 / sources[cands[i]].distance;
+    weight_total += weight;
+    offset += sources[cands[i]].offset * weight;
+    jitter += pow(sources[cands[i]].offset - sources[cands[0]].offset, 2) *
+              weight;
+  }
+  sources[cands[0]].tally = TALLY_SYSTEM_PEER;
+  result->offset = offset / weight_total;
+  // the jitter of the system peer adds to how much the others disagree
+  result->jitter = sqrt(jitter / weight_total +
+                        pow(sources[cands[0]].jitter, 2));
+  result->num_candidates = num_cands;
+  result->system_peer = cands[0];
+  return 0;
+}
+
+
+/*
+  root distance of a server, half the round trip to its reference clock plus
+  every error along the way. delay, dispersion and jitter come from the clock
+  filter, root_delay and root_dispersion from the reply
+*/
+double get_root_distance(double delay, double dispersion, double jitter,
+                         double root_delay, double root_dispersion){
+  // RFC 5905 puts a 1ms floor under the round trip, a server next door is not
+  // trusted to the nanosecond
+  return fmax(1e-3, root_delay + delay) / 2 + root_dispersion + dispersion +
+         jitter;
+}
+
+
+/*
+  Marzullo's algorithm as in RFC 5905, the most servers that can be wrong is
+  raised from none until a majority of the rest share an interval.
+
+  Return codes:
+    0 - low and high are set to the shared interval
+    1 - no majority agree
+*/
+static int find_majority_interval(struct select_source *sources,
+                                  int num_sources, double *low, double *high){
+  int i;
+  int n;
+  int allow;
+  int found;
+  int chime;
+  struct select_endpoint endpoints[num_sources * 3 + 1];
+
+  n = 0;
+  for (i = 0; i < num_sources; i++){
+    if (sources[i].tally == TALLY_REJECT){
+      continue;
+    }
+    endpoints[n].value = sources[i].offset - sources[i].distance;
+    endpoints[n++].type = -1;
+    endpoints[n].value = sources[i].offset;
+    endpoints[n++].type = 0;
+    endpoints[n].value = sources[i].offset + sources[i].distance;
+    endpoints[n++].type = 1;
+  }
+  qsort(endpoints, n, sizeof(endpoints[0]), compare_endpoints);
+  num_sources = n / 3;
+
+  for (allow = 0; 2 * allow < num_sources; allow++){
+    // the lowest point that all but allow of the intervals reach
+    found = 0;
+    chime = 0;
+    for (i = 0; i < n; i++){
+      chime -= endpoints[i].type;
+      if (chime >= num_sources - allow){
+        *low = endpoints[i].value;
+        break;
+      }
+      if (endpoints[i].type == 0){
+        found++;
+      }
+    }
+    // and the highest
+    chime = 0;
+    for (i = n - 1; i >= 0; i--){
+      chime += endpoints[i].type;
+      if (chime >= num_sources - allow){
+        *high = endpoints[i].value;
+        break;
+      }
+      if (endpoints[i].type == 0){
+        found++;
+      }
+    }
+    // more midpoints outside the interval than sources allowed to be wrong
+    // means the interval is not trusted yet
+    if (found > allow){
+      continue;
+    }
+    if (*high > *low){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+  drops the candidate whose offset is furthest from the others until the
+  spread between them is no more than the jitter of the best of them, or only
+  SELECT_MIN_CLUSTER remain. cands stays sorted best first
+*/
+static void cluster_candidates(struct select_source *sources, int *cands,
+                               int *num_cands){
+  int i;
+  int j;
+  int worst;
+  double spread;
+  double max_spread;
+  double min_jitter;
+
+  while (*num_cands > SELECT_MIN_CLUSTER){
+    worst = 0;
+    max_spread = -1;
+    min_jitter = INFINITY;
+    for (i = 0; i < *num_cands; i++){
+      spread = 0;
+      for (j = 0; j < *num_cands; j++){
+        spread += pow(sources[cands[i]].offset - sources[cands[j]].offset, 2);
+      }
+      spread = sqrt(spread / (*num_cands - 1));
+      if (spread > max_spread){
+        max_spread = spread;
+        worst = i;
+      }
+      min_jitter = fmin(min_jitter, sources[cands[i]].jitter);
+    }
+    if (max_spread <= min_jitter){
+      break;
+    }
+    memmove(&cands[worst], &cands[worst + 1],
+            (*num_cands - worst - 1) * sizeof(cands[0]));
+    (*num_cands)--;
+  }
+}
+
+
+static int compare_endpoints(const void *a, const void *b){
+  const struct select_endpoint *x = a;
+  const struct select_endpoint *y = b;
+
+  if (x->value != y->value){
+    return x->value < y->value ? -1 : 1;
+  }
+  // at the same value a lower edge comes first so touching intervals overlap
+  return x->type - y->type;
+}
@@ -0,0 +1,57 @@
+#ifndef SNTPSELECT_H
+#define SNTPSELECT_H
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+  Source selection from RFC 5905 (section 11.2). Every server gives a
+  correctness interval, its offset plus or minus its root distance, which the
+  true time should lie in if the server is right. Marzullo's algorithm finds
+  the smallest interval shared by a majority of servers, the ones not in it
+  are falsetickers. The cluster algorithm then drops the survivors furthest
+  from the rest until what is left agrees to within its own jitter, and the
+  offsets of those are combined weighted by how close each server is to the
+  root of its tree. One slow or wrong server is outvoted instead of deciding
+  the result.
+*/
+
+// a server further than this from its reference clock is not used, seconds
+#define SELECT_MAX_DISTANCE 1.5
+// the cluster algorithm stops pruning once this few survivors are left
+#define SELECT_MIN_CLUSTER 3
+// servers of this stratum or above are not synchronised
+#define SELECT_MAX_STRATUM 16
+
+enum select_tally{
+  TALLY_REJECT, // unusable, too far away or not synchronised
+  TALLY_FALSETICKER, // outside the interval shared by the majority
+  TALLY_OUTLIER, // dropped by the cluster algorithm
+  TALLY_CANDIDATE, // combined into the result
+  TALLY_SYSTEM_PEER // the best candidate, the one the jitter is measured from
+};
+
+struct select_source{
+  double offset; // seconds
+  double distance; // root distance, seconds
+  double jitter; // from the clock filter, seconds
+  int stratum;
+  int tally; // set to one of enum select_tally by select_sources
+};
+
+struct select_result{
+  double offset; // combined offset of the candidates, seconds
+  double jitter; // of the combined offset, seconds
+  int num_sources;
+  int num_candidates;
+  int system_peer; // index of the best candidate, -1 when none was picked
+};
+
+
+int select_sources(struct select_source *sources, int num_sources,
+                   struct select_result *result);
+double get_root_distance(double delay, double dispersion, double jitter,
+                         double root_delay, double root_dispersion);
+
+#endif
@@ -2,121 +2,710 @@
  */
 
 #include "sntpserver.h"
+#include "sntpuring.h"
 
 
 int main( int argc, char * argv[]) {
-  int sockfd;
-  struct host_info my_server;
-  struct sntp_request client_req;
-  struct ntp_packet reply_pkt;
-  struct timeval request_t_unix;
+  int i;
+  int j;
   struct server_settings s_set;
+  struct server_worker *workers;
 
   s_set = get_server_settings(argc, argv);
-  if (initialise_server(&sockfd, s_set.server_port, &my_server, s_set.debug) != 0){
+  if (select_clock_source(s_set.clock_source, s_set.clock_accuracy,
+                          s_set.debug) != 0){
+    fprintf(stderr, "the clock_source asked for can not be used here, or is "
+            "not within clock_accuracy, using realtime\n");
+    select_clock_source(CLOCK_SOURCE_REALTIME, 0, s_set.debug);
+  }
+
+  if (s_set.nts.enabled && initialise_nts_server(&s_set.nts, s_set.debug) != 0){
+    fprintf(stderr, "unable to start NTS key establishment, check nts_cert_file "
+            "and nts_key_file\n");
+    exit(1);
+  }
+  if ((workers = calloc(s_set.worker_threads, sizeof(*workers))) == NULL){
+    fprintf(stderr, "unable to allocate worker threads\n");
+    exit(1);
+  }
+  if (initialise_workers(workers, &s_set) != 0){
     fprintf(stderr, "error initialising server\n");
     exit(1);
   }
-  if(s_set.manycast_enabled){
-    if(setup_manycast(sockfd, s_set.manycast_address, s_set.debug) != 0){
-      fprintf(stderr, "error setting up socket for manycast\n");
+
+  if (log_start(s_set.log_level) != 0){
+    fprintf(stderr, "unable to start the log writer\n");
+    exit(1);
+  }
+  log_info("reading the %s clock, precision %i", get_clock_source()->name,
+           get_clock_source_precision());
+  for (i = 0; i < s_set.num_listeners; i++){
+    log_info("listening on %s:%i", inet_ntoa(s_set.listeners[i].sin_addr),
+             ntohs(s_set.listeners[i].sin_port));
+  }
+  if (s_set.nts.enabled){
+    if (start_nts_server(&s_set.nts) != 0){
+      fprintf(stderr, "unable to start NTS-KE threads\n");
       exit(1);
     }
+    log_info("NTS-KE listening on port %i", s_set.nts.ke_port);
+  }
+
+  // every socket is bound before any worker starts so no request is missed
+  for (i = 0; i < s_set.worker_threads; i++){
+    if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0){
+      fprintf(stderr, "unable to start worker thread %i\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < s_set.worker_threads; i++){
+    pthread_join(workers[i].thread, NULL);
+    for (j = 0; j < s_set.num_listeners; j++){
+      close(workers[i].sockfds[j]);
+    }
+    close(workers[i].epfd);
+    free(workers[i].batch);
+    free_interleave_table(&workers[i].il_table);
+    free_ratelimit_table(&workers[i].rl_table);
+  }
+  log_stop();
+
+  free(workers);
+  return 0;
+}
+
+
+/*
+  gives every worker its own socket for each listener and an epoll instance
+  watching them. with more than one worker the sockets share their address
+  through SO_REUSEPORT and the kernel spreads incoming requests across them.
+
+  Return codes:
+    0 - success
+    1 - error setting up a worker
+*/
+int initialise_workers(struct server_worker *workers,
+                       struct server_settings *s_set){
+  int i;
+  int j;
+  int optval;
+  int reuse_port;
+  struct epoll_event event;
+
+  reuse_port = s_set->worker_threads > 1;
+  for (i = 0; i < s_set->worker_threads; i++){
+    workers[i].id = i;
+    workers[i].s_set = s_set;
+    if (s_set->interleaved_enabled &&
+        initialise_interleave_table(&workers[i].il_table,
+                                    s_set->interleave_table_size) != 0){
+      print_debug(s_set->debug, "unable to allocate interleave table");
+      return 1;
+    }
+    if (s_set->ratelimit_enabled &&
+        initialise_ratelimit_table(&workers[i].rl_table,
+                                   s_set->ratelimit_table_size,
+                                   s_set->ratelimit_rate, s_set->ratelimit_burst,
+                                   s_set->ratelimit_send_kod) != 0){
+      print_debug(s_set->debug, "unable to allocate rate limit table");
+      return 1;
+    }
+    if (s_set->nts.enabled &&
+        initialise_nts_keys(&workers[i].nts_keys, &s_set->nts) != 0){
+      print_debug(s_set->debug, "unable to set up NTS keys");
+      return 1;
+    }
+    if (s_set->batch_size > 1 &&
+        (workers[i].batch = initialise_request_batch(s_set->batch_size)) == NULL){
+      print_debug(s_set->debug, "unable to allocate request batch");
+      return 1;
+    }
+
+    if ((workers[i].epfd = epoll_create1(0)) == -1){
+      print_debug(s_set->debug, "unable to create epoll instance");
+      return 1;
+    }
+    for (j = 0; j < s_set->num_listeners; j++){
+      if (initialise_server(&workers[i].sockfds[j], &s_set->listeners[j],
+                            reuse_port, s_set->debug) != 0){
+        return 1;
+      }
+      event.events = EPOLLIN;
+      event.data.fd = workers[i].sockfds[j];
+      if (epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].sockfds[j],
+                    &event) != 0){
+        print_debug(s_set->debug, "unable to watch socket with epoll");
+        return 1;
+      }
+
+      // only the first worker joins the manycast groups. the others must opt
+      // out of group traffic otherwise every socket on the port gets a copy
+      // of each manycast request and the client would see duplicate replies.
+      if (i != 0 && s_set->num_manycast_groups > 0){
+        optval = 0;
+        if (setsockopt(workers[i].sockfds[j], IPPROTO_IP, IP_MULTICAST_ALL,
+                       &optval, sizeof(optval)) < 0){
+          print_debug(s_set->debug, "unable to opt worker %i out of manycast", i);
+          return 1;
+        }
+      }
+    }
   }
 
+  for (j = 0; j < s_set->num_manycast_groups; j++){
+    if(setup_manycast(workers[0].sockfds[s_set->manycast_listeners[j]],
+                      s_set->manycast_groups[j].sin_addr, s_set->debug) != 0){
+      fprintf(stderr, "error setting up socket for manycast\n");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+void *run_worker(void *arg){
+  struct server_worker *worker = arg;
+
+  log_info("worker %i serving requests", worker->id);
+  if (worker->s_set->io_engine == IO_ENGINE_URING &&
+      serve_requests_uring(worker) == 0){
+    return NULL;
+  }
+  serve_requests(worker);
+  return NULL;
+}
+
+
+/*
+  one event loop per worker serves every listener. each ready socket is read
+  until it is empty or LISTENER_DRAIN_LIMIT reads have been made, a socket that
+  still has requests waiting is picked up again by the next epoll_wait.
+  replies always go out on the socket the request came in on.
+*/
+void serve_requests(struct server_worker *worker){
+  int i;
+  int j;
+  int num_events;
+  int sockfd;
+  struct epoll_event events[MAX_LISTENERS];
+
   while(1){
-    if (recieve_SNTP_packet(sockfd, &client_req.pkt, &client_req.client.addr,
-                            &request_t_unix, s_set.debug) != 0){
-      fprintf(stderr, "error while listening for requests\n");
+    if ((num_events = epoll_wait(worker->epfd, events, MAX_LISTENERS, -1)) == -1){
+      if (errno != EINTR){
+        log_error("error while waiting for requests");
+      }
       continue;
     }
 
-    printf("recieved a packet from %s\n",
-         inet_ntoa(client_req.client.addr.sin_addr));
-    convert_unix_time_into_ntp_time(&request_t_unix, &client_req.time_of_request);
+    for (i = 0; i < num_events; i++){
+      sockfd = events[i].data.fd;
+      for (j = 0; j < LISTENER_DRAIN_LIMIT; j++){
+        if (worker->batch != NULL){
+          // a short batch means the socket has been emptied
+          if (handle_request_batch(worker, sockfd) < worker->s_set->batch_size){
+            break;
+          }
+        }
+        else if (handle_request(worker, sockfd) != 0){
+          break;
+        }
+      }
+    }
+  }
+}
+
+
+/*
+  handle one request, this costs a recvfrom and a sendto
+
+  Return codes:
+    0 - a request was read from the socket
+    1 - no request was waiting
+*/
+int handle_request(struct server_worker *worker, int sockfd){
+  union ntp_buffer buf;
+  struct sntp_request client_req;
+  struct ntp_packet reply_pkt;
+  struct timespec request_t_unix;
+
+  // the shared helpers print synchronously so their debug output is left
+  // off, anything worth reporting is logged here instead
+  client_req.pkt = &buf.pkt;
+  client_req.local_addr.s_addr = INADDR_ANY;
+  if (recieve_SNTP_packet(sockfd, &buf, &client_req.len,
+                          &client_req.client.addr, &request_t_unix,
+                          &client_req.local_addr, 0) != 0){
+    if (errno != EAGAIN && errno != EWOULDBLOCK){
+      log_error("error while listening for requests");
+    }
+    return 1;
+  }
+  client_req.time_of_request = convert_timespec_into_ntp_time(&request_t_unix);
+
+  if (process_request(worker, &client_req, &reply_pkt) != 0){
+    return 0;
+  }
+
+  // reply from the address the client sent to, on a host with several
+  // addresses the kernel might otherwise pick a different one
+  if (send_SNTP_packet(&reply_pkt, client_req.reply_ext,
+                       client_req.reply_ext_len, &client_req.reply_mac, sockfd,
+                       client_req.client.addr,
+                       client_req.local_addr.s_addr != INADDR_ANY ?
+                       &client_req.local_addr : NULL, 0) != 0){
+    log_warning("error sending reply packet to %s",
+                inet_ntoa(client_req.client.addr.sin_addr));
+    return 0;
+  }
+  record_reply_sent(&client_req);
+  log_debug("succesffuly sent reply packet to %s",
+            inet_ntoa(client_req.client.addr.sin_addr));
+  return 0;
+}
+
+
+struct request_batch *initialise_request_batch(int batch_size){
+  int i;
+  struct request_batch *batch;
+
+  if ((batch = calloc(1, sizeof(*batch))) == NULL){
+    return NULL;
+  }
+
+  // the packet buffers never move, so point the message headers at them once
+  for (i = 0; i < batch_size; i++){
+    batch->reqs[i].pkt = &batch->bufs[i].pkt;
+    batch->recv_iovs[i].iov_base = &batch->bufs[i];
+    batch->recv_iovs[i].iov_len = sizeof(union ntp_buffer);
+    batch->recv_msgs[i].msg_hdr.msg_iov = &batch->recv_iovs[i];
+    batch->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+
+    batch->send_iovs[i][0].iov_base = &batch->replies[i];
+    batch->send_iovs[i][0].iov_len = sizeof(struct ntp_packet);
+  }
+  return batch;
+}
+
+
+/*
+  read up to batch_size requests with a single recvmmsg and send all of the
+  replies back with a single sendmmsg. each request keeps the arrival time the
+  kernel stamped it with, so batching does not skew the receive timestamps.
+
+  Return codes:
+    the number of requests read, 0 if none were waiting
+*/
+int handle_request_batch(struct server_worker *worker, int sockfd){
+  int batch_size = worker->s_set->batch_size;
+  int i;
+  int num_reqs;
+  int num_replies;
+  struct timespec fallback_t_unix;
+  struct timespec request_t_unix;
+  struct sntp_request *client_req;
+  struct request_batch *batch = worker->batch;
+
+  // the kernel overwrites the name and control lengths on every receive
+  for (i = 0; i < batch_size; i++){
+    batch->recv_msgs[i].msg_hdr.msg_name = &batch->reqs[i].client.addr;
+    batch->recv_msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->recv_msgs[i].msg_hdr.msg_control = batch->cmsg_bufs[i];
+    batch->recv_msgs[i].msg_hdr.msg_controllen = RECV_CMSG_SIZE;
+  }
+
+  // take whatever is already queued, the socket never blocks. MSG_TRUNC
+  // gives the full length of a request too long for its buffer
+  if ((num_reqs = recvmmsg(sockfd, batch->recv_msgs, batch_size, MSG_TRUNC,
+                           NULL)) == -1){
+    if (errno != EAGAIN && errno != EWOULDBLOCK){
+      log_error("error while listening for requests");
+    }
+    return 0;
+  }
+  // only used when the kernel didnt attach a timestamp to a request
+  read_clock_source(&fallback_t_unix);
+
+  num_replies = 0;
+  for (i = 0; i < num_reqs; i++){
+    client_req = &batch->reqs[i];
+    client_req->len = batch->recv_msgs[i].msg_len;
+
+    if (get_recv_timestamp(&batch->recv_msgs[i].msg_hdr,
+                           &request_t_unix) != 0){
+      request_t_unix = fallback_t_unix;
+    }
+    client_req->time_of_request =
+      convert_timespec_into_ntp_time(&request_t_unix);
+    client_req->local_addr.s_addr = INADDR_ANY;
+    get_recv_local_addr(&batch->recv_msgs[i].msg_hdr, &client_req->local_addr);
 
-    // check the packet to see if its a valid ntp request
-    if (check_packet(client_req, s_set.debug) != 0){
-      fprintf(stderr, "packet check failed, ignoring request for %s\n",
-              inet_ntoa(client_req.client.addr.sin_addr));
+    if (process_request(worker, client_req,
+                        &batch->replies[num_replies]) != 0){
       continue;
     }
+    batch->reply_reqs[num_replies] = client_req;
+
+    // empty NTS fields and MAC are sent as empty iovecs
+    batch->send_iovs[num_replies][0].iov_base = &batch->replies[num_replies];
+    batch->send_iovs[num_replies][1].iov_base = client_req->reply_ext;
+    batch->send_iovs[num_replies][1].iov_len = client_req->reply_ext_len;
+    batch->send_iovs[num_replies][2].iov_base = client_req->reply_mac.data;
+    batch->send_iovs[num_replies][2].iov_len = client_req->reply_mac.len;
+    batch->send_msgs[num_replies].msg_hdr.msg_name = &client_req->client.addr;
+    batch->send_msgs[num_replies].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    batch->send_msgs[num_replies].msg_hdr.msg_iov = batch->send_iovs[num_replies];
+    batch->send_msgs[num_replies].msg_hdr.msg_iovlen = 3;
+    if (client_req->local_addr.s_addr != INADDR_ANY){
+      set_send_local_addr(&batch->send_msgs[num_replies].msg_hdr,
+                          batch->send_cmsg_bufs[num_replies],
+                          client_req->local_addr);
+    }
+    else{
+      batch->send_msgs[num_replies].msg_hdr.msg_control = NULL;
+      batch->send_msgs[num_replies].msg_hdr.msg_controllen = 0;
+    }
+    num_replies++;
+  }
+
+  if (num_replies > 0 &&
+      send_reply_batch(sockfd, batch->send_msgs, num_replies) == 0){
+    for (i = 0; i < num_replies; i++){
+      record_reply_sent(batch->reply_reqs[i]);
+    }
+  }
+  return num_reqs;
+}
+
+
+/*
+  sendmmsg may send fewer messages than asked, keep going until every reply
+  has been handed to the kernel or an error occurs
+
+  Return codes:
+    0 - success
+    1 - error sending one or more replies
+*/
+int send_reply_batch(int sockfd, struct mmsghdr *msgs, int count){
+  int i;
+  int sent;
+  int total_sent;
+
+  total_sent = 0;
+  while (total_sent < count){
+    if ((sent = sendmmsg(sockfd, msgs + total_sent, count - total_sent, 0)) == -1){
+      log_warning("error with sending reply batch");
+      return 1;
+    }
+    for (i = total_sent; i < total_sent + sent; i++){
+      log_debug("succesffuly sent reply packet to %s",
+                inet_ntoa(((struct sockaddr_in *)msgs[i].msg_hdr.msg_name)->sin_addr));
+    }
+    total_sent += sent;
+  }
+  return 0;
+}
+
+
+/*
+  checks a received request and builds the reply for it, shared by every
+  receive path
+
+  Return codes:
+    0 - reply_pkt is ready to be sent
+    1 - request is invalid and should be ignored
+*/
+int process_request(struct server_worker *worker, struct sntp_request *c_req,
+                    struct ntp_packet *reply_pkt){
+  uint32_t client_addr;
+  struct interleave_entry *entry;
+
+  log_debug("recieved a packet from %s", inet_ntoa(c_req->client.addr.sin_addr));
+
+  // nothing below may return with these left over from an earlier request,
+  // the NAK and KoD paths reach sign_reply and record_reply_sent too
+  c_req->key = NULL;
+  c_req->nts.state = NTS_REQUEST_NONE;
+  c_req->interleaved = 0;
+  c_req->il_entry = NULL;
+
+  // check the packet to see if its a valid ntp request
+  if (check_packet(worker, c_req) != 0){
+    return 1;
+  }
+
+  // the limit comes before any crypto so a client over it, or traffic
+  // spoofed from its address, costs no more than a table lookup. the RATE
+  // KoD is not authenticated as the request has not been checked yet
+  if (worker->s_set->ratelimit_enabled){
+    // the bucket is timed with the receive timestamp in NTP short format
+    switch (ratelimit_check(&worker->rl_table, c_req->client.addr.sin_addr.s_addr,
+                            (uint32_t)(c_req->time_of_request >> 16))){
+      case RATELIMIT_KOD:
+        log_debug("rate limit hit, sending kiss-o'-death to %s",
+                  inet_ntoa(c_req->client.addr.sin_addr));
+        *reply_pkt = create_kod_packet(c_req, "RATE");
+        sign_reply(worker, c_req, reply_pkt);
+        return 0;
+      case RATELIMIT_DROP:
+        log_debug("rate limit hit, dropping request from %s",
+                  inet_ntoa(c_req->client.addr.sin_addr));
+        return 1;
+    }
+  }
+
+  // and that it comes from who it says it does
+  switch (check_nts(worker, c_req)){
+    case 1:
+      return 1;
+    case 2:
+      // the client has to run key establishment again
+      log_debug("sending NTS NAK to %s", inet_ntoa(c_req->client.addr.sin_addr));
+      *reply_pkt = create_kod_packet(c_req, "NTSN");
+      sign_reply(worker, c_req, reply_pkt);
+      return 0;
+  }
+  if (check_auth(worker, c_req) != 0){
+    return 1;
+  }
 
-    reply_pkt = create_reply_packet(&client_req);
-    if (send_SNTP_packet(&reply_pkt, sockfd, client_req.client.addr,
-                         s_set.debug) == 0){
-      printf("succesffuly sent reply packet to %s\n",
-             inet_ntoa(client_req.client.addr.sin_addr));
+  if (worker->s_set->interleaved_enabled){
+    client_addr = c_req->client.addr.sin_addr.s_addr;
+    entry = lookup_interleave_entry(&worker->il_table, client_addr);
+    if (is_interleaved_request(entry, client_addr, c_req->pkt)){
+      c_req->interleaved = 1;
+      c_req->prev_transmit_time = entry->tx_ts;
     }
+    record_interleave_receive(entry, client_addr, c_req->time_of_request);
+    c_req->il_entry = entry;
   }
 
-  close(sockfd);
+  *reply_pkt = create_reply_packet(c_req);
+  sign_reply(worker, c_req, reply_pkt);
   return 0;
 }
 
 
+/*
+  a reply to a signed request is signed with the same key, one to an NTS
+  request gets the NTS fields with its new cookies. the transmit time has
+  already been written so either adds its own cost to the error of that
+  timestamp, interleaved mode does away with it
+*/
+void sign_reply(struct server_worker *worker, struct sntp_request *c_req,
+                struct ntp_packet *reply_pkt){
+  c_req->reply_ext_len = write_nts_reply(&worker->nts_keys, &c_req->nts,
+                                         reply_pkt, c_req->reply_ext,
+                                         (uint32_t)(c_req->time_of_request >> 32));
+  c_req->reply_mac.len = 0;
+  if (c_req->key != NULL){
+    compute_ntp_mac(c_req->key, reply_pkt, NTP_HEADER_LEN, &c_req->reply_mac);
+  }
+}
+
+
+/*
+  the clock is read once the reply has been handed to the kernel, this is the
+  transmit time given to the client in its next interleaved reply
+*/
+void record_reply_sent(struct sntp_request *c_req){
+  if (c_req->il_entry != NULL){
+    record_interleave_transmit(c_req->il_entry, get_ntp_time_of_day());
+  }
+}
+
+
 struct ntp_packet create_reply_packet(struct sntp_request *c_req){
-  int req_version;
-  struct ntp_time_t transmit_ts_ntp;
   struct ntp_packet reply_pkt;
 
   memset( &reply_pkt, 0, sizeof reply_pkt ); // zero all fields in struct
-  // get request version
-  req_version = (c_req->pkt.li_vn_mode >> 3) & 0x7;
   // set version to the same as the client version and mode to 4(server)
-  reply_pkt.li_vn_mode = (req_version << 3) | 4; // (vn << 3) | mode
+  set_ntp_header(&reply_pkt, 0, get_ntp_version(c_req->pkt), NTP_MODE_SERVER);
   reply_pkt.stratum = 2;
   // copy poll from request
-  reply_pkt.poll = c_req->pkt.poll;
+  reply_pkt.poll = c_req->pkt->poll;
 
-  // add the precision of system clock
-  reply_pkt.precision = (int)-log2(32);
+  // add the precision of system clock, as measured at startup
+  reply_pkt.precision = get_clock_source_precision();
 
   // byte converstion not needed as its a stright copy from original packet
-  reply_pkt.originate_timestamp.second = c_req->pkt.transmit_timestamp.second;
-  reply_pkt.originate_timestamp.fraction = c_req->pkt.transmit_timestamp.fraction;
+  if (c_req->interleaved){
+    // the client matches interleaved replies on its own receive time of our
+    // previous reply
+    reply_pkt.originate_timestamp = c_req->pkt->receive_timestamp;
+  }
+  else{
+    reply_pkt.originate_timestamp = c_req->pkt->transmit_timestamp;
+  }
 
   // add recieve time
-  reply_pkt.receive_timestamp.second = htonl(c_req->time_of_request.second);
-  reply_pkt.receive_timestamp.fraction = htonl(c_req->time_of_request.fraction);
+  write_ntp_timestamp(&reply_pkt.receive_timestamp, c_req->time_of_request);
 
-  // add transmit time
-  transmit_ts_ntp = get_ntp_time_of_day();
-  reply_pkt.transmit_timestamp.second = htonl(transmit_ts_ntp.second);
-  reply_pkt.transmit_timestamp.fraction = htonl(transmit_ts_ntp.fraction);
+  // add transmit time, in interleaved mode this is when the previous reply
+  // actually left rather than an estimate taken before this one is sent
+  write_ntp_timestamp(&reply_pkt.transmit_timestamp, c_req->interleaved ?
+                      c_req->prev_transmit_time : get_ntp_time_of_day());
   return reply_pkt;
 }
 
 
-int check_packet(struct sntp_request c_req, int debug){
-  int mode;
-  int vn;
-  char msg_strt[100] = "check failed failed on -";
+/*
+  a kiss-o'-death packet has stratum 0 and an ascii kiss code in the reference
+  identifier. the timestamps are filled in from the request so older clients
+  that ignore kiss codes still match it to their request.
+*/
+struct ntp_packet create_kod_packet(struct sntp_request *c_req,
+                                    const char *kiss_code){
+  struct ntp_packet kod_pkt;
 
-  mode = c_req.pkt.li_vn_mode & 0x7; // extract first 3 bits
-  vn = (c_req.pkt.li_vn_mode >> 3) & 0x7; // extract bits 3 to 5
-  if (mode != 3){
-    print_debug(debug, "%s packet is not of mode client 3(mode=%i)", msg_strt,
-                mode);
-    return 1;
+  memset( &kod_pkt, 0, sizeof kod_pkt );
+  // leap indicator 3 (clock not synchronised), mode 4(server)
+  set_ntp_header(&kod_pkt, 3, get_ntp_version(c_req->pkt), NTP_MODE_SERVER);
+  kod_pkt.stratum = 0;
+  kod_pkt.poll = c_req->pkt->poll;
+  memcpy(&kod_pkt.reference_identifier, kiss_code, 4);
+
+  kod_pkt.originate_timestamp = c_req->pkt->transmit_timestamp;
+  write_ntp_timestamp(&kod_pkt.receive_timestamp, c_req->time_of_request);
+  kod_pkt.transmit_timestamp = kod_pkt.receive_timestamp;
+  return kod_pkt;
+}
+
+
+/*
+  Return codes:
+    0 - request can be answered
+    1 - request is invalid
+*/
+int check_packet(struct server_worker *worker, struct sntp_request *c_req){
+  int reason;
+
+  if ((reason = validate_ntp_request(c_req->pkt, c_req->len,
+                                     &c_req->info)) == NTP_ACCEPT){
+    // extension fields other than those of NTS are ignored, as RFC 7822
+    // asks
+    return 0;
+  }
+  reject_request(worker, c_req, reason);
+  return 1;
+}
+
+
+/*
+  the NTS fields of a request, if it has any, are checked when NTS is
+  enabled. the cookie is read with the worker's own cookie keys, timed with
+  the receive timestamp
+
+  Return codes:
+    0 - request can be answered
+    1 - request is invalid
+    2 - the cookie or authenticator could not be read, a NAK is sent
+*/
+int check_nts(struct server_worker *worker, struct sntp_request *c_req){
+  int ret;
+
+  c_req->nts.state = NTS_REQUEST_NONE;
+  if (!worker->s_set->nts.enabled){
+    return 0;
+  }
+  if ((ret = check_nts_request(&worker->nts_keys, c_req->pkt, &c_req->info,
+                               (uint32_t)(c_req->time_of_request >> 32),
+                               &c_req->nts)) != 0){
+    reject_request(worker, c_req, NTP_REJECT_NTS);
+  }
+  return ret;
+}
+
+
+/*
+  a request with a MAC has to match one of the keys, the reply is then signed
+  with it. one without is only answered when auth_required is off. as with
+  any other invalid request nothing is sent back, not even a crypto-NAK, so a
+  forged request gets no reply
+
+  Return codes:
+    0 - request can be answered
+    1 - request failed authentication
+*/
+int check_auth(struct server_worker *worker, struct sntp_request *c_req){
+  c_req->key = NULL;
+  // NTS has already authenticated it, which also meets auth_required
+  if (c_req->nts.state == NTS_REQUEST_VALID){
+    return 0;
   }
-  else if (vn < 1 || vn > 4){
-    print_debug(debug, "%s packet version is not in range 1 to 4(vn=%i)",
-                msg_strt, vn);
+  if (c_req->info.mac == NULL && !worker->s_set->auth_required){
+    return 0;
+  }
+  if (verify_ntp_mac(&worker->s_set->keys, c_req->pkt, &c_req->info,
+                     &c_req->key) != 0){
+    reject_request(worker, c_req, NTP_REJECT_AUTH);
     return 1;
   }
   return 0;
 }
 
 
+/*
+  the reason a request is rejected is counted by the worker, the counts are
+  logged at most once every REJECT_LOG_INTERVAL seconds and only when there
+  has been a new rejection
+*/
+void reject_request(struct server_worker *worker, struct sntp_request *c_req,
+                    int reason){
+  uint32_t now;
+  char counts[256];
+
+  count_ntp_reject(&worker->rejects, reason);
+  log_debug("check failed on - %s(%zu bytes, mode=%i, vn=%i), ignoring "
+            "request from %s", get_ntp_reject_name(reason), c_req->len,
+            get_ntp_mode(c_req->pkt), get_ntp_version(c_req->pkt),
+            inet_ntoa(c_req->client.addr.sin_addr));
+
+  // timed with the receive timestamp so the clock is not read again
+  now = (uint32_t)(c_req->time_of_request >> 32);
+  if (now - worker->rejects_logged >= REJECT_LOG_INTERVAL){
+    worker->rejects_logged = now;
+    format_ntp_reject_counts(&worker->rejects, counts, sizeof(counts));
+    log_info("worker %i rejected requests: %s", worker->id, counts);
+  }
+}
+
+
 struct server_settings get_server_settings(int argc, char * argv[]){
   struct server_settings s_set;
+  struct sockaddr_in group;
 
   // set relevant settings to their defaults
   s_set.server_port = DEFAULT_SERVER_PORT;
   s_set.debug = DEFAULT_debug;
+  s_set.log_level = DEFAULT_LOG_LEVEL;
   s_set.manycast_enabled = DEFAULT_MANYCAST_ENABLED;
   s_set.manycast_address = DEFAULT_MANYCAST_ADDRESS;
+  s_set.num_listeners = 0;
+  s_set.num_manycast_groups = 0;
+  s_set.batch_size = DEFAULT_BATCH_SIZE;
+  s_set.worker_threads = DEFAULT_WORKER_THREADS;
+  s_set.interleaved_enabled = DEFAULT_INTERLEAVED_ENABLED;
+  s_set.interleave_table_size = DEFAULT_INTERLEAVE_TABLE_SIZE;
+  s_set.ratelimit_enabled = DEFAULT_RATELIMIT_ENABLED;
+  s_set.ratelimit_rate = DEFAULT_RATELIMIT_RATE;
+  s_set.ratelimit_burst = DEFAULT_RATELIMIT_BURST;
+  s_set.ratelimit_send_kod = DEFAULT_RATELIMIT_SEND_KOD;
+  s_set.ratelimit_table_size = DEFAULT_RATELIMIT_TABLE_SIZE;
+  s_set.io_engine = DEFAULT_IO_ENGINE;
+  s_set.uring_entries = DEFAULT_URING_ENTRIES;
+  s_set.uring_buffers = DEFAULT_URING_BUFFERS;
+  s_set.uring_sqpoll = DEFAULT_URING_SQPOLL;
+  s_set.clock_source = DEFAULT_CLOCK_SOURCE;
+  s_set.clock_accuracy = DEFAULT_CLOCK_ACCURACY;
+  memset(&s_set.keys, 0, sizeof(s_set.keys));
+  s_set.auth_required = DEFAULT_AUTH_REQUIRED;
+  memset(&s_set.nts, 0, sizeof(s_set.nts));
+  s_set.nts.enabled = DEFAULT_NTS_ENABLED;
+  s_set.nts.ke_port = DEFAULT_NTS_KE_PORT;
+  s_set.nts.cert_file = DEFAULT_NTS_CERT_FILE;
+  s_set.nts.key_file = DEFAULT_NTS_KEY_FILE;
+  s_set.nts.ke_threads = DEFAULT_NTS_KE_THREADS;
+  s_set.nts.cookie_rotation = DEFAULT_NTS_COOKIE_ROTATION;
 
   // dont parse config file if it doesnt exist
   if (0 == access(CONFIG_FILE, 0)){
@@ -127,14 +716,193 @@ struct server_settings get_server_settings(int argc, char * argv[]){
     print_debug(s_set.debug, "no config file found for '%s'", CONFIG_FILE);
   }
 
+  if (s_set.batch_size < 1 || s_set.batch_size > MAX_BATCH_SIZE){
+    print_debug(s_set.debug, "batch_size must be between 1 and %i, using %i",
+                MAX_BATCH_SIZE, DEFAULT_BATCH_SIZE);
+    s_set.batch_size = DEFAULT_BATCH_SIZE;
+  }
+  if (s_set.worker_threads < 1 || s_set.worker_threads > MAX_WORKER_THREADS){
+    print_debug(s_set.debug, "worker_threads must be between 1 and %i, using %i",
+                MAX_WORKER_THREADS, DEFAULT_WORKER_THREADS);
+    s_set.worker_threads = DEFAULT_WORKER_THREADS;
+  }
+  if (s_set.interleave_table_size < 1){
+    s_set.interleave_table_size = DEFAULT_INTERLEAVE_TABLE_SIZE;
+  }
+  // the bucket counts in 1/RATELIMIT_TOKEN_ONE of a request, anything slower
+  // would never refill
+  if (s_set.ratelimit_rate < 1.0 / RATELIMIT_TOKEN_ONE ||
+      s_set.ratelimit_burst < 1 ||
+      s_set.ratelimit_table_size < 1){
+    print_debug(s_set.debug, "invalid rate limit settings, using the defaults");
+    s_set.ratelimit_rate = DEFAULT_RATELIMIT_RATE;
+    s_set.ratelimit_burst = DEFAULT_RATELIMIT_BURST;
+    s_set.ratelimit_table_size = DEFAULT_RATELIMIT_TABLE_SIZE;
+  }
+  if (s_set.uring_entries < 1 || s_set.uring_entries > MAX_URING_ENTRIES){
+    print_debug(s_set.debug, "uring_entries must be between 1 and %i, using %i",
+                MAX_URING_ENTRIES, DEFAULT_URING_ENTRIES);
+    s_set.uring_entries = DEFAULT_URING_ENTRIES;
+  }
+  if (s_set.uring_buffers < 1 || s_set.uring_buffers > MAX_URING_BUFFERS){
+    print_debug(s_set.debug, "uring_buffers must be between 1 and %i, using %i",
+                MAX_URING_BUFFERS, DEFAULT_URING_BUFFERS);
+    s_set.uring_buffers = DEFAULT_URING_BUFFERS;
+  }
+  if (s_set.nts.ke_threads < 1 || s_set.nts.ke_threads > MAX_NTS_KE_THREADS){
+    print_debug(s_set.debug, "nts_ke_threads must be between 1 and %i, using %i",
+                MAX_NTS_KE_THREADS, DEFAULT_NTS_KE_THREADS);
+    s_set.nts.ke_threads = DEFAULT_NTS_KE_THREADS;
+  }
+  if (s_set.nts.cookie_rotation < 1){
+    s_set.nts.cookie_rotation = DEFAULT_NTS_COOKIE_ROTATION;
+  }
+  // clients are told which port to send their NTS requests to
+  s_set.nts.ntp_port = s_set.server_port;
+  if (s_set.auth_required && s_set.keys.num_keys == 0){
+    fprintf(stderr, "auth_required is set but no keys were read from a "
+            "key_file\n");
+    exit(1);
+  }
+
+  // without a listen list the server listens on every address on server_port
+  if (s_set.num_listeners == 0){
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    group.sin_port = htons(s_set.server_port);
+    group.sin_addr.s_addr = INADDR_ANY;
+    add_listener(&s_set, &group);
+  }
+  if (s_set.manycast_enabled){
+    if (parse_listen_address(s_set.manycast_address, s_set.server_port,
+                             &group) != 0 ||
+        add_manycast_group(&s_set, &group) != 0){
+      fprintf(stderr, "unable to serve manycast address '%s'\n",
+              s_set.manycast_address);
+      exit(1);
+    }
+  }
+  if (assign_manycast_listeners(&s_set) != 0){
+    fprintf(stderr, "too many addresses to listen on\n");
+    exit(1);
+  }
+
   return s_set;
  }
 
 
-int initialise_server(int *sockfd, int port, struct host_info *cn, int debug){
+/*
+  Return codes:
+    0 - success
+    1 - too many listeners
+*/
+int add_listener(struct server_settings *s_set, struct sockaddr_in *addr){
+  if (s_set->num_listeners >= MAX_LISTENERS){
+    return 1;
+  }
+  s_set->listeners[s_set->num_listeners++] = *addr;
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - too many groups
+*/
+int add_manycast_group(struct server_settings *s_set, struct sockaddr_in *group){
+  if (s_set->num_manycast_groups >= MAX_LISTENERS){
+    return 1;
+  }
+  s_set->manycast_groups[s_set->num_manycast_groups++] = *group;
+  return 0;
+}
+
+
+/*
+  each group is joined on the listener bound to every address on the groups
+  port, which is added if the listen list does not already have one
+
+  Return codes:
+    0 - success
+    1 - too many listeners
+*/
+int assign_manycast_listeners(struct server_settings *s_set){
+  int i;
+  int j;
+  struct sockaddr_in any_addr;
+
+  for (j = 0; j < s_set->num_manycast_groups; j++){
+    for (i = 0; i < s_set->num_listeners; i++){
+      if (s_set->listeners[i].sin_addr.s_addr == INADDR_ANY &&
+          s_set->listeners[i].sin_port == s_set->manycast_groups[j].sin_port){
+        break;
+      }
+    }
+    if (i == s_set->num_listeners){
+      any_addr = s_set->manycast_groups[j];
+      any_addr.sin_addr.s_addr = INADDR_ANY;
+      if (add_listener(s_set, &any_addr) != 0){
+        return 1;
+      }
+    }
+    s_set->manycast_listeners[j] = i;
+  }
+  return 0;
+}
+
+
+/*
+  accepts "address:port", "address" or ":port", a missing address is every
+  address and a missing port is default_port
+
+  Return codes:
+    0 - success
+    1 - invalid address or port
+*/
+int parse_listen_address(const char *str, int default_port,
+                         struct sockaddr_in *addr){
+  int port;
+  char host[INET_ADDRSTRLEN];
+  const char *sep;
+  char *end;
+
+  port = default_port;
+  if ((sep = strrchr(str, ':')) != NULL){
+    port = strtol(sep + 1, &end, 10);
+    if (*end != '\0' || port < 1 || port > 65535){
+      return 1;
+    }
+  }
+  else{
+    sep = str + strlen(str);
+  }
+  if (sep - str >= INET_ADDRSTRLEN){
+    return 1;
+  }
+  memcpy(host, str, sep - str);
+  host[sep - str] = '\0';
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(port);
+  if (host[0] == '\0' || strcmp(host, "*") == 0){
+    addr->sin_addr.s_addr = INADDR_ANY;
+  }
+  else if (inet_pton(AF_INET, host, &addr->sin_addr) != 1){
+    return 1;
+  }
+  return 0;
+}
+
+
+int initialise_server(int *sockfd, struct sockaddr_in *addr, int reuse_port,
+                      int debug){
   int optval;
 
-  if( (*sockfd = socket( AF_INET, SOCK_DGRAM, 0)) == -1) {
+  // sockets never block, the event loop reads them once epoll says they are
+  // ready
+  if( (*sockfd = socket( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) == -1) {
       print_debug(debug, "error creating a socket");
       return 1;
   }
@@ -145,21 +913,43 @@ int initialise_server(int *sockfd, int port, struct host_info *cn, int debug){
      return 1;
   }
 
-  memset( &cn->addr, 0, sizeof( cn->addr));    /* zero struct */
-  cn->addr.sin_family = AF_INET;              /* host byte order ... */
-  cn->addr.sin_port = htons( port); /* ... short, network byte order */
-  cn->addr.sin_addr.s_addr = INADDR_ANY;
+  // lets several sockets bind the same port, one per worker thread
+  if (reuse_port &&
+      setsockopt(*sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+     print_debug( debug, "error setting up reuseable port");
+     return 1;
+  }
 
-  if( bind( *sockfd, (struct sockaddr *)&cn->addr,
+  if( bind( *sockfd, (struct sockaddr *)addr,
                       sizeof( struct sockaddr)) == -1) {
-       print_debug( debug,  "error binding to socket");
+       print_debug( debug,  "error binding to %s:%i", inet_ntoa(addr->sin_addr),
+                    ntohs(addr->sin_port));
        return 1;
   }
+
+  // a failure here is not fatal, the time after receiving is used instead
+  enable_recv_timestamps(*sockfd, debug);
+  // a socket bound to every address needs to know which one each request was
+  // sent to so the reply can come from the same address
+  if (addr->sin_addr.s_addr == INADDR_ANY &&
+      enable_recv_local_addr(*sockfd, debug) != 0){
+    return 1;
+  }
   return 0;
 }
 
 
 void parse_config_file(struct server_settings *s_set){
+  int i;
+  const char *name;
+  const char *log_level;
+  struct sockaddr_in addr;
+  config_setting_t *list;
+  const char *ratelimit_action;
+  const char *io_engine;
+  const char *clock_source;
+  const char *key_file;
+  int line_num;
   config_t cfg;
 
   cfg = setup_config_file(CONFIG_FILE); // get config file options
@@ -173,13 +963,111 @@ void parse_config_file(struct server_settings *s_set){
 
   config_lookup_int(&cfg, "server_port", &s_set->server_port);
   config_lookup_bool(&cfg, "debug", &s_set->debug);
+
+  // addresses default to server_port so it has to be read first
+  if ((list = config_lookup(&cfg, "listen")) != NULL){
+    for (i = 0; i < config_setting_length(list); i++){
+      name = config_setting_get_string_elem(list, i);
+      if (name == NULL ||
+          parse_listen_address(name, s_set->server_port, &addr) != 0 ||
+          add_listener(s_set, &addr) != 0){
+        fprintf(stderr, "unable to listen on '%s'\n", name ? name : "");
+        exit(1);
+      }
+    }
+  }
+  if ((list = config_lookup(&cfg, "manycast_groups")) != NULL){
+    for (i = 0; i < config_setting_length(list); i++){
+      name = config_setting_get_string_elem(list, i);
+      if (name == NULL ||
+          parse_listen_address(name, s_set->server_port, &addr) != 0 ||
+          !IN_MULTICAST(ntohl(addr.sin_addr.s_addr)) ||
+          add_manycast_group(s_set, &addr) != 0){
+        fprintf(stderr, "unable to join manycast group '%s'\n",
+                name ? name : "");
+        exit(1);
+      }
+    }
+  }
+  if (config_lookup_string(&cfg, "log_level", &log_level) &&
+      parse_log_level(log_level, &s_set->log_level) != 0){
+    fprintf(stderr, "unknown log_level '%s', using the default\n", log_level);
+  }
+  // debug turns on everything, including a line for every request
+  if (s_set->debug){
+    s_set->log_level = LOG_LEVEL_DEBUG;
+  }
+  config_lookup_int(&cfg, "batch_size", &s_set->batch_size);
+  config_lookup_int(&cfg, "worker_threads", &s_set->worker_threads);
+  config_lookup_bool(&cfg, "interleaved_enabled", &s_set->interleaved_enabled);
+  config_lookup_int(&cfg, "interleave_table_size", &s_set->interleave_table_size);
+
+  config_lookup_bool(&cfg, "ratelimit_enabled", &s_set->ratelimit_enabled);
+  lookup_config_number(&cfg, "ratelimit_rate", &s_set->ratelimit_rate);
+  config_lookup_int(&cfg, "ratelimit_burst", &s_set->ratelimit_burst);
+  config_lookup_int(&cfg, "ratelimit_table_size", &s_set->ratelimit_table_size);
+  if (config_lookup_string(&cfg, "ratelimit_action", &ratelimit_action)){
+    if (strcmp(ratelimit_action, "kod") == 0){
+      s_set->ratelimit_send_kod = 1;
+    }
+    else if (strcmp(ratelimit_action, "drop") == 0){
+      s_set->ratelimit_send_kod = 0;
+    }
+    else{
+      fprintf(stderr, "unknown ratelimit_action '%s', using the default\n",
+              ratelimit_action);
+    }
+  }
+
+  if (config_lookup_string(&cfg, "io_engine", &io_engine)){
+    if (strcmp(io_engine, "epoll") == 0){
+      s_set->io_engine = IO_ENGINE_EPOLL;
+    }
+    else if (strcmp(io_engine, "io_uring") == 0){
+      s_set->io_engine = IO_ENGINE_URING;
+    }
+    else{
+      fprintf(stderr, "unknown io_engine '%s', using the default\n", io_engine);
+    }
+  }
+  config_lookup_int(&cfg, "uring_entries", &s_set->uring_entries);
+  config_lookup_int(&cfg, "uring_buffers", &s_set->uring_buffers);
+  config_lookup_bool(&cfg, "uring_sqpoll", &s_set->uring_sqpoll);
+
+  if (config_lookup_string(&cfg, "clock_source", &clock_source) &&
+      parse_clock_source(clock_source, &s_set->clock_source) != 0){
+    fprintf(stderr, "unknown clock_source '%s', using the default\n",
+            clock_source);
+  }
+  lookup_config_number(&cfg, "clock_accuracy", &s_set->clock_accuracy);
+
+  // symmetric key authentication
+  if (config_lookup_string(&cfg, "key_file", &key_file)){
+    switch (load_key_table(&s_set->keys, key_file, &line_num)){
+      case 1:
+        fprintf(stderr, "unable to read key file '%s'\n", key_file);
+        exit(1);
+      case 2:
+        fprintf(stderr, "invalid key on line %i of '%s'\n", line_num,
+                key_file);
+        exit(1);
+    }
+  }
+  config_lookup_bool(&cfg, "auth_required", &s_set->auth_required);
+
+  config_lookup_bool(&cfg, "nts_enabled", &s_set->nts.enabled);
+  config_lookup_int(&cfg, "nts_ke_port", &s_set->nts.ke_port);
+  config_lookup_string(&cfg, "nts_cert_file", &s_set->nts.cert_file);
+  config_lookup_string(&cfg, "nts_key_file", &s_set->nts.key_file);
+  config_lookup_int(&cfg, "nts_ke_threads", &s_set->nts.ke_threads);
+  config_lookup_int(&cfg, "nts_cookie_rotation", &s_set->nts.cookie_rotation);
 }
 
 
-int setup_manycast(int sockfd, const char *manycast_address, int debug){
+int setup_manycast(int sockfd, struct in_addr group, int debug){
   struct ip_mreq many_req;
 
-  many_req.imr_multiaddr.s_addr = inet_addr(manycast_address);
+  many_req.imr_multiaddr = group;
   many_req.imr_interface.s_addr = htonl(INADDR_ANY);
   if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &many_req,
                 sizeof(many_req)) < 0) {
@@ -1,4 +1,12 @@
+#ifndef SNTPSERVER_H
+#define SNTPSERVER_H
+
 #include "sntptools.h"
+#include "sntpinterleave.h"
+#include "sntplog.h"
+#include "sntpratelimit.h"
+#include "sntpauth.h"
+#include "sntpntsserver.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -9,11 +17,41 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// the maximum number of requests that can be read in a single batch
+#define MAX_BATCH_SIZE 64
+// the maximum number of addresses and manycast groups the server can serve
+#define MAX_LISTENERS 16
+
+// how requests are read from and replies written to the sockets
+enum io_engine{
+  IO_ENGINE_EPOLL, // epoll with recvfrom/sendto or recvmmsg/sendmmsg
+  IO_ENGINE_URING // io_uring, falls back to epoll when unavailable
+};
 
 struct sntp_request{
   struct host_info client;
-  struct ntp_packet pkt;
-  struct ntp_time_t time_of_request;
+  // the request where it was received, it is never copied out of the
+  // receive buffer
+  const struct ntp_packet *pkt;
+  size_t len; // bytes received at pkt
+  struct ntp_packet_info info; // its extension fields and MAC
+  const struct auth_key *key; // the request was signed with, NULL if not
+  struct nts_request nts; // its NTS fields, if it has any
+  // NTS extension fields sent after the reply, then its MAC, empty if it is
+  // not signed
+  uint8_t reply_ext[NTS_MAX_REPLY_EXT_LEN];
+  size_t reply_ext_len;
+  struct ntp_mac reply_mac;
+  uint64_t time_of_request;
+  int interleaved; // reply in interleaved mode
+  uint64_t prev_transmit_time; // send time of the previous reply
+  struct interleave_entry *il_entry; // NULL when interleaved mode is off
+  // address the request was sent to, INADDR_ANY if not known
+  struct in_addr local_addr;
 };
 
 
@@ -21,23 +59,145 @@ struct sntp_request{
 struct server_settings{
   int server_port;
   int debug;
+  int log_level; // one of enum log_level
   int manycast_enabled;
   const char *manycast_address;
+  int num_listeners;
+  struct sockaddr_in listeners[MAX_LISTENERS]; // addresses to serve on
+  int num_manycast_groups;
+  struct sockaddr_in manycast_groups[MAX_LISTENERS];
+  int manycast_listeners[MAX_LISTENERS]; // listener each group is joined on
+  int batch_size; // max requests handled per recvmmsg/sendmmsg
+  int worker_threads; // number of threads each serving their own socket
+  int interleaved_enabled;
+  int interleave_table_size; // number of clients tracked per worker
+  int ratelimit_enabled;
+  double ratelimit_rate; // average requests per second allowed per client
+  int ratelimit_burst; // requests a client can send in a burst
+  int ratelimit_send_kod; // send a RATE kiss-o'-death instead of dropping
+  int ratelimit_table_size; // number of clients tracked per worker
+  int io_engine; // one of enum io_engine
+  int uring_entries; // submission queue size of each worker
+  int uring_buffers; // receive buffers of each worker
+  int uring_sqpoll; // let a kernel thread submit for each worker
+  int clock_source; // one of enum clock_source_type
+  double clock_accuracy; // seconds, the worst precision auto will pick
+  struct key_table keys; // read from key_file, empty if it is not set
+  int auth_required; // only answer requests signed with one of the keys
+  struct nts_server nts; // key establishment and cookies, if enabled
+};
+
+
+// buffers used to receive and reply to a batch of requests in one syscall each
+struct request_batch{
+  union ntp_buffer bufs[MAX_BATCH_SIZE]; // the requests are received into
+  struct sntp_request reqs[MAX_BATCH_SIZE];
+  struct ntp_packet replies[MAX_BATCH_SIZE];
+  struct sntp_request *reply_reqs[MAX_BATCH_SIZE]; // request for each reply
+  struct mmsghdr recv_msgs[MAX_BATCH_SIZE];
+  struct mmsghdr send_msgs[MAX_BATCH_SIZE];
+  struct iovec recv_iovs[MAX_BATCH_SIZE];
+  struct iovec send_iovs[MAX_BATCH_SIZE][3]; // the reply, NTS fields and MAC
+  char cmsg_bufs[MAX_BATCH_SIZE][RECV_CMSG_SIZE];
+  char send_cmsg_bufs[MAX_BATCH_SIZE][SEND_CMSG_SIZE];
+};
+
+
+// state owned by a single worker thread, nothing in here is shared with the
+// other workers so the request path never has to take a lock
+struct server_worker{
+  int id;
+  pthread_t thread;
+  int epfd; // watches every socket of this worker
+  int sockfds[MAX_LISTENERS]; // one socket per listener
+  struct request_batch *batch; // NULL when batching is off
+  struct server_settings *s_set;
+  struct interleave_table il_table;
+  struct ratelimit_table rl_table;
+  struct nts_keys nts_keys; // cookie keys this worker has derived
+  struct ntp_reject_counts rejects; // requests that failed check_packet
+  uint32_t rejects_logged; // NTP second the counts were last logged
 };
 
 
 struct ntp_packet create_reply_packet(struct sntp_request *c_req);
-int check_packet(struct sntp_request c_req, int debug);
+struct ntp_packet create_kod_packet(struct sntp_request *c_req,
+                                    const char *kiss_code);
+int check_packet(struct server_worker *worker, struct sntp_request *c_req);
+int check_nts(struct server_worker *worker, struct sntp_request *c_req);
+int check_auth(struct server_worker *worker, struct sntp_request *c_req);
+void reject_request(struct server_worker *worker, struct sntp_request *c_req,
+                    int reason);
+void sign_reply(struct server_worker *worker, struct sntp_request *c_req,
+                struct ntp_packet *reply_pkt);
 struct server_settings get_server_settings(int argc, char * argv[]);
-int initialise_server(int *sockfd, int port, struct host_info *cn, int debug);
+int add_listener(struct server_settings *s_set, struct sockaddr_in *addr);
+int add_manycast_group(struct server_settings *s_set, struct sockaddr_in *group);
+int assign_manycast_listeners(struct server_settings *s_set);
+int handle_request(struct server_worker *worker, int sockfd);
+int handle_request_batch(struct server_worker *worker, int sockfd);
+struct request_batch *initialise_request_batch(int batch_size);
+int initialise_server(int *sockfd, struct sockaddr_in *addr, int reuse_port,
+                      int debug);
+int initialise_workers(struct server_worker *workers,
+                       struct server_settings *s_set);
+void *run_worker(void *arg);
 void parse_config_file(struct server_settings *s_set);
-int setup_manycast(int sockfd, const char *manycast_address, int debug);
+int parse_listen_address(const char *str, int default_port,
+                         struct sockaddr_in *addr);
+int setup_manycast(int sockfd, struct in_addr group, int debug);
+int process_request(struct server_worker *worker, struct sntp_request *c_req,
+                    struct ntp_packet *reply_pkt);
+void record_reply_sent(struct sntp_request *c_req);
+void serve_requests(struct server_worker *worker);
+int send_reply_batch(int sockfd, struct mmsghdr *msgs, int count);
 
 
 #define CONFIG_FILE "server_config.cfg"
 
 // set default settings
 #define DEFAULT_debug 0
+// per request messages are logged at debug level so are off by default
+#define DEFAULT_LOG_LEVEL LOG_LEVEL_INFO
 #define DEFAULT_MANYCAST_ENABLED 0
 #define DEFAULT_MANYCAST_ADDRESS "224.0.1.1"
 #define DEFAULT_SERVER_PORT 6001
+// 1 disables batching, each request is then received and sent on its own
+#define DEFAULT_BATCH_SIZE 1
+// 1 serves every request from the main thread
+#define DEFAULT_WORKER_THREADS 1
+// the maximum number of worker threads that can be started
+#define MAX_WORKER_THREADS 256
+// the most requests or batches read from one socket before the others get a
+// turn
+#define LISTENER_DRAIN_LIMIT 16
+// answer clients that ask for interleaved mode
+#define DEFAULT_INTERLEAVED_ENABLED 1
+// number of clients each worker remembers for interleaved mode
+#define DEFAULT_INTERLEAVE_TABLE_SIZE 4096
+// per client rate limiting, off unless turned on in the config file
+#define DEFAULT_RATELIMIT_ENABLED 0
+#define DEFAULT_RATELIMIT_RATE 1.0
+#define DEFAULT_RATELIMIT_BURST 8
+#define DEFAULT_RATELIMIT_SEND_KOD 1
+#define DEFAULT_RATELIMIT_TABLE_SIZE 65536
+#define DEFAULT_IO_ENGINE IO_ENGINE_EPOLL
+#define DEFAULT_URING_ENTRIES 256
+#define DEFAULT_URING_BUFFERS 1024
+#define DEFAULT_URING_SQPOLL 0
+#define DEFAULT_AUTH_REQUIRED 0
+// network time security, needs a certificate and key for key establishment
+#define DEFAULT_NTS_ENABLED 0
+#define DEFAULT_NTS_KE_PORT NTS_KE_PORT
+#define DEFAULT_NTS_CERT_FILE "nts.crt"
+#define DEFAULT_NTS_KEY_FILE "nts.key"
+#define DEFAULT_NTS_KE_THREADS 2
+// a day, cookies are then accepted for two to three days
+#define DEFAULT_NTS_COOKIE_ROTATION 86400
+// the kernel limits for the queue size and number of provided buffers
+#define MAX_URING_ENTRIES 32768
+#define MAX_URING_BUFFERS 32768
+// the most often the rejected request counts of a worker are logged
+#define REJECT_LOG_INTERVAL 60
+
+#endif
@@ -0,0 +1,394 @@
+/* sntpsiv.c - AES-SIV for NTS, on AES-NI where the CPU has it
+ */
+
+#include "sntpsiv.h"
+
+static void expand_aes128_key(struct aes128_key *key, const uint8_t *raw);
+static void encrypt_block(const struct aes128_key *key, const uint8_t *in,
+                          uint8_t *out);
+static void compute_s2v(const struct aes_siv_key *key, const uint8_t *ad,
+                        size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                        const uint8_t *p, size_t p_len, uint8_t *v);
+static void compute_cmac(const struct aes_siv_key *key, const uint8_t *data,
+                         size_t len, const uint8_t *xorend, uint8_t *mac);
+static void encrypt_cbc(const struct aes128_key *key, uint8_t *mac,
+                        const uint8_t *data, size_t num_blocks);
+static void apply_ctr(const struct aes_siv_key *key, const uint8_t *iv,
+                      const uint8_t *in, size_t len, uint8_t *out);
+static void double_block(const uint8_t *in, uint8_t *out);
+#ifdef HAVE_AESNI
+static void expand_aes128_key_aesni(struct aes128_key *key, const uint8_t *raw);
+static void encrypt_block_aesni(const struct aes128_key *key, const uint8_t *in,
+                                uint8_t *out);
+static void encrypt_cbc_aesni(const struct aes128_key *key, uint8_t *mac,
+                              const uint8_t *data, size_t num_blocks);
+static void apply_ctr_aesni(const struct aes128_key *key, const uint8_t *ctr,
+                            const uint8_t *in, size_t len, uint8_t *out);
+#endif
+
+
+// raw is AES_SIV_KEY_LEN bytes
+void expand_aes_siv_key(struct aes_siv_key *key, const uint8_t *raw){
+  uint8_t zero[AES_BLOCK_SIZE];
+  uint8_t l[AES_BLOCK_SIZE];
+
+  expand_aes128_key(&key->mac, raw);
+  expand_aes128_key(&key->ctr, raw + AES_SIV_KEY_LEN / 2);
+
+  // the subkeys as for any CMAC (RFC 4493)
+  memset(zero, 0, sizeof(zero));
+  encrypt_block(&key->mac, zero, l);
+  double_block(l, key->k1);
+  double_block(key->k1, key->k2);
+  OPENSSL_cleanse(l, sizeof(l));
+  compute_cmac(key, zero, AES_BLOCK_SIZE, NULL, key->d0);
+}
+
+
+/*
+  out is the AES_SIV_TAG_LEN byte tag then the len bytes of ciphertext, it
+  must not overlap in
+*/
+void aes_siv_encrypt(const struct aes_siv_key *key, const uint8_t *ad,
+                     size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                     const uint8_t *in, size_t len, uint8_t *out){
+  compute_s2v(key, ad, ad_len, nonce, nonce_len, in, len, out);
+  apply_ctr(key, out, in, len, out + AES_SIV_TAG_LEN);
+}
+
+
+/*
+  in is the tag then the ciphertext, len bytes of both, out gets the
+  len - AES_SIV_TAG_LEN bytes of plaintext and must not overlap in. out is
+  wiped if the tag does not match
+
+  Return codes:
+    0 - success
+    1 - in is too short or has been tampered with
+*/
+int aes_siv_decrypt(const struct aes_siv_key *key, const uint8_t *ad,
+                    size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                    const uint8_t *in, size_t len, uint8_t *out){
+  uint8_t v[AES_SIV_TAG_LEN];
+
+  if (len < AES_SIV_TAG_LEN){
+    return 1;
+  }
+  apply_ctr(key, in, in + AES_SIV_TAG_LEN, len - AES_SIV_TAG_LEN, out);
+  compute_s2v(key, ad, ad_len, nonce, nonce_len, out, len - AES_SIV_TAG_LEN, v);
+  if (CRYPTO_memcmp(v, in, AES_SIV_TAG_LEN) != 0){
+    OPENSSL_cleanse(out, len - AES_SIV_TAG_LEN);
+    return 1;
+  }
+  return 0;
+}
+
+
+static void expand_aes128_key(struct aes128_key *key, const uint8_t *raw){
+#ifdef HAVE_AESNI
+  // the CPU is only asked once, the answer is cached by the compiler runtime
+  if ((key->aesni = __builtin_cpu_supports("aes"))){
+    expand_aes128_key_aesni(key, raw);
+    return;
+  }
+#endif
+  key->aesni = 0;
+  AES_set_encrypt_key(raw, 128, &key->u.schedule);
+}
+
+
+static void encrypt_block(const struct aes128_key *key, const uint8_t *in,
+                          uint8_t *out){
+#ifdef HAVE_AESNI
+  if (key->aesni){
+    encrypt_block_aesni(key, in, out);
+    return;
+  }
+#endif
+  AES_encrypt(in, out, &key->u.schedule);
+}
+
+
+/*
+  the synthetic IV of the associated data, nonce and plaintext in that order
+  (RFC 5297 section 2.4), each string is folded into the running value with
+  a doubling so the order matters
+*/
+static void compute_s2v(const struct aes_siv_key *key, const uint8_t *ad,
+                        size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                        const uint8_t *p, size_t p_len, uint8_t *v){
+  int i;
+  uint8_t d[AES_BLOCK_SIZE];
+  uint8_t mac[AES_BLOCK_SIZE];
+
+  memcpy(d, key->d0, AES_BLOCK_SIZE);
+  compute_cmac(key, ad, ad_len, NULL, mac);
+  double_block(d, d);
+  for (i = 0; i < AES_BLOCK_SIZE; i++){
+    d[i] ^= mac[i];
+  }
+  compute_cmac(key, nonce, nonce_len, NULL, mac);
+  double_block(d, d);
+  for (i = 0; i < AES_BLOCK_SIZE; i++){
+    d[i] ^= mac[i];
+  }
+
+  // the last string is xored onto the end of a long plaintext, a short one is
+  // padded out to a block and xored with d doubled once more
+  if (p_len >= AES_BLOCK_SIZE){
+    compute_cmac(key, p, p_len, d, v);
+    return;
+  }
+  double_block(d, d);
+  for (i = 0; i < (int)p_len; i++){
+    d[i] ^= p[i];
+  }
+  d[p_len] ^= 0x80;
+  compute_cmac(key, d, AES_BLOCK_SIZE, NULL, v);
+}
+
+
+/*
+  CBC-MAC of the blocks with the last one masked by a subkey, as in
+  sntpauth.c. xorend, when not NULL, is a block xored onto the last
+  AES_BLOCK_SIZE bytes of data (at least a block long) as S2V needs, the
+  blocks it falls in are copied out so a long plaintext is not
+*/
+static void compute_cmac(const struct aes_siv_key *key, const uint8_t *data,
+                         size_t len, const uint8_t *xorend, uint8_t *mac){
+  size_t i;
+  size_t start;
+  size_t last; // offset of the last block, which may be partial or empty
+  size_t last_len;
+  uint8_t tail[2 * AES_BLOCK_SIZE];
+  const uint8_t *subkey;
+
+  last = len == 0 ? 0 : (len - 1) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+  last_len = len - last;
+  memset(mac, 0, AES_BLOCK_SIZE);
+  if (xorend == NULL){
+    encrypt_cbc(&key->mac, mac, data, last / AES_BLOCK_SIZE);
+    memcpy(tail, data + last, last_len);
+  }
+  else{
+    // xorend starts in the last block or the one before it
+    start = (len - AES_BLOCK_SIZE) / AES_BLOCK_SIZE * AES_BLOCK_SIZE;
+    encrypt_cbc(&key->mac, mac, data, start / AES_BLOCK_SIZE);
+    memcpy(tail, data + start, len - start);
+    for (i = 0; i < AES_BLOCK_SIZE; i++){
+      tail[len - AES_BLOCK_SIZE - start + i] ^= xorend[i];
+    }
+    if (start < last){
+      encrypt_cbc(&key->mac, mac, tail, 1);
+      memmove(tail, tail + AES_BLOCK_SIZE, last_len);
+    }
+  }
+
+  subkey = last_len == AES_BLOCK_SIZE ? key->k1 : key->k2;
+  for (i = 0; i < AES_BLOCK_SIZE; i++){
+    if (i < last_len){
+      mac[i] ^= tail[i];
+    }
+    else if (i == last_len){
+      mac[i] ^= 0x80;
+    }
+    mac[i] ^= subkey[i];
+  }
+  encrypt_block(&key->mac, mac, mac);
+}
+
+
+// mac is replaced by the encryption of itself xored with each block in turn
+static void encrypt_cbc(const struct aes128_key *key, uint8_t *mac,
+                        const uint8_t *data, size_t num_blocks){
+  size_t i;
+  size_t j;
+
+#ifdef HAVE_AESNI
+  if (key->aesni){
+    encrypt_cbc_aesni(key, mac, data, num_blocks);
+    return;
+  }
+#endif
+  for (j = 0; j < num_blocks; j++){
+    for (i = 0; i < AES_BLOCK_SIZE; i++){
+      mac[i] ^= data[j * AES_BLOCK_SIZE + i];
+    }
+    AES_encrypt(mac, mac, &key->u.schedule);
+  }
+}
+
+
+static void apply_ctr(const struct aes_siv_key *key, const uint8_t *iv,
+                      const uint8_t *in, size_t len, uint8_t *out){
+  int i;
+  size_t n;
+  size_t offset;
+  uint8_t ctr[AES_BLOCK_SIZE];
+  uint8_t stream[AES_BLOCK_SIZE];
+
+  // the top bits of the last two 32 bit words are cleared so the counter can
+  // be added to the low 64 bits without a carry out of them (RFC 5297
+  // section 2.5)
+  memcpy(ctr, iv, AES_BLOCK_SIZE);
+  ctr[8] &= 0x7f;
+  ctr[12] &= 0x7f;
+#ifdef HAVE_AESNI
+  if (key->ctr.aesni){
+    apply_ctr_aesni(&key->ctr, ctr, in, len, out);
+    return;
+  }
+#endif
+
+  for (offset = 0; offset < len; offset += AES_BLOCK_SIZE){
+    encrypt_block(&key->ctr, ctr, stream);
+    n = len - offset < AES_BLOCK_SIZE ? len - offset : AES_BLOCK_SIZE;
+    for (i = 0; i < (int)n; i++){
+      out[offset + i] = in[offset + i] ^ stream[i];
+    }
+    for (i = AES_BLOCK_SIZE - 1; i >= 8 && ++ctr[i] == 0; i--);
+  }
+}
+
+
+// in shifted left a bit, with Rb added if the top bit fell off. in and out
+// can be the same block
+static void double_block(const uint8_t *in, uint8_t *out){
+  int i;
+  uint8_t carry = in[0] >> 7;
+
+  for (i = 0; i < AES_BLOCK_SIZE - 1; i++){
+    out[i] = (in[i] << 1) | (in[i + 1] >> 7);
+  }
+  out[AES_BLOCK_SIZE - 1] = (in[AES_BLOCK_SIZE - 1] << 1) ^ (carry ? 0x87 : 0);
+}
+
+
+#ifdef HAVE_AESNI
+
+// the next round key from the last and the keygenassist of it
+__attribute__((target("aes,sse2")))
+static inline __m128i expand_round_key(__m128i key, __m128i assist){
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+// keygenassist takes the round constant as an immediate
+#define EXPAND_ROUND_KEY(rk, i, rcon) \
+  rk[i] = expand_round_key(rk[i - 1], _mm_aeskeygenassist_si128(rk[i - 1], rcon))
+
+__attribute__((target("aes,sse2")))
+static void expand_aes128_key_aesni(struct aes128_key *key, const uint8_t *raw){
+  __m128i *rk = (__m128i *)key->u.round_keys;
+
+  rk[0] = _mm_loadu_si128((const __m128i *)raw);
+  EXPAND_ROUND_KEY(rk, 1, 0x01);
+  EXPAND_ROUND_KEY(rk, 2, 0x02);
+  EXPAND_ROUND_KEY(rk, 3, 0x04);
+  EXPAND_ROUND_KEY(rk, 4, 0x08);
+  EXPAND_ROUND_KEY(rk, 5, 0x10);
+  EXPAND_ROUND_KEY(rk, 6, 0x20);
+  EXPAND_ROUND_KEY(rk, 7, 0x40);
+  EXPAND_ROUND_KEY(rk, 8, 0x80);
+  EXPAND_ROUND_KEY(rk, 9, 0x1b);
+  EXPAND_ROUND_KEY(rk, 10, 0x36);
+}
+
+
+__attribute__((target("aes,sse2")))
+static void encrypt_block_aesni(const struct aes128_key *key, const uint8_t *in,
+                                uint8_t *out){
+  int i;
+  const __m128i *rk = (const __m128i *)key->u.round_keys;
+  __m128i m;
+
+  m = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), rk[0]);
+  for (i = 1; i < 10; i++){
+    m = _mm_aesenc_si128(m, rk[i]);
+  }
+  _mm_storeu_si128((__m128i *)out, _mm_aesenclast_si128(m, rk[10]));
+}
+
+
+// the chain stays in a register from one block to the next
+__attribute__((target("aes,sse2")))
+static void encrypt_cbc_aesni(const struct aes128_key *key, uint8_t *mac,
+                              const uint8_t *data, size_t num_blocks){
+  int i;
+  size_t j;
+  const __m128i *rk = (const __m128i *)key->u.round_keys;
+  __m128i m;
+
+  m = _mm_loadu_si128((const __m128i *)mac);
+  for (j = 0; j < num_blocks; j++){
+    m = _mm_xor_si128(m, _mm_loadu_si128((const __m128i *)
+                                         (data + j * AES_BLOCK_SIZE)));
+    m = _mm_xor_si128(m, rk[0]);
+    for (i = 1; i < 10; i++){
+      m = _mm_aesenc_si128(m, rk[i]);
+    }
+    m = _mm_aesenclast_si128(m, rk[10]);
+  }
+  _mm_storeu_si128((__m128i *)mac, m);
+}
+
+
+/*
+  CTR blocks do not depend on each other, so four are kept in flight at once
+  to cover the latency of aesenc. ctr has its counter bits cleared already
+*/
+__attribute__((target("aes,sse2")))
+static void apply_ctr_aesni(const struct aes128_key *key, const uint8_t *ctr,
+                            const uint8_t *in, size_t len, uint8_t *out){
+  int i;
+  int j;
+  int n;
+  size_t offset;
+  uint64_t high;
+  uint64_t low;
+  uint64_t counter[2];
+  uint8_t stream[AES_BLOCK_SIZE];
+  const __m128i *rk = (const __m128i *)key->u.round_keys;
+  __m128i b[4];
+
+  memcpy(&high, ctr, 8);
+  memcpy(&low, ctr + 8, 8);
+  low = __builtin_bswap64(low);
+  counter[0] = high;
+
+  for (offset = 0; offset < len; offset += n * AES_BLOCK_SIZE){
+    n = (len - offset + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    if (n > 4){
+      n = 4;
+    }
+    for (j = 0; j < n; j++){
+      counter[1] = __builtin_bswap64(low++);
+      b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)counter), rk[0]);
+    }
+    for (i = 1; i < 10; i++){
+      for (j = 0; j < n; j++){
+        b[j] = _mm_aesenc_si128(b[j], rk[i]);
+      }
+    }
+    for (j = 0; j < n; j++){
+      b[j] = _mm_aesenclast_si128(b[j], rk[10]);
+      if (offset + (j + 1) * AES_BLOCK_SIZE <= len){
+        _mm_storeu_si128((__m128i *)(out + offset + j * AES_BLOCK_SIZE),
+                         _mm_xor_si128(b[j], _mm_loadu_si128(
+                           (const __m128i *)(in + offset + j * AES_BLOCK_SIZE))));
+        continue;
+      }
+      // a partial last block
+      _mm_storeu_si128((__m128i *)stream, b[j]);
+      for (i = 0; offset + j * AES_BLOCK_SIZE + i < len; i++){
+        out[offset + j * AES_BLOCK_SIZE + i] =
+          in[offset + j * AES_BLOCK_SIZE + i] ^ stream[i];
+      }
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef SNTPSIV_H
+#define SNTPSIV_H
+
+// AES_set_encrypt_key and AES_encrypt are used where there is no AES-NI, see
+// sntpauth.h
+#ifndef OPENSSL_API_COMPAT
+#define OPENSSL_API_COMPAT 10101
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <openssl/aes.h>
+#include <openssl/crypto.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_AESNI 1
+#endif
+
+/*
+  AEAD_AES_SIV_CMAC_256 (RFC 5297), the AEAD every NTS implementation has to
+  support. A 32 byte key is two AES-128 keys, the first makes the synthetic IV
+  with S2V over the associated data, nonce and plaintext, the second encrypts
+  the plaintext in CTR mode under that IV. The IV doubles as the tag so a
+  repeated nonce only shows that the same message was sent twice, which lets
+  nonces be a counter.
+
+  Keys are expanded once into a struct aes_siv_key along with the CMAC
+  subkeys and the CMAC of the zero block every S2V starts from. Blocks are
+  encrypted with AES-NI when the CPU has it, checked when a key is expanded,
+  and with OpenSSL's AES otherwise.
+*/
+
+#define AES_SIV_KEY_LEN 32
+#define AES_SIV_TAG_LEN 16
+
+// an AES-128 key expanded for encryption
+struct aes128_key{
+  int aesni; // round_keys is used rather than schedule
+  union{
+    uint8_t round_keys[11][16] __attribute__((aligned(16)));
+    AES_KEY schedule;
+  } u;
+};
+
+struct aes_siv_key{
+  struct aes128_key mac; // the S2V key
+  struct aes128_key ctr; // the CTR key
+  uint8_t k1[AES_BLOCK_SIZE]; // CMAC subkey for a whole last block
+  uint8_t k2[AES_BLOCK_SIZE]; // CMAC subkey for a padded last block
+  uint8_t d0[AES_BLOCK_SIZE]; // CMAC of the zero block
+};
+
+
+void expand_aes_siv_key(struct aes_siv_key *key, const uint8_t *raw);
+void aes_siv_encrypt(const struct aes_siv_key *key, const uint8_t *ad,
+                     size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                     const uint8_t *in, size_t len, uint8_t *out);
+int aes_siv_decrypt(const struct aes_siv_key *key, const uint8_t *ad,
+                    size_t ad_len, const uint8_t *nonce, size_t nonce_len,
+                    const uint8_t *in, size_t len, uint8_t *out);
+
+#endif
@@ -4,40 +4,108 @@
 #include "sntptools.h"
 
 
-struct ntp_time_t get_ntp_time_of_day(){
-  struct ntp_time_t ts_ntp;
-  struct timeval ts_unix;
+uint64_t get_ntp_time_of_day(void){
+  struct timespec ts_unix;
 
-  gettimeofday(&ts_unix, NULL);
-  convert_unix_time_into_ntp_time(&ts_unix, &ts_ntp);
-  return ts_ntp;
+  read_clock_source(&ts_unix);
+  return convert_timespec_into_ntp_time(&ts_unix);
 }
 
 
-int recieve_SNTP_packet(int sockfd, struct ntp_packet *pkt,
-                        struct sockaddr_in *addr, struct timeval *dest_time,
-                        int debug){
-  socklen_t addr_len;
+// end - start as signed 32.32 seconds, correct while they are within 68
+// years of each other
+int64_t get_ntp_time_difference(uint64_t end, uint64_t start){
+  return (int64_t)(end - start);
+}
+
+
+double convert_ntp_time_into_seconds(int64_t ntp){
+  return ntp / 4294967296.0;
+}
+
+
+/*
+  the arrival time is taken from the kernel timestamp attached to the packet,
+  so it does not include the time spent waking up and returning from the
+  syscall. the clock is read after the receive only if no timestamp came back.
+  local_addr, when not NULL, is set to the address the packet was sent to so
+  a reply can be sent from it. it is left untouched if it is not known. len is
+  set to the number of bytes received, which the packet checks need. a
+  datagram too long for buf is cut short but len is still its full length,
+  so the checks reject it instead of reading what was cut.
+*/
+int recieve_SNTP_packet(int sockfd, union ntp_buffer *buf, size_t *len,
+                        struct sockaddr_in *addr, struct timespec *dest_time,
+                        struct in_addr *local_addr, int debug){
   int numbytes;
+  struct iovec iov;
+  struct msghdr msg;
+  char cmsg_buf[RECV_CMSG_SIZE];
 
-  memset( pkt, 0, sizeof *pkt );
-  addr_len = sizeof( struct sockaddr);
-  if( (numbytes = recvfrom( sockfd, pkt, MAXBUFLEN - 1, 0,
-               (struct sockaddr *)addr, &addr_len)) == -1) {
+  iov.iov_base = buf;
+  iov.iov_len = sizeof(*buf);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = addr;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cmsg_buf;
+  msg.msg_controllen = sizeof(cmsg_buf);
+
+  if( (numbytes = recvmsg( sockfd, &msg, MSG_TRUNC)) == -1) {
     print_debug(debug, "socket recv timeout");
     return  1;
   }
-  gettimeofday(dest_time, NULL); // store time of packet arrival
+  *len = numbytes;
+  // store time of packet arrival
+  if (dest_time != NULL && get_recv_timestamp(&msg, dest_time) != 0){
+    read_clock_source(dest_time);
+  }
+  if (local_addr != NULL){
+    get_recv_local_addr(&msg, local_addr);
+  }
   print_debug(debug, "got packet from %s", inet_ntoa( addr->sin_addr));
   return 0;
 }
 
 
-int send_SNTP_packet(struct ntp_packet *pkt, int sockfd, struct sockaddr_in addr,
+/*
+  ext_len bytes of extension fields at ext and then mac, when not NULL and not
+  empty, are sent straight after the packet without copying any of them.
+  local_addr, when not NULL, is the source address the packet is sent from,
+  otherwise the kernel picks one from its routing table
+*/
+int send_SNTP_packet(struct ntp_packet *pkt, const void *ext, size_t ext_len,
+                     const struct ntp_mac *mac, int sockfd,
+                     struct sockaddr_in addr, struct in_addr *local_addr,
                      int debug){
   int numbytes;
-  if( (numbytes = sendto( sockfd, pkt, sizeof(struct ntp_packet), 0,
-      (struct sockaddr *)&addr, sizeof( struct sockaddr))) == -1) {
+  struct iovec iov[3];
+  struct msghdr msg;
+  char cmsg_buf[SEND_CMSG_SIZE];
+
+  iov[0].iov_base = pkt;
+  iov[0].iov_len = sizeof(struct ntp_packet);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &addr;
+  msg.msg_namelen = sizeof(struct sockaddr_in);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  if (ext_len > 0){
+    iov[msg.msg_iovlen].iov_base = (void *)ext;
+    iov[msg.msg_iovlen].iov_len = ext_len;
+    msg.msg_iovlen++;
+  }
+  if (mac != NULL && mac->len > 0){
+    iov[msg.msg_iovlen].iov_base = (void *)mac->data;
+    iov[msg.msg_iovlen].iov_len = mac->len;
+    msg.msg_iovlen++;
+  }
+  if (local_addr != NULL){
+    set_send_local_addr(&msg, cmsg_buf, *local_addr);
+  }
+
+  if( (numbytes = sendmsg( sockfd, &msg, 0)) == -1) {
     print_debug(debug, "error with sending packet");
     return  1;
   }
@@ -45,3 +113,168 @@ int send_SNTP_packet(struct ntp_packet *pkt, int sockfd, struct sockaddr_in addr
                           inet_ntoa( addr.sin_addr));
   return 0;
 }
+
+
+/*
+  ask the kernel to stamp every datagram with its arrival time, the timestamp
+  is then read back from the ancillary data of each message with nanosecond
+  resolution
+*/
+int enable_recv_timestamps(int sockfd, int debug){
+  int optval = 1;
+
+  if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval,
+                 sizeof(optval)) != 0){
+    print_debug(debug, "unable to enable kernel receive timestamps");
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - kernel timestamp found and copied into recv_time
+    1 - no timestamp attached, recv_time is left untouched
+*/
+int get_recv_timestamp(struct msghdr *msg, struct timespec *recv_time){
+  struct cmsghdr *cmsg;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)){
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS){
+      memcpy(recv_time, CMSG_DATA(cmsg), sizeof(struct timespec));
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+// integer only conversions so no resolution is lost going to and from ns. the
+// fraction is truncated one way and rounded back the other, so a timespec
+// comes back out exactly as it went in. the top two fractions round up to a
+// whole second, which is carried so tv_nsec stays below 1e9
+uint64_t convert_timespec_into_ntp_time(struct timespec *ts){
+  return (uint64_t)(uint32_t)(ts->tv_sec + NTP_UNIX_EPOCH_OFFSET) << 32 |
+         ((uint64_t)ts->tv_nsec << 32) / 1000000000;
+}
+
+
+void convert_ntp_time_into_timespec(uint64_t ntp, struct timespec *ts){
+  ts->tv_sec = (uint32_t)(ntp >> 32) - NTP_UNIX_EPOCH_OFFSET;
+  ts->tv_nsec = (long)(((ntp & 0xffffffffULL) * 1000000000 +
+                        0x80000000ULL) >> 32);
+  if (ts->tv_nsec >= 1000000000){
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+
+/*
+  libconfig keeps ints and floats apart, this accepts either so settings can be
+  written as 2 or 0.5
+
+  Return codes:
+    1 - setting found and copied into value
+    0 - setting not found, value is left untouched
+*/
+int lookup_config_number(const config_t *cfg, const char *path, double *value){
+  int int_value;
+
+  if (config_lookup_float(cfg, path, value)){
+    return 1;
+  }
+  if (config_lookup_int(cfg, path, &int_value)){
+    *value = int_value;
+    return 1;
+  }
+  return 0;
+}
+
+
+// the kernel then reports the destination address of every datagram
+int enable_recv_local_addr(int sockfd, int debug){
+  int optval = 1;
+
+  if (setsockopt(sockfd, IPPROTO_IP, IP_PKTINFO, &optval, sizeof(optval)) != 0){
+    print_debug(debug, "unable to enable packet destination addresses");
+    return 1;
+  }
+  return 0;
+}
+
+
+/*
+  finds the local address a datagram was sent to. a multicast or broadcast
+  destination cannot be replied from, the address of the interface the packet
+  arrived on is used for those instead.
+
+  Return codes:
+    0 - address found and copied into local_addr
+    1 - no address attached, local_addr is left untouched
+*/
+int get_recv_local_addr(struct msghdr *msg, struct in_addr *local_addr){
+  struct cmsghdr *cmsg;
+  struct in_pktinfo pktinfo;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)){
+    if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO){
+      memcpy(&pktinfo, CMSG_DATA(cmsg), sizeof(pktinfo));
+      if (IN_MULTICAST(ntohl(pktinfo.ipi_addr.s_addr)) ||
+          pktinfo.ipi_addr.s_addr == INADDR_BROADCAST){
+        *local_addr = pktinfo.ipi_spec_dst;
+      }
+      else{
+        *local_addr = pktinfo.ipi_addr;
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*
+  attaches the source address to a message about to be sent, cmsg_buf must be
+  SEND_CMSG_SIZE bytes and stay valid until the message is sent
+*/
+void set_send_local_addr(struct msghdr *msg, char *cmsg_buf,
+                         struct in_addr local_addr){
+  struct cmsghdr *cmsg;
+  struct in_pktinfo pktinfo;
+
+  memset(cmsg_buf, 0, SEND_CMSG_SIZE);
+  msg->msg_control = cmsg_buf;
+  msg->msg_controllen = SEND_CMSG_SIZE;
+  cmsg = CMSG_FIRSTHDR(msg);
+  cmsg->cmsg_level = IPPROTO_IP;
+  cmsg->cmsg_type = IP_PKTINFO;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+
+  memset(&pktinfo, 0, sizeof(pktinfo));
+  pktinfo.ipi_spec_dst = local_addr;
+  memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+}
+
+
+void create_packet(struct ntp_packet *pkt){
+  memset( pkt, 0, sizeof *pkt ); // zero all fields in struct
+
+   // set SNTP V4 and Mode 3(client)
+  set_ntp_header(pkt, 0, 4, NTP_MODE_CLIENT);
+
+  write_ntp_timestamp(&pkt->transmit_timestamp, get_ntp_time_of_day());
+ }
+
+
+/*
+  an interleaved reply echoes the receive field of the request, which holds T4
+  of the previous exchange, rather than the transmit field
+*/
+int is_interleaved_reply(const struct ntp_packet *req_pkt,
+                         const struct ntp_packet *rep_pkt){
+  return !is_ntp_timestamp_zero(&req_pkt->receive_timestamp) &&
+         is_same_ntp_timestamp(&rep_pkt->originate_timestamp,
+                               &req_pkt->receive_timestamp);
+}
@@ -1,38 +1,70 @@
+#ifndef SNTPTOOLS_H
+#define SNTPTOOLS_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // recvmmsg/sendmmsg
+#endif
+
 #include "reusedlib.h" // reused code found online
+#include "sntpclock.h"
+#include "sntpcodec.h"
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <string.h> // memset
 #include <unistd.h>
+#include <time.h>
 
 
-struct ntp_packet {
-  uint8_t li_vn_mode;
-  uint8_t stratum;
-  uint8_t poll;
-  int8_t  precision;
-  int32_t root_delay;
-  uint32_t root_dispersion;
-  uint32_t reference_identifier;
-  struct ntp_time_t reference_timestamp;
-  struct ntp_time_t originate_timestamp;
-  struct ntp_time_t receive_timestamp;
-  struct ntp_time_t transmit_timestamp;
-};
-
 struct host_info{
   const char *name; //hostname
   struct sockaddr_in addr;
 };
 
 
-#define MAXBUFLEN 200
+// space needed for the ancillary data holding a packets kernel timestamp
+#define RECV_TIMESTAMP_CMSG_SIZE CMSG_SPACE(sizeof(struct timespec))
+// space for a packets kernel timestamp and its destination address
+#define RECV_CMSG_SIZE (RECV_TIMESTAMP_CMSG_SIZE + \
+                        CMSG_SPACE(sizeof(struct in_pktinfo)))
+// space for the source address of a packet being sent
+#define SEND_CMSG_SIZE CMSG_SPACE(sizeof(struct in_pktinfo))
+// seconds from Jan 1, 1900 to Jan 1, 1970
+#define NTP_UNIX_EPOCH_OFFSET 0x83AA7E80UL
+
+/*
+  Timestamps are kept in host order as a single uint64_t in the 32.32 fixed
+  point format of the packet, seconds since 1900 in the top half. Two of them
+  are subtracted as integers and the difference read as a signed 32.32 number
+  of seconds, which keeps the full 2^-32 second resolution and also works
+  across the 2036 rollover of the seconds field. struct ntp_time_t is only the
+  network order layout in the packet.
+*/
 
 
-struct ntp_time_t get_ntp_time_of_day();
-int recieve_SNTP_packet(int sockfd, struct ntp_packet *pkt,
-                        struct sockaddr_in *addr, struct timeval *dest_time,
-                        int debug_enabled);
-int send_SNTP_packet(struct ntp_packet *pkt, int sockfd, struct sockaddr_in addr,
+uint64_t get_ntp_time_of_day(void);
+int64_t get_ntp_time_difference(uint64_t end, uint64_t start);
+double convert_ntp_time_into_seconds(int64_t ntp);
+int recieve_SNTP_packet(int sockfd, union ntp_buffer *buf, size_t *len,
+                        struct sockaddr_in *addr, struct timespec *dest_time,
+                        struct in_addr *local_addr, int debug_enabled);
+int send_SNTP_packet(struct ntp_packet *pkt, const void *ext, size_t ext_len,
+                     const struct ntp_mac *mac, int sockfd,
+                     struct sockaddr_in addr, struct in_addr *local_addr,
                      int debug_enabled);
+int enable_recv_timestamps(int sockfd, int debug_enabled);
+int get_recv_timestamp(struct msghdr *msg, struct timespec *recv_time);
+int enable_recv_local_addr(int sockfd, int debug_enabled);
+int get_recv_local_addr(struct msghdr *msg, struct in_addr *local_addr);
+void set_send_local_addr(struct msghdr *msg, char *cmsg_buf,
+                         struct in_addr local_addr);
+uint64_t convert_timespec_into_ntp_time(struct timespec *ts);
+void convert_ntp_time_into_timespec(uint64_t ntp, struct timespec *ts);
+int lookup_config_number(const config_t *cfg, const char *path, double *value);
+void create_packet(struct ntp_packet *pkt);
+int is_interleaved_reply(const struct ntp_packet *req_pkt,
+                         const struct ntp_packet *rep_pkt);
+
+#endif
@@ -0,0 +1,474 @@
+/* sntpuring.c - io_uring request loop for the server
+ */
+
+#include "sntpuring.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// the top half of user_data says what a completion is for and the bottom half
+// which listener or send slot it belongs to
+#define URING_OP_RECV 0ULL
+#define URING_OP_SEND 1ULL
+#define URING_USER_DATA(op, index) (((op) << 32) | (uint32_t)(index))
+
+static int arm_recv(struct uring *ring, int sockfd, int listener);
+static struct io_uring_sqe *get_sqe(struct uring *ring);
+static void handle_uring_request(struct server_worker *worker,
+                                 struct uring *ring, int listener, char *buf,
+                                 int len);
+static int queue_send(struct uring *ring, int sockfd, int slot);
+static int reap_completions(struct server_worker *worker, struct uring *ring);
+static void recycle_buffer(struct uring *ring, unsigned short bid);
+static int submit_uring(struct uring *ring, int wait);
+
+
+/*
+  entries is the size of the submission queue, the completion queue is made
+  four times larger as every submission can produce a completion and a
+  multishot receive produces one for every request. num_bufs receive buffers
+  are shared by all of the listeners.
+
+  Return codes:
+    0 - success
+    1 - io_uring is not available or not new enough
+*/
+int initialise_uring(struct uring *ring, int entries, int num_bufs, int sqpoll){
+  int i;
+  size_t cq_ring_size;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+  ring->sqpoll = sqpoll;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = entries * 4;
+  if (sqpoll){
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 1000; // ms before the kernel thread sleeps
+  }
+  if ((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0){
+    return 1;
+  }
+  // the multishot receive needs IORING_FEAT_NODROP otherwise requests are
+  // lost whenever the completion queue fills up
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP)){
+    free_uring(ring);
+    return 1;
+  }
+
+  // both queues share one mapping
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size = params.cq_off.cqes +
+                 params.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_ring_size > ring->sq_ring_size){
+    ring->sq_ring_size = cq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED){
+    ring->sq_ring = NULL;
+    free_uring(ring);
+    return 1;
+  }
+  ring->cq_ring = ring->sq_ring;
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED){
+    ring->sqes = NULL;
+    free_uring(ring);
+    return 1;
+  }
+
+  ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_flags = (unsigned *)((char *)ring->sq_ring + params.sq_off.flags);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+  // the buffer ring has to be a power of two long and page aligned
+  ring->num_bufs = 1;
+  while (ring->num_bufs < (unsigned)num_bufs){
+    ring->num_bufs <<= 1;
+  }
+  ring->buf_ring_size = ring->num_bufs * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring->buf_ring == MAP_FAILED){
+    ring->buf_ring = NULL;
+    free_uring(ring);
+    return 1;
+  }
+  if ((ring->bufs = malloc((size_t)ring->num_bufs * URING_BUF_SIZE)) == NULL){
+    free_uring(ring);
+    return 1;
+  }
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uintptr_t)ring->buf_ring;
+  reg.ring_entries = ring->num_bufs;
+  reg.bgid = URING_BUF_GROUP;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) != 0){
+    free_uring(ring);
+    return 1;
+  }
+  for (i = 0; i < (int)ring->num_bufs; i++){
+    recycle_buffer(ring, i);
+  }
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+  // the kernel only looks at the name and control lengths of a multishot
+  // receive, the same header is used by every listener
+  ring->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+  ring->recv_msg.msg_controllen = RECV_CMSG_SIZE;
+
+  // every request in a full completion queue may be waiting on a reply
+  ring->num_slots = params.cq_entries;
+  ring->slots = calloc(ring->num_slots, sizeof(*ring->slots));
+  ring->free_slots = calloc(ring->num_slots, sizeof(*ring->free_slots));
+  if (ring->slots == NULL || ring->free_slots == NULL){
+    free_uring(ring);
+    return 1;
+  }
+  for (i = 0; i < ring->num_slots; i++){
+    ring->free_slots[i] = i;
+  }
+  ring->num_free_slots = ring->num_slots;
+  return 0;
+}
+
+
+// closing the ring cancels the outstanding receives
+void free_uring(struct uring *ring){
+  if (ring->fd >= 0){
+    close(ring->fd);
+  }
+  if (ring->sq_ring != NULL){
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->sqes != NULL){
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->buf_ring != NULL){
+    munmap(ring->buf_ring, ring->buf_ring_size);
+  }
+  free(ring->bufs);
+  free(ring->slots);
+  free(ring->free_slots);
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+
+/*
+  the io_uring version of serve_requests. replies are built by the same
+  process_request as the other receive paths, only the way packets reach and
+  leave the server is different.
+
+  Return codes:
+    1 - io_uring could not be used, the caller should serve with epoll instead
+*/
+int serve_requests_uring(struct server_worker *worker){
+  int j;
+  struct uring ring;
+  struct server_settings *s_set = worker->s_set;
+
+  if (initialise_uring(&ring, s_set->uring_entries, s_set->uring_buffers,
+                       s_set->uring_sqpoll) != 0){
+    log_warning("worker %i unable to set up io_uring, using epoll instead",
+                worker->id);
+    return 1;
+  }
+  for (j = 0; j < s_set->num_listeners; j++){
+    if (arm_recv(&ring, worker->sockfds[j], j) != 0){
+      free_uring(&ring);
+      return 1;
+    }
+  }
+
+  while(1){
+    // hand over the replies queued by the last pass and wait for more work
+    if (submit_uring(&ring, 1) != 0){
+      log_error("error while waiting for requests");
+      continue;
+    }
+    if (reap_completions(worker, &ring) != 0){
+      log_warning("worker %i io_uring receive not supported, using epoll "
+                  "instead", worker->id);
+      free_uring(&ring);
+      return 1;
+    }
+  }
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - multishot receive is not supported by this kernel
+*/
+static int reap_completions(struct server_worker *worker, struct uring *ring){
+  int listener;
+  int index;
+  unsigned head;
+  unsigned tail;
+  struct io_uring_cqe *cqe;
+  struct uring_send_slot *slot;
+
+  head = *ring->cq_head;
+  tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++){
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    index = (uint32_t)cqe->user_data;
+
+    if ((cqe->user_data >> 32) == URING_OP_SEND){
+      slot = &ring->slots[index];
+      if (cqe->res < 0){
+        log_warning("error sending reply packet to %s",
+                    inet_ntoa(slot->addr.sin_addr));
+      }
+      else{
+        record_reply_sent(&slot->req);
+        log_debug("succesffuly sent reply packet to %s",
+                  inet_ntoa(slot->addr.sin_addr));
+      }
+      ring->free_slots[ring->num_free_slots++] = index;
+      continue;
+    }
+
+    listener = index;
+    if (cqe->flags & IORING_CQE_F_BUFFER){
+      handle_uring_request(worker, ring, listener,
+                           ring->bufs + (cqe->flags >> IORING_CQE_BUFFER_SHIFT) *
+                           URING_BUF_SIZE, cqe->res);
+      recycle_buffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP){
+      __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+    else if (cqe->res < 0 && cqe->res != -ENOBUFS){
+      errno = -cqe->res;
+      log_error("error while listening for requests: %s", strerror(errno));
+    }
+    // the receive stops when it runs out of buffers or hits an error, the
+    // buffers recycled above are back in the ring before it is rearmed
+    if (!(cqe->flags & IORING_CQE_F_MORE)){
+      arm_recv(ring, worker->sockfds[listener], listener);
+    }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+  return 0;
+}
+
+
+/*
+  a received buffer holds an io_uring_recvmsg_out header followed by the client
+  address, the control messages and the payload, the address and control
+  areas are always as long as asked for in recv_msg
+*/
+static void handle_uring_request(struct server_worker *worker,
+                                 struct uring *ring, int listener, char *buf,
+                                 int len){
+  int slot;
+  char *name;
+  char *control;
+  char *payload;
+  struct msghdr msg;
+  struct timespec request_t_unix;
+  struct sntp_request *client_req;
+  struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+
+  name = buf + sizeof(*out);
+  control = name + ring->recv_msg.msg_namelen;
+  payload = control + ring->recv_msg.msg_controllen;
+  // a buffer has room for more than NTP_MAX_PACKET_LEN after the headers, so
+  // a request that was cut short is still too long for check_packet
+  if (len < payload - buf){
+    log_debug("ignoring a message with no room for its payload");
+    return;
+  }
+
+  if (ring->num_free_slots == 0){
+    log_warning("too many replies queued, dropping request");
+    return;
+  }
+  slot = ring->free_slots[--ring->num_free_slots];
+  client_req = &ring->slots[slot].req;
+
+  memset(&client_req->client.addr, 0, sizeof(client_req->client.addr));
+  memcpy(&client_req->client.addr, name,
+         out->namelen < sizeof(struct sockaddr_in) ?
+         out->namelen : sizeof(struct sockaddr_in));
+  // the request is read where it lies, the buffer is only recycled once the
+  // reply has been made
+  client_req->pkt = (const struct ntp_packet *)payload;
+  client_req->len = out->payloadlen;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = out->controllen;
+  if (get_recv_timestamp(&msg, &request_t_unix) != 0){
+    read_clock_source(&request_t_unix);
+  }
+  client_req->time_of_request = convert_timespec_into_ntp_time(&request_t_unix);
+  client_req->local_addr.s_addr = INADDR_ANY;
+  get_recv_local_addr(&msg, &client_req->local_addr);
+
+  if (process_request(worker, client_req, &ring->slots[slot].pkt) != 0 ||
+      queue_send(ring, worker->sockfds[listener], slot) != 0){
+    ring->free_slots[ring->num_free_slots++] = slot;
+  }
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the submission queue is full
+*/
+static int queue_send(struct uring *ring, int sockfd, int slot){
+  struct io_uring_sqe *sqe;
+  struct uring_send_slot *s = &ring->slots[slot];
+
+  s->addr = s->req.client.addr;
+  s->iov[0].iov_base = &s->pkt;
+  s->iov[0].iov_len = sizeof(struct ntp_packet);
+  s->iov[1].iov_base = s->req.reply_ext;
+  s->iov[1].iov_len = s->req.reply_ext_len;
+  s->iov[2].iov_base = s->req.reply_mac.data;
+  s->iov[2].iov_len = s->req.reply_mac.len;
+  memset(&s->msg, 0, sizeof(s->msg));
+  s->msg.msg_name = &s->addr;
+  s->msg.msg_namelen = sizeof(struct sockaddr_in);
+  s->msg.msg_iov = s->iov;
+  // empty NTS fields and MAC are sent as empty iovecs
+  s->msg.msg_iovlen = 3;
+  // reply from the address the client sent to
+  if (s->req.local_addr.s_addr != INADDR_ANY){
+    set_send_local_addr(&s->msg, s->cmsg_buf, s->req.local_addr);
+  }
+
+  if ((sqe = get_sqe(ring)) == NULL){
+    log_warning("submission queue full, dropping reply to %s",
+                inet_ntoa(s->addr.sin_addr));
+    return 1;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = sockfd;
+  sqe->addr = (uintptr_t)&s->msg;
+  sqe->len = 1;
+  sqe->user_data = URING_USER_DATA(URING_OP_SEND, slot);
+  return 0;
+}
+
+
+/*
+  Return codes:
+    0 - success
+    1 - the submission queue is full
+*/
+static int arm_recv(struct uring *ring, int sockfd, int listener){
+  struct io_uring_sqe *sqe;
+
+  if ((sqe = get_sqe(ring)) == NULL){
+    log_error("submission queue full, unable to listen for requests");
+    return 1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = sockfd;
+  sqe->addr = (uintptr_t)&ring->recv_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_USER_DATA(URING_OP_RECV, listener);
+  return 0;
+}
+
+
+// a full queue is handed to the kernel straight away to make room
+static struct io_uring_sqe *get_sqe(struct uring *ring){
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries){
+    submit_uring(ring, 0);
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries){
+      return NULL;
+    }
+  }
+  index = ring->sq_local_tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+
+// give a buffer back to the kernel, the new tail is published by the caller
+static void recycle_buffer(struct uring *ring, unsigned short bid){
+  struct io_uring_buf *buf;
+
+  buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->num_bufs - 1)];
+  buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+}
+
+
+/*
+  submits everything queued and, when wait is set, blocks until at least one
+  completion is ready. with SQPOLL the kernel thread picks up the queue by
+  itself and a system call is only needed to wake it or to wait.
+
+  Return codes:
+    0 - success
+    1 - error entering the ring
+*/
+static int submit_uring(struct uring *ring, int wait){
+  unsigned flags = 0;
+  unsigned to_submit;
+
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  if (ring->sqpoll){
+    to_submit = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+        IORING_SQ_NEED_WAKEUP){
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+  }
+  else{
+    to_submit = ring->sq_local_tail - *ring->sq_head;
+  }
+  if (wait){
+    flags |= IORING_ENTER_GETEVENTS;
+  }
+  if (to_submit == 0 && flags == 0){
+    return 0;
+  }
+
+  if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, flags,
+              NULL, 0) < 0 && errno != EINTR && errno != EAGAIN &&
+      errno != EBUSY){
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef SNTPURING_H
+#define SNTPURING_H
+
+#include "sntpserver.h"
+#include <linux/io_uring.h>
+
+/*
+  io_uring engine for the server. Each worker arms one multishot recvmsg per
+  listener socket, the kernel then keeps picking buffers from a ring of
+  provided buffers and posts a completion for every request that arrives.
+  Replies are queued as sendmsg submissions and everything queued in a pass
+  over the completion queue goes to the kernel in the same io_uring_enter that
+  waits for the next requests, so a busy server makes roughly one system call
+  per batch of requests instead of two per request.
+*/
+
+// space for the recvmsg header, client address, control messages and payload
+// of one request, the payload can be up to NTP_MAX_PACKET_LEN long. anything
+// longer is truncated and rejected.
+#define URING_BUF_SIZE 2048
+// buffer group every listener of a worker takes its receive buffers from
+#define URING_BUF_GROUP 0
+
+// a reply waiting for its sendmsg to complete
+struct uring_send_slot{
+  struct msghdr msg;
+  struct iovec iov[3]; // the reply, NTS fields and MAC
+  struct sockaddr_in addr;
+  struct ntp_packet pkt;
+  char cmsg_buf[SEND_CMSG_SIZE];
+  // kept for recording the transmit time, its pkt points into a receive
+  // buffer that has been recycled by then
+  struct sntp_request req;
+};
+
+struct uring{
+  int fd;
+  int sqpoll; // a kernel thread is submitting for us
+  // submission queue
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_flags;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sq_local_tail; // includes entries not yet given to the kernel
+  struct io_uring_sqe *sqes;
+  // completion queue
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  // mappings to undo on teardown, both queues share sq_ring
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t sqes_size;
+  // provided receive buffers
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_size;
+  char *bufs;
+  unsigned num_bufs;
+  unsigned short buf_tail;
+  // the name and control lengths every multishot receive fills in
+  struct msghdr recv_msg;
+  // replies in flight
+  struct uring_send_slot *slots;
+  int num_slots;
+  int *free_slots;
+  int num_free_slots;
+};
+
+
+int initialise_uring(struct uring *ring, int entries, int num_bufs, int sqpoll);
+void free_uring(struct uring *ring);
+int serve_requests_uring(struct server_worker *worker);
+
+#endif